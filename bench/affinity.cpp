@@ -0,0 +1,149 @@
+/**
+ * Benchmark of the placement of thread_pool workers on NUMA nodes.
+ *
+ * Each simulated image is a task which allocates and fills a buffer of
+ * decoded pixels (so the memory is first touched on the node of the task),
+ * and submits a task per variant that reads the whole buffer and writes a
+ * smaller one, like the resize tasks of the server. Reports images per
+ * second with the workers not pinned, pinned to nodes and pinned to cores.
+ * Placing the workers on nodes keeps the variant tasks on the node that holds
+ * the pixels, which shows on machines with several sockets. The topology can
+ * be simulated by splitting the CPUs into nodes, which shows the effect of
+ * pinning on the caches even on a single socket.
+ *
+ * Here the tasks touch the pixels themselves. In the server, most of that is
+ * done by libvips threads, which aren't pinned, so this is the upper bound of
+ * the effect.
+ *
+ * Usage: bench-affinity <threads> <images> [<simulated nodes>]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+#include "../src/cpu_affinity.hpp"
+#include "../src/thread_pool.hpp"
+#include "../src/utils.hpp"
+
+/** Decoded size of a simulated image */
+static constexpr std::size_t IMAGE_SIZE = 16 * 1024 * 1024;
+static constexpr unsigned VARIANTS = 6;
+
+struct images_done
+{
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned remaining;
+  std::atomic<std::uint64_t> checksum{ 0 };
+
+  void finish_one()
+  {
+    std::lock_guard lock(mutex);
+    if (--remaining == 0)
+      cv.notify_one();
+  }
+
+  void wait()
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [this] { return remaining == 0; });
+  }
+};
+
+struct image
+{
+  std::vector<std::uint8_t> pixels;
+  std::atomic<unsigned> variants_left{ VARIANTS };
+};
+
+/** Downscale the pixels by the factor, touching all of them */
+std::uint64_t
+resize(std::vector<std::uint8_t> const& pixels, std::size_t factor)
+{
+  std::vector<std::uint8_t> out(pixels.size() / factor);
+  for (std::size_t i = 0; i < out.size(); i++) {
+    unsigned sum = 0;
+    for (std::size_t j = 0; j < factor; j++)
+      sum += pixels[i * factor + j];
+    out[i] = sum / factor;
+  }
+  return std::accumulate(out.begin(), out.end(), std::uint64_t(0));
+}
+
+void
+process_image(thread_pool& pool, images_done& done)
+{
+  auto img = std::make_shared<image>();
+  img->pixels.resize(IMAGE_SIZE);
+  for (std::size_t i = 0; i < IMAGE_SIZE; i++)
+    img->pixels[i] = i * 31;
+
+  for (unsigned v = 0; v < VARIANTS; v++) {
+    pool.add_task([img, v, &done] {
+      done.checksum += resize(img->pixels, std::size_t(1) << v);
+      if (img->variants_left.fetch_sub(1) == 1)
+        done.finish_one();
+    });
+  }
+}
+
+double
+run(unsigned threads,
+    unsigned images,
+    std::vector<worker_placement> placements)
+{
+  images_done done;
+  done.remaining = images;
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    thread_pool pool(threads, { stage_options("default") }, placements);
+    for (unsigned i = 0; i < images; i++)
+      pool.add_task([&] { process_image(pool, done); });
+    done.wait();
+  }
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return images / elapsed.count();
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <threads> <images> [<simulated nodes>]" << std::endl;
+    return 1;
+  }
+  unsigned threads = string_view_to_int(argv[1]);
+  unsigned images = string_view_to_int(argv[2]);
+
+  auto topology = cpu_topology::detect();
+  if (argc > 3)
+    topology = topology.simulate(string_view_to_int(argv[3]));
+
+  std::cout << "threads: " << threads << ", images: " << images
+            << ", nodes:";
+  for (auto const& node : topology.nodes)
+    std::cout << " " << node.size() << " CPUs";
+  std::cout << std::endl;
+
+  for (auto [name, mode] : { std::pair{ "none", worker_affinity::none },
+                             std::pair{ "node", worker_affinity::node },
+                             std::pair{ "core", worker_affinity::core } }) {
+    // the first run warms up the allocator
+    run(threads, images, place_workers(topology, mode, threads));
+    double per_sec =
+      run(threads, images, place_workers(topology, mode, threads));
+    std::cout << "affinity.workers=" << name << ": " << per_sec
+              << " images/s" << std::endl;
+  }
+  return 0;
+}
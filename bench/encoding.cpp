@@ -0,0 +1,101 @@
+/**
+ * Benchmark of the encoder presets (encode.* in the config file).
+ *
+ * For every given image, this resizes it to each size from the given config
+ * file, and encodes every variant to each configured output format, once with
+ * the libvips defaults and once with the configured preset. For each, it
+ * reports the encoding time and the size of the result, so that you can see
+ * where the presets save bytes, and how much CPU they cost.
+ *
+ * Usage: bench-encoding <config file> <iterations> <image>...
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <vips/vips8>
+
+#include "../src/config.hpp"
+#include "../src/utils.hpp"
+
+std::vector<std::uint8_t>
+read_file(char const* path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Failed to open " + std::string(path));
+  return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+struct encode_result
+{
+  double millis;
+  std::size_t bytes;
+};
+
+encode_result
+encode(vips::VImage const& image,
+       std::string const& suffix,
+       unsigned iterations)
+{
+  std::size_t length = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < iterations; i++) {
+    void* buffer;
+    image.write_to_buffer(suffix.c_str(), &buffer, &length);
+    g_free(buffer);
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return { elapsed.count() / iterations, length };
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " <config file> <iterations> <image>..." << std::endl;
+    return 1;
+  }
+
+  if (VIPS_INIT(argv[0]))
+    throw std::runtime_error("Failed to initialize libvips");
+  // every iteration must do the full work
+  vips_cache_set_max(0);
+
+  config cfg = config::parse(argv[1]);
+  unsigned iterations = string_view_to_int(argv[2]);
+
+  std::cout << "image\tformat\twidth\tdefault ms\tdefault bytes\tpreset ms"
+               "\tpreset bytes\tpreset"
+            << std::endl;
+  for (int i = 3; i < argc; i++) {
+    std::string input_format(get_extension(argv[i]));
+    if (input_format == "jpg")
+      input_format = "jpeg";
+
+    auto data = read_file(argv[i]);
+    auto original =
+      vips::VImage::new_from_buffer(data.data(), data.size(), nullptr);
+    for (auto size : cfg.get_sizes(original.width())) {
+      // the resized image is computed once, only encoding is measured
+      auto resized = original.thumbnail_image(size).copy_memory();
+      for (auto const& format : cfg.get_formats(input_format)) {
+        auto preset = cfg.get_save_suffix(format, size);
+        auto defaults = encode(resized, "." + format, iterations);
+        auto configured = encode(resized, preset, iterations);
+        std::cout << argv[i] << "\t" << format << "\t" << size << "\t"
+                  << std::fixed << std::setprecision(1) << defaults.millis
+                  << "\t" << defaults.bytes << "\t" << configured.millis
+                  << "\t" << configured.bytes << "\t" << preset << std::endl;
+      }
+    }
+  }
+
+  vips_shutdown();
+  return 0;
+}
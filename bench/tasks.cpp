@@ -0,0 +1,234 @@
+/**
+ * Benchmark of task submission overhead of thread_pool and task_group.
+ *
+ * Runs chains of empty tasks, where each task submits the next one (like the
+ * resize tasks of the server submit encode tasks), capturing a shared_ptr like
+ * the server's tasks do. Reports tasks per second and heap allocations per
+ * task, for the thread_pool, for a task_group on top of it, and for a
+ * std::function + std::deque queue (how thread_pool worked before task_node)
+ * as the baseline.
+ *
+ * Usage: bench-tasks <threads> <tasks>
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "../src/thread_pool.hpp"
+#include "../src/utils.hpp"
+
+static std::atomic<std::uint64_t> allocations{ 0 };
+
+void*
+operator new(std::size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void
+operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+/** The previous thread_pool queue, for comparison */
+class function_pool
+{
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> threads;
+  bool shutdown = false;
+
+public:
+  function_pool(unsigned n)
+  {
+    for (unsigned i = 0; i < n; i++) {
+      threads.emplace_back([this] {
+        while (true) {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [this] { return !tasks.empty() || shutdown; });
+          if (shutdown)
+            break;
+          auto task = std::move(tasks.front());
+          tasks.pop_front();
+          lock.unlock();
+          task();
+        }
+      });
+    }
+  }
+
+  void add_task(std::function<void()>&& task)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+    cv.notify_one();
+  }
+
+  ~function_pool()
+  {
+    {
+      std::lock_guard lock(mutex);
+      shutdown = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+      t.join();
+  }
+};
+
+/** Counts down finished chains, and lets the main thread wait for all */
+struct chains_done
+{
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned remaining;
+
+  void finish_one()
+  {
+    std::lock_guard lock(mutex);
+    if (--remaining == 0)
+      cv.notify_one();
+  }
+
+  void wait()
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [this] { return remaining == 0; });
+  }
+};
+
+/** A task which submits its successor, until the chain is long enough */
+template<typename Submitter>
+struct chain_step
+{
+  Submitter* submitter;
+  std::shared_ptr<chains_done> done;
+  unsigned left;
+
+  void operator()() const
+  {
+    if (left == 0) {
+      done->finish_one();
+      return;
+    }
+    submitter->add_task(chain_step{ submitter, done, left - 1 });
+  }
+};
+
+struct bench_result
+{
+  double tasks_per_sec;
+  double allocations_per_task;
+};
+
+template<typename Submitter>
+bench_result
+run_chains(Submitter& submitter, unsigned chains, unsigned tasks)
+{
+  auto done = std::make_shared<chains_done>();
+  done->remaining = chains;
+  unsigned per_chain = tasks / chains;
+
+  auto allocations_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < chains; i++)
+    submitter.add_task(chain_step<Submitter>{ &submitter, done, per_chain });
+  done->wait();
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  auto allocated = allocations.load() - allocations_before;
+
+  double total = double(per_chain + 1) * chains;
+  return { total / elapsed.count(), allocated / total };
+}
+
+/** Submits through a task_group, as the image processor does */
+struct group_submitter
+{
+  task_group* group;
+
+  template<typename Fn>
+  void add_task(Fn&& task)
+  {
+    group->add_task(std::forward<Fn>(task));
+  }
+};
+
+template<typename Fn>
+void
+report(char const* name, Fn&& run)
+{
+  // the first run fills the freelists, like a server that is already running
+  run();
+  auto result = run();
+  std::cout << name << ": " << result.tasks_per_sec << " tasks/s, "
+            << result.allocations_per_task << " allocations/task"
+            << std::endl;
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <threads> <tasks>" << std::endl;
+    return 1;
+  }
+  unsigned threads = string_view_to_int(argv[1]);
+  unsigned tasks = string_view_to_int(argv[2]);
+  unsigned chains = threads * 4;
+
+  std::cout << "threads: " << threads << ", tasks: " << tasks << std::endl;
+
+  {
+    function_pool pool(threads);
+    report("std::function queue (baseline)",
+           [&] { return run_chains(pool, chains, tasks); });
+  }
+  {
+    thread_pool pool(threads);
+    report("thread_pool", [&] { return run_chains(pool, chains, tasks); });
+  }
+  {
+    thread_pool pool(threads);
+    report("task_group", [&] {
+      // the group finishes when all its tasks do, so each run needs a new one
+      std::promise<void> finished;
+      task_group group(
+        pool, [](std::exception const&) {}, [&] { finished.set_value(); });
+      group_submitter submitter{ &group };
+      // keeps the group running even if the first chain ends before the
+      // others are submitted
+      group.defer_task();
+      auto result = run_chains(submitter, chains, tasks);
+      group.add_deferred_task([] {});
+      // the last task still uses the group after finishing its chain
+      finished.get_future().wait();
+      return result;
+    });
+  }
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * Benchmark of the split between thread_pool width and libvips concurrency.
+ *
+ * For every split pool_size * vips_concurrency = number of cores, this runs
+ * the resize + encode work that the server would do for each given image
+ * (using sizes and formats from the given config file), and reports the
+ * throughput. Use the best split as thread_pool_size and vips_concurrency in
+ * your configuration.
+ *
+ * Usage: bench-threading <config file> <iterations> <image>...
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <vips/vips8>
+
+#include "../src/config.hpp"
+#include "../src/thread_pool.hpp"
+#include "../src/utils.hpp"
+
+struct bench_image
+{
+  std::vector<std::uint8_t> data;
+  std::string format;
+};
+
+std::vector<std::uint8_t>
+read_file(char const* path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Failed to open " + std::string(path));
+  return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+void
+process_one(config const& cfg, bench_image const& image)
+{
+  auto original = vips::VImage::new_from_buffer(
+    image.data.data(), image.data.size(), nullptr);
+  for (auto size : cfg.get_sizes(original.width())) {
+    auto resized = original.thumbnail_image(size);
+    for (auto const& format : cfg.get_formats(image.format)) {
+      void* buffer;
+      size_t length;
+      auto suffix = cfg.get_save_suffix(format, size);
+      resized.write_to_buffer(suffix.c_str(), &buffer, &length);
+      g_free(buffer);
+    }
+  }
+}
+
+double
+run_split(config const& cfg,
+          std::vector<bench_image> const& images,
+          unsigned iterations,
+          unsigned pool_size,
+          unsigned vips_threads)
+{
+  vips_concurrency_set(vips_threads);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned remaining = iterations * images.size();
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    thread_pool pool(pool_size);
+    for (unsigned i = 0; i < iterations; i++) {
+      for (auto const& image : images) {
+        pool.add_task([&] {
+          process_one(cfg, image);
+          std::lock_guard lock(mutex);
+          if (--remaining == 0)
+            cv.notify_one();
+        });
+      }
+    }
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return remaining == 0; });
+  }
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  return iterations * images.size() / elapsed.count();
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " <config file> <iterations> <image>..." << std::endl;
+    return 1;
+  }
+
+  if (VIPS_INIT(argv[0]))
+    throw std::runtime_error("Failed to initialize libvips");
+  // every iteration must do the full work
+  vips_cache_set_max(0);
+
+  config cfg = config::parse(argv[1]);
+  unsigned iterations = string_view_to_int(argv[2]);
+
+  std::vector<bench_image> images;
+  for (int i = 3; i < argc; i++) {
+    std::string format(get_extension(argv[i]));
+    if (format == "jpg")
+      format = "jpeg";
+    images.push_back({ read_file(argv[i]), format });
+  }
+
+  unsigned cores = config::get_core_count();
+  std::cout << "cores: " << cores << ", images: " << images.size()
+            << ", iterations: " << iterations << std::endl;
+  for (unsigned vips_threads = 1; vips_threads <= cores; vips_threads *= 2) {
+    unsigned pool_size = std::max(1u, cores / vips_threads);
+    double per_sec =
+      run_split(cfg, images, iterations, pool_size, vips_threads);
+    std::cout << "thread_pool_size=" << pool_size
+              << " vips_concurrency=" << vips_threads << ": " << per_sec
+              << " images/s" << std::endl;
+  }
+
+  vips_shutdown();
+  return 0;
+}
@@ -0,0 +1,478 @@
+#ifndef BACKFILL_HPP
+#define BACKFILL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <vips/vips8>
+
+#include "config.hpp"
+#include "image_processing.hpp"
+#include "logger.hpp"
+#include "memory_budget.hpp"
+#include "server_state.hpp"
+#include "utils.hpp"
+
+/** The sizes and formats config, in a form that changes when they change */
+std::string
+variants_fingerprint(config const& cfg)
+{
+  std::string result = "sizes=";
+  for (auto const& spec : cfg.sizes.specs) {
+    result += std::to_string(spec.fixed_value);
+    if (spec.decrement)
+      result += ":" + std::to_string(spec.decrement) +
+                (spec.decrement_is_pct ? "%" : "px");
+    result += ",";
+  }
+  // sorted, the order of an unordered_map may differ between runs
+  std::map<std::string, std::vector<std::string>> formats(cfg.formats.begin(),
+                                                          cfg.formats.end());
+  for (auto const& [from, to] : formats) {
+    result += " formats." + from + "=";
+    for (auto const& format : to)
+      result += format + ",";
+  }
+  return result;
+}
+
+/** How far the backfill got, saved in backfill_config::progress_file */
+struct backfill_progress
+{
+  /** variants_fingerprint of the config the backfill works towards */
+  std::string fingerprint;
+  /** Folders up to this name (inclusive) were tried */
+  std::string last_folder;
+  /** All folders are done */
+  bool complete = false;
+  /** Folders up to last_folder that failed, and are tried again */
+  std::set<std::string> failed;
+
+  /** Read the progress, a missing file is no progress */
+  static backfill_progress load(std::filesystem::path const& path)
+  {
+    backfill_progress result;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      auto pos = line.find('=');
+      if (pos == std::string::npos)
+        throw std::runtime_error("Invalid line in " + path.string());
+      auto key = std::string_view(line).substr(0, pos);
+      auto value = std::string_view(line).substr(pos + 1);
+      if (key == "fingerprint")
+        result.fingerprint = value;
+      else if (key == "last_folder")
+        result.last_folder = value;
+      else if (key == "complete")
+        result.complete = parse_bool(value);
+      else if (key == "failed")
+        result.failed.emplace(value);
+    }
+    return result;
+  }
+
+  /** Write the progress, replacing the file atomically */
+  void save(std::filesystem::path const& path) const
+  {
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::trunc);
+      file << "fingerprint=" << fingerprint << "\n"
+           << "last_folder=" << last_folder << "\n"
+           << "complete=" << (complete ? "true" : "false") << "\n";
+      for (auto const& name : failed)
+        file << "failed=" << name << "\n";
+      if (!file)
+        throw std::runtime_error("Failed to write " + temp_path.string());
+    }
+    std::filesystem::rename(temp_path, path);
+  }
+};
+
+/** A stored image, as found in its folder (see image_processor) */
+struct stored_image
+{
+  /** File name of the original, e.g. photo.jpeg */
+  std::string original;
+  /** Name shared by the original and the variants, e.g. photo */
+  std::string filename;
+  /** Format of the original, e.g. jpeg */
+  std::string format;
+
+  struct variant
+  {
+    /** Name of the folder of the variant, e.g. 256x192 */
+    std::string folder;
+    std::set<std::string> formats;
+  };
+  /** Stored variants by width */
+  std::map<dimension_t, variant> variants;
+
+  /** Read the stored image from the entries of its folder */
+  static stored_image parse(std::vector<folder_entry> const& entries)
+  {
+    stored_image result;
+    for (auto const& entry : entries) {
+      if (entry.children)
+        continue;
+      if (!result.original.empty())
+        throw std::runtime_error("Multiple files in the root of the folder");
+      result.original = entry.name;
+    }
+    if (result.original.empty())
+      throw std::runtime_error("No original file in the folder");
+    result.filename = get_filename_without_extension(result.original);
+    result.format = get_extension(result.original);
+
+    for (auto const& entry : entries) {
+      if (!entry.children)
+        continue;
+      dimensions_spec spec;
+      spec.width_height_from_string(entry.name);
+      auto& stored = result.variants[spec.width];
+      stored.folder = entry.name;
+      for (auto const& file : *entry.children)
+        stored.formats.insert(std::string(get_extension(file.name)));
+    }
+    return result;
+  }
+
+  /**
+   * Formats of each variant the config asks for that aren't stored, for an
+   * original of the given width
+   */
+  std::map<dimension_t, std::vector<std::string>> missing_variants(
+    config const& cfg,
+    dimension_t original_width) const
+  {
+    std::map<dimension_t, std::vector<std::string>> result;
+    auto formats = cfg.get_formats(format);
+    for (auto width : cfg.get_sizes(original_width)) {
+      auto stored = variants.find(width);
+      for (auto const& f : formats) {
+        if (stored == variants.end() || !stored->second.formats.count(f))
+          result[width].push_back(f);
+      }
+    }
+    return result;
+  }
+};
+
+/**
+ * Creates the variants missing from the stored folders on a background thread.
+ * The folders are processed in order of their names, and the last one tried is
+ * saved to the progress file together with the sizes and formats the backfill
+ * works towards (see variants_fingerprint), so a restarted server continues
+ * where it stopped, and starts over only when they change again. Folders that
+ * failed are saved too, and tried again by the next run.
+ *
+ * The thread only lists and reads the folders, the variants of each image are
+ * created by a task in the backfill stage of the pool, which by default has
+ * the lowest priority and runs one task at a time within the cap of the
+ * processing stage, so the backfill only uses threads that uploads leave idle.
+ * The new variants of a folder are added to it at once with
+ * storage_backend::extend_folder. Existing files are never replaced, so a
+ * change of encoder options doesn't re-encode stored variants.
+ *
+ * The memory of decoding an image is reserved from the memory budget like for
+ * an upload, and with claim_dir set, a folder claimed by another process is
+ * skipped, so that processes sharing the storage don't backfill it twice.
+ */
+class backfill_job
+{
+private:
+  server_state state;
+  backfill_config const& settings;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+  std::thread worker;
+
+  bool wait_until(std::chrono::steady_clock::time_point time)
+  {
+    std::unique_lock lock(mutex);
+    return !cv.wait_until(lock, time, [this] { return stopping; });
+  }
+
+  bool is_stopping()
+  {
+    std::lock_guard lock(mutex);
+    return stopping;
+  }
+
+  /**
+   * Reserve memory for processing the image, returns false if the folder
+   * should be skipped
+   */
+  bool reserve_memory(memory_budget::reservation& memory, std::uint64_t size)
+  {
+    while (true) {
+      std::promise<memory_budget::grow_result> grown;
+      auto result = grown.get_future();
+      state.memory.grow(
+        memory, size, [&grown](auto r) { grown.set_value(r); });
+      switch (result.get()) {
+        case memory_budget::grow_result::granted:
+          return true;
+        case memory_budget::grow_result::too_large:
+          return false;
+        case memory_budget::grow_result::busy:
+          // the uploads go first, try again once they had some time
+          if (!wait_until(std::chrono::steady_clock::now() +
+                          std::chrono::seconds(1)))
+            return false;
+      }
+    }
+  }
+
+  /** Create the missing variants of the image into the staged folder */
+  void create_variants(
+    stored_image const& image,
+    std::vector<std::uint8_t> const& data,
+    image_header const& header,
+    std::map<dimension_t, std::vector<std::string>> const& missing,
+    staged_folder& folder)
+  {
+    auto const& cfg = state.server_config;
+    bool animated = header.pages > 1 && supports_animation(image.format);
+    // all frames of an animated image, stacked vertically
+    auto options = animated ? "n=-1" : "";
+    auto blob = vips_blob_new(nullptr, data.data(), data.size());
+
+    try {
+      for (auto const& [width, formats] : missing) {
+        auto resized = apply_metadata_policy(
+          cfg.metadata,
+          vips::VImage::thumbnail_buffer(
+            blob, width, thumbnail_options(cfg.metadata, options)));
+        auto height = animated ? vips_image_get_page_height(resized.get_image())
+                               : resized.height();
+
+        auto stored = image.variants.find(width);
+        std::string folder_name;
+        if (stored != image.variants.end()) {
+          folder_name = stored->second.folder;
+        } else {
+          folder_name = std::to_string(width) + "x" + std::to_string(height);
+          folder.create_folder(folder_name);
+        }
+
+        for (auto const& format : formats) {
+          auto suffix = cfg.get_save_suffix(format, width);
+          void* buffer;
+          size_t size;
+          if (animated && !supports_animation(format))
+            resized.extract_area(0, 0, resized.width(), height)
+              .write_to_buffer(suffix.c_str(), &buffer, &size);
+          else
+            resized.write_to_buffer(suffix.c_str(), &buffer, &size);
+          folder.create_file(folder_name + "/" + image.filename + "." + format,
+                             static_cast<std::uint8_t*>(buffer),
+                             size);
+          g_free(buffer);
+          state.metrics.backfill_variants.fetch_add(1);
+        }
+      }
+    } catch (...) {
+      vips_area_unref(VIPS_AREA(blob));
+      throw;
+    }
+    vips_area_unref(VIPS_AREA(blob));
+  }
+
+  /** Check one folder, and extend it with the missing variants if needed */
+  void backfill_folder(std::string const& name)
+  {
+    auto& storage = *state.server_config.storage;
+    auto entries = storage.walk_folder(name);
+    if (!entries)
+      return;
+    auto image = stored_image::parse(*entries);
+
+    // the variants to create depend on the width of the original, which
+    // needs its header
+    auto data = storage.read_file(name, image.original);
+    if (!data)
+      throw std::runtime_error("Failed to read " + image.original);
+    image_header header;
+    try {
+      header = read_header(vips::VImage::new_from_buffer(
+        data->data(),
+        data->size(),
+        "",
+        vips::VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL)));
+    } catch (vips::VError const& e) {
+      throw std::runtime_error(std::string("Failed to load image: ") +
+                               e.what());
+    }
+    if (header.pixels() > state.server_config.max_image_pixels)
+      return;
+    auto missing = image.missing_variants(state.server_config, header.width);
+    if (missing.empty())
+      return;
+
+    std::unique_ptr<claim_registry::claim> claim;
+    if (state.claims) {
+      auto [status, acquired] = state.claims->try_claim(name);
+      if (status == claim_registry::claim_status::held)
+        return;
+      claim = std::move(acquired);
+    }
+
+    std::vector<dimension_t> widths;
+    for (auto const& [width, _] : missing)
+      widths.push_back(width);
+    memory_budget::reservation memory;
+    if (!reserve_memory(memory, estimate_variants_memory(header, widths)))
+      throw std::runtime_error("Not enough memory to process the image");
+
+    auto folder = storage.create_staged_folder(name);
+    std::promise<void> done;
+    auto result = done.get_future();
+    state.pool.add_task(state.stages.backfill, [&] {
+      try {
+        create_variants(image, *data, header, missing, *folder);
+        done.set_value();
+      } catch (...) {
+        done.set_exception(std::current_exception());
+      }
+    });
+    try {
+      result.get();
+    } catch (vips::VError const& e) {
+      throw std::runtime_error(std::string("Failed to create variants: ") +
+                               e.what());
+    }
+    storage.extend_folder(*folder);
+    // responses to uploads of the image list the new variants from now on
+    if (state.responses)
+      state.responses->remove(name);
+    state.metrics.backfill_extended.fetch_add(1);
+  }
+
+  void run()
+  {
+    std::filesystem::path progress_path = settings.progress_file;
+    auto fingerprint = variants_fingerprint(state.server_config);
+    auto progress = backfill_progress::load(progress_path);
+    if (progress.fingerprint != fingerprint)
+      progress = { fingerprint, "", false, {} };
+    if (progress.complete)
+      return;
+
+    auto listed = state.server_config.storage->list_folders();
+    std::vector<std::string> names;
+    for (auto& folder : listed)
+      if (folder.name > progress.last_folder ||
+          progress.failed.count(folder.name))
+        names.push_back(std::move(folder.name));
+    std::sort(names.begin(), names.end());
+    // failed folders which were deleted since
+    std::erase_if(progress.failed, [&](auto const& name) {
+      return !std::binary_search(names.begin(), names.end(), name);
+    });
+    state.metrics.backfill_remaining = names.size();
+    log_info("Backfilling variants of ", names.size(), " stored images");
+
+    auto interval =
+      settings.max_folders_per_sec
+        ? std::chrono::steady_clock::duration(std::chrono::seconds(1)) /
+            settings.max_folders_per_sec
+        : std::chrono::steady_clock::duration::zero();
+    auto next = std::chrono::steady_clock::now();
+    auto last_save = next;
+    for (auto const& name : names) {
+      if (!wait_until(next))
+        break;
+      next += interval;
+
+      try {
+        backfill_folder(name);
+        progress.failed.erase(name);
+      } catch (std::exception const& e) {
+        // stopped while waiting for memory, the folder isn't done
+        if (is_stopping())
+          break;
+        log_warning("Failed to backfill ", name, ": ", e.what());
+        state.metrics.backfill_failed.fetch_add(1);
+        progress.failed.insert(name);
+      }
+      state.metrics.backfill_remaining.fetch_sub(1);
+      progress.last_folder = std::max(progress.last_folder, name);
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_save >= std::chrono::seconds(1)) {
+        progress.save(progress_path);
+        last_save = now;
+      }
+      // a slow folder doesn't allow a burst of the following ones
+      next = std::max(next, now);
+    }
+
+    progress.complete = !is_stopping() && progress.failed.empty();
+    progress.save(progress_path);
+    if (progress.complete)
+      log_info("Backfill of variants is complete");
+    else if (!is_stopping())
+      log_warning("Backfill of ",
+                  progress.failed.size(),
+                  " stored images failed, they are tried again on restart");
+  }
+
+public:
+  backfill_job(server_state state, backfill_config const& settings)
+    : state(state)
+    , settings(settings)
+  {
+  }
+
+  backfill_job(backfill_job const&) = delete;
+  backfill_job& operator=(backfill_job const&) = delete;
+
+  ~backfill_job() { stop(); }
+
+  /** Start the background thread, if the backfill is enabled */
+  void start()
+  {
+    if (!settings.enabled)
+      return;
+    worker = std::thread([this] {
+      try {
+        run();
+      } catch (std::exception const& e) {
+        log_error("Backfill of variants stopped: ", e.what());
+      }
+    });
+  }
+
+  /** Stop after the folder being processed, the progress is saved */
+  void stop()
+  {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+};
+
+#endif // BACKFILL_HPP
@@ -0,0 +1,372 @@
+#ifndef CLAIMS_HPP
+#define CLAIMS_HPP
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.hpp"
+
+/**
+ * Deduplication of concurrent uploads of the same image across several server
+ * processes sharing one storage. The currently_processing map in server_state
+ * does the same within a single process.
+ *
+ * A process that starts processing an image claims it by creating the file
+ * <claim_dir>/<hash>.claim and holding an exclusive flock on it. When the
+ * processing is done, the file is deleted. Other processes which find the
+ * claim held don't process the image, but wait until the file is deleted
+ * (they are notified through inotify), and then find the stored result.
+ *
+ * The kernel releases the lock when the holder exits, so claims of crashed
+ * processes don't block anyone: their files stay, but can be claimed again.
+ * These are picked up by periodic rechecks, since no deletion is reported for
+ * them. A claim held for longer than claim_timeout_secs is considered stale
+ * (e.g. the holder hangs), and is taken over: a fresh claim file is locked and
+ * renamed over the stale one, so that other processes find the new claim held.
+ * Takeovers and releases hold a lock on <claim_dir>/.lock, so that a release
+ * doesn't delete the file of a claim that took it over, and only one process
+ * takes over each stale claim.
+ *
+ * claim_dir must be on a local filesystem, flock is not reliable on NFS.
+ */
+class claim_registry
+{
+public:
+  /** An acquired claim, released when this is destroyed */
+  class claim
+  {
+    friend class claim_registry;
+
+  private:
+    std::filesystem::path path;
+    int fd;
+
+    claim(std::filesystem::path path, int fd)
+      : path(std::move(path))
+      , fd(fd)
+    {
+    }
+
+  public:
+    claim(claim const&) = delete;
+    claim& operator=(claim const&) = delete;
+
+    ~claim()
+    {
+      // unlink while still holding the lock, so that nobody can lock the
+      // file between the unlock and the unlink (see try_claim). The claim
+      // may have been taken over, then the file belongs to the new holder
+      try {
+        directory_lock lock(path.parent_path());
+        if (is_linked(fd, path))
+          ::unlink(path.c_str());
+      } catch (std::exception const& e) {
+        log_error("Failed to release claim ", path.string(), ": ", e.what());
+      }
+      ::close(fd);
+    }
+  };
+
+  enum class claim_status
+  {
+    /** We hold the claim now */
+    acquired,
+    /** Another process holds the claim */
+    held,
+    /** Another process held the claim for too long, we took it over */
+    taken_over,
+  };
+
+private:
+  /**
+   * Exclusive lock of the claim directory, taken for takeovers and releases.
+   * The file is opened for every lock, because flock doesn't exclude threads
+   * sharing one open file.
+   */
+  class directory_lock
+  {
+    int fd;
+
+  public:
+    explicit directory_lock(std::filesystem::path const& dir)
+    {
+      auto path = dir / ".lock";
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0)
+        throw std::runtime_error("Failed to open " + path.string() + ": " +
+                                 std::strerror(errno));
+      while (::flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+          int error = errno;
+          ::close(fd);
+          throw std::runtime_error("Failed to lock " + path.string() + ": " +
+                                   std::strerror(error));
+        }
+      }
+    }
+
+    directory_lock(directory_lock const&) = delete;
+    directory_lock& operator=(directory_lock const&) = delete;
+
+    ~directory_lock() { ::close(fd); }
+  };
+
+  /** Whether the path still refers to the open file */
+  static bool is_linked(int fd, std::filesystem::path const& path)
+  {
+    struct stat opened, current;
+    return ::fstat(fd, &opened) == 0 && ::stat(path.c_str(), &current) == 0 &&
+           opened.st_ino == current.st_ino && opened.st_dev == current.st_dev;
+  }
+
+  /**
+   * Replace the stale claim file open as stale_fd with a fresh claim, unless
+   * someone else has already replaced or released it. Returns the locked fd
+   * of the new claim, or -1.
+   */
+  int take_over(std::filesystem::path const& path, int stale_fd)
+  {
+    directory_lock lock(claim_dir);
+    if (!is_linked(stale_fd, path))
+      return -1;
+
+    // only one takeover runs at a time, so the temporary name is free, unless
+    // a process crashed during a takeover
+    auto fresh = path;
+    fresh += ".takeover";
+    ::unlink(fresh.c_str());
+    int fd =
+      ::open(fresh.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create claim file " +
+                               fresh.string() + ": " + std::strerror(errno));
+    if (::flock(fd, LOCK_EX | LOCK_NB) != 0 ||
+        ::rename(fresh.c_str(), path.c_str()) != 0) {
+      int error = errno;
+      ::unlink(fresh.c_str());
+      ::close(fd);
+      throw std::runtime_error("Failed to take over claim file " +
+                               path.string() + ": " + std::strerror(error));
+    }
+    return fd;
+  }
+
+  std::filesystem::path claim_dir;
+  std::chrono::seconds stale_after;
+
+  /** Waiters are rechecked this often, even if no deletion was reported */
+  static constexpr int RECHECK_INTERVAL_MS = 1000;
+
+  std::mutex waiters_mutex;
+  std::unordered_map<std::string, std::vector<std::function<void()>>> waiters;
+
+  int inotify_fd = -1;
+  int wake_fd = -1;
+  std::thread watcher;
+
+  std::filesystem::path claim_path(std::string const& hash) const
+  {
+    return claim_dir / (hash + ".claim");
+  }
+
+  /** Call and remove the waiters of the hash, or of all hashes if null */
+  void notify(std::string const* hash)
+  {
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard lock(waiters_mutex);
+      for (auto it = waiters.begin(); it != waiters.end();) {
+        if (hash && it->first != *hash) {
+          ++it;
+          continue;
+        }
+        for (auto& callback : it->second)
+          callbacks.push_back(std::move(callback));
+        it = waiters.erase(it);
+      }
+    }
+    for (auto& callback : callbacks)
+      callback();
+  }
+
+  void watch()
+  {
+    alignas(inotify_event) char buffer[4096];
+    auto last_recheck = std::chrono::steady_clock::now();
+
+    while (true) {
+      pollfd fds[2] = { { inotify_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+      int result = ::poll(fds, 2, RECHECK_INTERVAL_MS);
+      if (result < 0 && errno != EINTR) {
+        log_error("Claim watcher failed: ", std::strerror(errno));
+        return;
+      }
+      if (fds[1].revents & POLLIN)
+        return;
+
+      if (fds[0].revents & POLLIN) {
+        ssize_t length;
+        while ((length = ::read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+          for (char* ptr = buffer; ptr < buffer + length;) {
+            auto event = reinterpret_cast<inotify_event*>(ptr);
+            std::string_view name(event->len ? event->name : "");
+            if (name.ends_with(".claim")) {
+              std::string hash(name.substr(0, name.size() - 6));
+              notify(&hash);
+            }
+            ptr += sizeof(inotify_event) + event->len;
+          }
+        }
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_recheck >=
+          std::chrono::milliseconds(RECHECK_INTERVAL_MS)) {
+        last_recheck = now;
+        notify(nullptr);
+      }
+    }
+  }
+
+public:
+  claim_registry(std::filesystem::path claim_dir, unsigned stale_after_secs)
+    : claim_dir(std::move(claim_dir))
+    , stale_after(stale_after_secs)
+  {
+    std::filesystem::create_directories(this->claim_dir);
+  }
+
+  claim_registry(claim_registry const&) = delete;
+  claim_registry& operator=(claim_registry const&) = delete;
+
+  ~claim_registry() { stop(); }
+
+  /** Start the thread which notifies the waiters */
+  void start()
+  {
+    inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+      throw std::runtime_error("Failed to initialize inotify: " +
+                               std::string(std::strerror(errno)));
+    if (::inotify_add_watch(
+          inotify_fd, claim_dir.c_str(), IN_DELETE | IN_MOVED_FROM) < 0)
+      throw std::runtime_error("Failed to watch " + claim_dir.string() + ": " +
+                               std::strerror(errno));
+    wake_fd = ::eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0)
+      throw std::runtime_error("Failed to create eventfd");
+
+    watcher = std::thread([this] { watch(); });
+  }
+
+  /** Stop the watcher thread. Pending waiters are never called. */
+  void stop()
+  {
+    if (watcher.joinable()) {
+      std::uint64_t one = 1;
+      (void)::write(wake_fd, &one, sizeof(one));
+      watcher.join();
+    }
+    if (inotify_fd >= 0)
+      ::close(inotify_fd);
+    if (wake_fd >= 0)
+      ::close(wake_fd);
+    inotify_fd = wake_fd = -1;
+  }
+
+  /**
+   * Try to claim processing of the image. The claim is returned unless the
+   * status is claim_status::held.
+   */
+  std::pair<claim_status, std::unique_ptr<claim>> try_claim(
+    std::string const& hash)
+  {
+    auto path = claim_path(hash);
+    while (true) {
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0)
+        throw std::runtime_error("Failed to open claim file " + path.string() +
+                                 ": " + std::strerror(errno));
+
+      if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int error = errno;
+        if (error != EWOULDBLOCK) {
+          ::close(fd);
+          throw std::runtime_error("Failed to lock claim file " +
+                                   path.string() + ": " +
+                                   std::strerror(error));
+        }
+        struct stat st;
+        bool is_stale =
+          ::fstat(fd, &st) == 0 &&
+          std::chrono::system_clock::now() -
+              std::chrono::system_clock::from_time_t(st.st_mtime) >
+            stale_after;
+        if (!is_stale) {
+          ::close(fd);
+          return { claim_status::held, nullptr };
+        }
+
+        int fresh_fd;
+        try {
+          fresh_fd = take_over(path, fd);
+        } catch (...) {
+          ::close(fd);
+          throw;
+        }
+        ::close(fd);
+        // someone else has taken it over or released it, look again
+        if (fresh_fd < 0)
+          continue;
+        return { claim_status::taken_over,
+                 std::unique_ptr<claim>(new claim(path, fresh_fd)) };
+      }
+
+      // the previous holder may have unlinked the file between our open and
+      // flock, then we hold a lock on a file nobody else can see, and must
+      // try again
+      if (!is_linked(fd, path)) {
+        ::close(fd);
+        continue;
+      }
+
+      // mark the time of the claim, a file left by a crashed process keeps
+      // its old time
+      ::futimens(fd, nullptr);
+      return { claim_status::acquired,
+               std::unique_ptr<claim>(new claim(path, fd)) };
+    }
+  }
+
+  /**
+   * Call the callback (once, from the watcher thread) when the claim of the
+   * hash may have been released. The caller should then check the storage,
+   * and try to claim the image again if it isn't there.
+   */
+  void wait(std::string const& hash, std::function<void()>&& callback)
+  {
+    std::lock_guard lock(waiters_mutex);
+    waiters[hash].push_back(std::move(callback));
+  }
+};
+
+#endif // CLAIMS_HPP
@@ -1,6 +1,7 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include <algorithm>
 #include <fstream>
 #include <optional>
 #include <set>
@@ -10,10 +11,37 @@
 #include <unordered_set>
 #include <vector>
 
+#include "cpu_affinity.hpp"
+#include "encode_presets.hpp"
+#include "logger.hpp"
+#include "memory_budget.hpp"
+#include "metadata.hpp"
+#include "pipeline_stages.hpp"
+#include "response_cache.hpp"
+#include "tracing.hpp"
+#include "upload_sessions.hpp"
 #include "utils.hpp"
 
 #include "storage/fs.hpp"
 #include "storage/interface.hpp"
+#include "storage/pack.hpp"
+#include "storage/s3.hpp"
+#include "storage/tiered.hpp"
+
+/** Create a storage backend of the type given by the storage.type option */
+std::unique_ptr<storage_backend>
+make_storage_backend(std::string_view type)
+{
+  if (type == "fs")
+    return std::make_unique<storage_fs>();
+  if (type == "pack")
+    return std::make_unique<storage_pack>();
+  if (type == "s3")
+    return std::make_unique<storage_s3>();
+  if (type == "tiered")
+    return std::make_unique<storage_tiered>(make_storage_backend);
+  throw std::runtime_error("Unknown storage type: " + std::string(type));
+}
 
 /**
  * Size specification can be:
@@ -134,44 +162,36 @@ struct size_specs
 };
 
 /**
- * Parse a (byte) value from a number with an optional suffix (k, M, G).
- * Suffixes are interpreted as powers of 1024.
+ * Background creation of variants missing from stored images, configured as
+ *
+ *   backfill.enabled=true|false
+ *   backfill.max_folders_per_sec=<n>    (0 is not limited)
+ *   backfill.progress_file=<path>
+ *
+ * When sizes or formats change, images stored before the change lack the new
+ * variants, which the backfill creates from the stored originals, see
+ * backfill.hpp.
  */
-unsigned
-parse_bytes(std::string_view s)
+struct backfill_config
 {
-  unsigned val = 0;
-  for (std::size_t i = 0; i < s.size(); i++) {
-    if (s[i] < '0' || s[i] > '9') {
-      if (i != s.size() - 1)
-        throw std::runtime_error("Failed to parse value: " + std::string(s));
-
-      switch (s[i]) {
-        case 'B':
-          break;
-        case 'k':
-        case 'K':
-          val *= 1024;
-          break;
-        case 'M':
-          val *= 1024 * 1024;
-          break;
-        case 'G':
-          val *= 1024 * 1024 * 1024;
-          break;
-        default:
-          throw std::runtime_error("Invalid byte value suffix: " +
-                                   std::string(s));
-      }
-      return val;
+  bool enabled = false;
+  unsigned max_folders_per_sec = 20;
+  std::string progress_file = ".asset-server-backfill";
+
+  /** Set an option from a config entry, key is the part after "backfill." */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "enabled") {
+      enabled = parse_bool(value);
+    } else if (key == "max_folders_per_sec") {
+      max_folders_per_sec = string_view_to_int(value);
+    } else if (key == "progress_file") {
+      progress_file = value;
+    } else {
+      throw std::runtime_error("Unknown backfill option");
     }
-    val = val * 10 + (s[i] - '0');
   }
-  throw std::runtime_error(
-    "Missing byte value suffix (use 'B' to mark individual bytes): " +
-    std::string(s));
-  return val;
-}
+};
 
 /**
  * Representation of complete server configuration. See the example configuration file at <repo_root>/asset-server.cfg for description of each field.
@@ -187,8 +207,49 @@ struct config
   /** Do not access directly, use get_thread_pool_size() */
   std::optional<unsigned> thread_pool_size;
 
+  /** Do not access directly, use get_vips_concurrency() */
+  std::optional<unsigned> vips_concurrency;
+
   unsigned upload_limit_bytes = 20 * 1024 * 1024;
 
+  /** Limit on width * height * pages of an image, checked before decoding */
+  std::uint64_t max_image_pixels = 100'000'000;
+
+  /** Pinning of the pool workers and the network thread to CPUs */
+  affinity_config affinity;
+
+  /** Creation of variants missing from stored images, see backfill.hpp */
+  backfill_config backfill;
+
+  /** Resumable uploads, see upload_sessions.hpp */
+  upload_session_config upload_sessions;
+
+  /** Responses to uploads of stored images, see response_cache.hpp */
+  response_cache_config response_cache;
+
+  /** Do not access directly, use get_max_progressive_decodes() */
+  std::optional<unsigned> max_progressive_decodes;
+
+  /** Frames of an animated image resized by a single task */
+  unsigned animation_frames_per_task = 16;
+
+  /** Messages below this level are not logged */
+  log_level logging_level = log_level::info;
+  /** Log JSON lines instead of text */
+  bool log_json = false;
+
+  /** Memory budget of the uploads and the libvips cache */
+  memory_config memory;
+
+  /** Sampling and output of request traces, see tracing.hpp */
+  trace_config tracing;
+
+  /** Use libmagic for images that don't match any built-in signature */
+  bool libmagic_fallback = true;
+
+  /** Hash identifying the images, see also get_storage_layout() */
+  hash_algorithm hash = hash_algorithm::sha256;
+
   /** Do not access directly (internal to the configuration), use get_sizes(width_of_your_image) */
   size_specs sizes;
 
@@ -196,15 +257,70 @@ struct config
   std::unordered_map<std::string, std::vector<std::string>> formats;
   static constexpr const char* ALL_FORMATS_KEY = "*";
 
+  /** Encoder options, use get_save_suffix() */
+  encode_presets encoding;
+
+  /** Metadata stripping and colour conversion of the variants */
+  metadata_policy metadata;
+
+  /** Priorities and caps of the processing stages, use get_pipeline_stages() */
+  stage_config stages;
+
   std::string auth_header_val;
 
+  /**
+   * Directory for claims of images being processed, shared by all processes
+   * using the same storage. Empty disables the claims, see claims.hpp
+   */
+  std::string claim_dir;
+  unsigned claim_timeout_secs = 60;
+
   std::unique_ptr<storage_backend> storage = nullptr;
 
+  /**
+   * Number of threads each libvips operation may use, chosen so that pool
+   * width * libvips concurrency roughly matches the number of cores.
+   *
+   * If neither value is configured, the per-image parallelism grows slowly
+   * with the core count (1 thread up to 15 cores, 2 up to 23, ..., at most 4),
+   * since most of the throughput comes from processing several images at once.
+   * If only one of the values is configured, the other one is derived from it.
+   */
+  unsigned get_vips_concurrency() const
+  {
+    if (vips_concurrency)
+      return *vips_concurrency;
+
+    unsigned cores = get_core_count();
+    if (thread_pool_size)
+      return std::max(1u, cores / *thread_pool_size);
+    return std::clamp(cores / 8, 1u, 4u);
+  }
+
   unsigned get_thread_pool_size() const
   {
-    if (!thread_pool_size)
-      return std::thread::hardware_concurrency() + 1;
-    return *thread_pool_size;
+    if (thread_pool_size)
+      return *thread_pool_size;
+
+    return std::max(1u, get_core_count() / get_vips_concurrency());
+  }
+
+  /**
+   * Uploads that may be decoded while they are still being received. Each of
+   * them occupies a pool thread until its transfer ends, so by default at
+   * most half of the pool is used for this.
+   */
+  unsigned get_max_progressive_decodes() const
+  {
+    if (max_progressive_decodes)
+      return *max_progressive_decodes;
+    return get_thread_pool_size() / 2;
+  }
+
+  static unsigned get_core_count()
+  {
+    // hardware_concurrency() may return 0 if it can't determine the value
+    return std::max(1u, std::thread::hardware_concurrency());
   }
 
   std::set<dimension_t> get_sizes(dimension_t original_width) const
@@ -212,6 +328,30 @@ struct config
     return sizes.get_sizes(original_width);
   }
 
+  storage_layout get_storage_layout() const
+  {
+    return { std::string(hash_algorithm_name(hash)) };
+  }
+
+  /**
+   * Suffix for vips::VImage::write_to_buffer, selecting the format and the
+   * configured encoder options for a variant of the given width
+   */
+  std::string get_save_suffix(std::string const& format,
+                              dimension_t width) const
+  {
+    return encoding.get_save_suffix(format, width);
+  }
+
+  pipeline_stages get_pipeline_stages() const
+  {
+    std::set<std::string> output_formats;
+    for (auto const& [_, list] : formats)
+      output_formats.insert(list.begin(), list.end());
+    return pipeline_stages::create(
+      stages, get_thread_pool_size(), output_formats);
+  }
+
   std::vector<std::string> get_formats(std::string const& format) const
   {
     std::vector<std::string> result;
@@ -248,6 +388,9 @@ struct config
         continue;
 
       auto pos = line.find('=');
+      // "<=" is part of the key (see encode_presets)
+      while (pos != std::string::npos && pos > 0 && line[pos - 1] == '<')
+        pos = line.find('=', pos + 1);
       if (pos == std::string::npos)
         throw std::runtime_error("Invalid config line");
 
@@ -268,24 +411,67 @@ struct config
           cfg.socket_kill_timeout_secs = string_view_to_int(value);
         } else if (key == "thread_pool_size") {
           cfg.thread_pool_size = string_view_to_int(value);
+          if (*cfg.thread_pool_size == 0)
+            throw std::runtime_error("thread_pool_size must be greater than 0");
+        } else if (key == "vips_concurrency") {
+          cfg.vips_concurrency = string_view_to_int(value);
+          if (*cfg.vips_concurrency == 0)
+            throw std::runtime_error("vips_concurrency must be greater than 0");
         } else if (key == "upload_limit") {
           cfg.upload_limit_bytes = parse_bytes(value);
+        } else if (key == "max_image_pixels") {
+          cfg.max_image_pixels = string_view_to_uint64(value);
+        } else if (key == "max_progressive_decodes") {
+          cfg.max_progressive_decodes = string_view_to_int(value);
+        } else if (key == "animation_frames_per_task") {
+          cfg.animation_frames_per_task = string_view_to_int(value);
+          if (cfg.animation_frames_per_task == 0)
+            throw std::runtime_error(
+              "animation_frames_per_task must be greater than 0");
+        } else if (key == "log_level") {
+          cfg.logging_level = parse_log_level(value);
+        } else if (key == "log_format") {
+          if (value != "text" && value != "json")
+            throw std::runtime_error("Expected text or json");
+          cfg.log_json = value == "json";
+        } else if (key == "libmagic_fallback") {
+          cfg.libmagic_fallback = parse_bool(value);
+        } else if (key == "hash_algorithm") {
+          cfg.hash = parse_hash_algorithm(value);
         } else if (key == "auth_token") {
           cfg.auth_header_val = "Bearer " + std::string(value);
+        } else if (key == "claim_dir") {
+          cfg.claim_dir = value;
+        } else if (key == "claim_timeout_secs") {
+          cfg.claim_timeout_secs = string_view_to_int(value);
         } else if (key == "sizes") {
           cfg.sizes = size_specs::parse(value);
         } else if (key == "storage.type") {
-          if (value == "fs")
-            cfg.storage = std::make_unique<storage_fs>();
-          else
-            throw std::runtime_error("Unknown storage type: " +
-                                     std::string(value));
+          cfg.storage = make_storage_backend(value);
         } else if (key.substr(0, 8) == "storage.") {
           if (!cfg.storage)
             throw std::runtime_error("storage.type not specified (it must come "
                                      "before other storage.* keys)");
 
           cfg.storage->set_config(key.substr(8), value);
+        } else if (key.substr(0, 7) == "encode.") {
+          cfg.encoding.set(key.substr(7), value);
+        } else if (key.substr(0, 9) == "metadata.") {
+          cfg.metadata.set(key.substr(9), value);
+        } else if (key.substr(0, 9) == "affinity.") {
+          cfg.affinity.set(key.substr(9), value);
+        } else if (key.substr(0, 9) == "backfill.") {
+          cfg.backfill.set(key.substr(9), value);
+        } else if (key.substr(0, 16) == "upload_sessions.") {
+          cfg.upload_sessions.set(key.substr(16), value);
+        } else if (key.substr(0, 15) == "response_cache.") {
+          cfg.response_cache.set(key.substr(15), value);
+        } else if (key.substr(0, 7) == "memory.") {
+          cfg.memory.set(key.substr(7), value);
+        } else if (key.substr(0, 6) == "trace.") {
+          cfg.tracing.set(key.substr(6), value);
+        } else if (key.substr(0, 7) == "stages.") {
+          cfg.stages.set(key.substr(7), value);
         } else if (key.substr(0, 8) == "formats.") {
           auto format = key.substr(8);
           std::vector<std::string> formats;
@@ -318,10 +504,15 @@ struct config
     if (cfg.formats.empty())
       throw std::runtime_error("No formats specified");
 
+    cfg.encoding.finalize();
+
     if (!cfg.storage)
       throw std::runtime_error("No storage type specified");
 
     cfg.storage->validate();
+    if (!cfg.claim_dir.empty() && !cfg.storage->supports_multiple_processes())
+      throw std::runtime_error("claim_dir is set, but the storage can't be "
+                               "shared by several processes");
 
     if (cfg.socket_kill_timeout_secs <= cfg.processing_timeout_secs)
       throw std::runtime_error("socket_kill_timeout_secs must be greater than "
@@ -331,10 +522,15 @@ struct config
       throw std::runtime_error(
         "processing_timeout_secs must be greater than 0");
 
+    // threads of libvips inherit the CPUs of the worker that starts them
+    if (cfg.affinity.workers == worker_affinity::core &&
+        cfg.get_vips_concurrency() > 1)
+      throw std::runtime_error(
+        "affinity.workers=core requires vips_concurrency=1");
+
     if (cfg.auth_header_val.empty())
-      std::cerr << "Warning: no auth_token specified, server will be open for "
-                   "uploads to anyone"
-                << std::endl;
+      log_warning("No auth_token specified, server will be open for uploads "
+                  "to anyone");
 
     return cfg;
   }
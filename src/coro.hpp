@@ -0,0 +1,428 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+/**
+ * Coroutines running on thread_pool. A pool_task is a lazily started
+ * coroutine: it runs when it is awaited, and the awaiting coroutine continues
+ * when it finishes, getting its result or exception. Waiting (for other tasks,
+ * other uploads, claims, ...) suspends the coroutine instead of blocking a
+ * pool thread, and it continues on the pool once the wait is over.
+ *
+ * - schedule_on(pool, stage) moves the coroutine to a pool thread, queueing it
+ *   in the given stage (see stage_options)
+ * - when_all(pool, tasks) runs tasks in parallel on the pool
+ * - async_event is a one-shot event coroutines can wait for
+ * - resume_on_callback() adapts callback-based waiting
+ * - spawn() starts a top-level task, reporting its outcome to a callback
+ */
+
+template<typename T>
+class pool_task;
+
+namespace coro_detail {
+
+struct final_awaiter
+{
+  bool await_ready() noexcept { return false; }
+
+  /** Continue the awaiting coroutine, if any, without growing the stack */
+  template<typename Promise>
+  std::coroutine_handle<> await_suspend(
+    std::coroutine_handle<Promise> handle) noexcept
+  {
+    if (auto continuation = handle.promise().continuation)
+      return continuation;
+    return std::noop_coroutine();
+  }
+
+  void await_resume() noexcept {}
+};
+
+struct promise_base
+{
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct promise : promise_base
+{
+  std::optional<T> value;
+
+  void return_value(T result) { value = std::move(result); }
+
+  T result()
+  {
+    if (exception)
+      std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+  void return_void() {}
+
+  void result()
+  {
+    if (exception)
+      std::rethrow_exception(exception);
+  }
+};
+
+/** Coroutine that starts right away and destroys itself when done */
+struct detached
+{
+  struct promise_type
+  {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+} // namespace coro_detail
+
+template<typename T = void>
+class pool_task
+{
+public:
+  struct promise_type : coro_detail::promise<T>
+  {
+    pool_task get_return_object()
+    {
+      return pool_task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+private:
+  std::coroutine_handle<promise_type> handle;
+
+  explicit pool_task(std::coroutine_handle<promise_type> handle)
+    : handle(handle)
+  {
+  }
+
+public:
+  pool_task(pool_task&& other) noexcept
+    : handle(std::exchange(other.handle, nullptr))
+  {
+  }
+
+  pool_task& operator=(pool_task&& other) noexcept
+  {
+    if (this != &other) {
+      if (handle)
+        handle.destroy();
+      handle = std::exchange(other.handle, nullptr);
+    }
+    return *this;
+  }
+
+  ~pool_task()
+  {
+    if (handle)
+      handle.destroy();
+  }
+
+  auto operator co_await() noexcept
+  {
+    struct awaiter
+    {
+      std::coroutine_handle<promise_type> handle;
+
+      bool await_ready() noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept
+      {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+
+      T await_resume() { return handle.promise().result(); }
+    };
+    return awaiter{ handle };
+  }
+};
+
+/** Awaitable which continues the coroutine on a thread of the pool */
+struct schedule_awaiter
+{
+  thread_pool& pool;
+  stage_id stage;
+
+  bool await_ready() noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    pool.add_task(stage, [handle] { handle.resume(); });
+  }
+
+  void await_resume() noexcept {}
+};
+
+schedule_awaiter
+schedule_on(thread_pool& pool, stage_id stage = 0)
+{
+  return { pool, stage };
+}
+
+/**
+ * Awaitable running the tasks in parallel on the pool, and continuing once all
+ * of them finished. If any of them throws, the first exception is rethrown
+ * (after all tasks finished, since they may use the awaiting coroutine's
+ * data).
+ *
+ * The tasks are started by the awaiting thread, and each of them should begin
+ * with schedule_on() to its stage, otherwise they run one after another.
+ */
+class when_all_awaiter
+{
+private:
+  thread_pool& pool;
+  std::vector<pool_task<void>> tasks;
+  std::atomic<std::size_t> remaining{ 0 };
+  std::mutex error_mutex;
+  std::exception_ptr first_error;
+  std::coroutine_handle<> waiting;
+
+  static coro_detail::detached run_one(when_all_awaiter* self,
+                                       pool_task<void>* task)
+  {
+    try {
+      co_await *task;
+    } catch (...) {
+      std::lock_guard lock(self->error_mutex);
+      if (!self->first_error)
+        self->first_error = std::current_exception();
+    }
+    if (self->remaining.fetch_sub(1) == 1)
+      self->waiting.resume();
+  }
+
+public:
+  when_all_awaiter(thread_pool& pool, std::vector<pool_task<void>>&& tasks)
+    : pool(pool)
+    , tasks(std::move(tasks))
+  {
+  }
+
+  bool await_ready() noexcept { return tasks.empty(); }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    waiting = handle;
+    remaining = tasks.size();
+    // the last task may resume the waiting coroutine (destroying this
+    // awaiter) before the loop ends, so it must not touch any members
+    auto* task = tasks.data();
+    auto* end = task + tasks.size();
+    for (; task != end; ++task)
+      run_one(this, task);
+  }
+
+  void await_resume()
+  {
+    if (first_error)
+      std::rethrow_exception(first_error);
+  }
+};
+
+when_all_awaiter
+when_all(thread_pool& pool, std::vector<pool_task<void>>&& tasks)
+{
+  return when_all_awaiter(pool, std::move(tasks));
+}
+
+/**
+ * A one-shot event. Coroutines awaiting wait() are suspended until set() is
+ * called, then they continue on the pool, in the given stage. Waiting after
+ * set() doesn't suspend.
+ */
+class async_event
+{
+private:
+  std::mutex mutex;
+  bool is_set = false;
+  /** Suspended coroutines, with the location to continue at */
+  std::vector<std::pair<std::coroutine_handle<>, thread_pool::task_location>>
+    waiters;
+
+public:
+  void set(thread_pool& pool, stage_id stage = 0)
+  {
+    decltype(waiters) to_resume;
+    {
+      std::lock_guard lock(mutex);
+      is_set = true;
+      to_resume.swap(waiters);
+    }
+    for (auto [handle, where] : to_resume)
+      pool.add_task_at(where, stage, [handle] { handle.resume(); });
+  }
+
+  auto wait()
+  {
+    struct awaiter
+    {
+      async_event& event;
+
+      bool await_ready() noexcept { return false; }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        std::lock_guard lock(event.mutex);
+        if (event.is_set)
+          return false;
+        event.waiters.emplace_back(handle, thread_pool::current_location());
+        return true;
+      }
+
+      void await_resume() noexcept {}
+    };
+    return awaiter{ *this };
+  }
+};
+
+/**
+ * Awaitable adapting callback-based waiting: subscribe is called with a
+ * callback (convertible to std::function<void()>), and the coroutine continues
+ * on the pool, in the given stage, once the callback is called. The callback may also be called
+ * right away, from inside subscribe.
+ */
+template<typename Subscribe>
+class callback_awaiter
+{
+private:
+  thread_pool& pool;
+  stage_id stage;
+  Subscribe subscribe;
+
+public:
+  callback_awaiter(thread_pool& pool, stage_id stage, Subscribe subscribe)
+    : pool(pool)
+    , stage(stage)
+    , subscribe(std::move(subscribe))
+  {
+  }
+
+  bool await_ready() noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    // the coroutine may be resumed (and this awaiter destroyed) before
+    // subscribe returns, so run it from the stack. The callback may come from
+    // another thread, the coroutine continues on the node it ran on
+    auto subscribe_now = std::move(subscribe);
+    subscribe_now([&pool = pool,
+                   stage = stage,
+                   where = thread_pool::current_location(),
+                   handle] {
+      pool.add_task_at(where, stage, [handle] { handle.resume(); });
+    });
+  }
+
+  void await_resume() noexcept {}
+};
+
+template<typename Subscribe>
+callback_awaiter<Subscribe>
+resume_on_callback(thread_pool& pool, stage_id stage, Subscribe subscribe)
+{
+  return { pool, stage, std::move(subscribe) };
+}
+
+class operation_cancelled : public std::runtime_error
+{
+public:
+  operation_cancelled()
+    : std::runtime_error("Operation was cancelled")
+  {
+  }
+};
+
+/**
+ * Cooperative cancellation: copies share one flag, coroutines check it
+ * between steps with throw_if_cancelled()
+ */
+class cancellation_token
+{
+private:
+  std::shared_ptr<std::atomic<bool>> flag =
+    std::make_shared<std::atomic<bool>>(false);
+
+public:
+  void cancel() { flag->store(true); }
+
+  bool is_cancelled() const { return flag->load(); }
+
+  void throw_if_cancelled() const
+  {
+    if (is_cancelled())
+      throw operation_cancelled();
+  }
+};
+
+namespace coro_detail {
+
+detached
+run_spawned(thread_pool& pool,
+            stage_id stage,
+            pool_task<void> task,
+            std::function<void(std::exception_ptr)> done)
+{
+  co_await schedule_on(pool, stage);
+  std::exception_ptr error;
+  try {
+    co_await task;
+  } catch (...) {
+    error = std::current_exception();
+  }
+  done(error);
+}
+
+} // namespace coro_detail
+
+/**
+ * Run a task on the pool, starting in the given stage, without awaiting it.
+ * When it finishes, done is called with its exception, or null.
+ */
+void
+spawn(thread_pool& pool,
+      stage_id stage,
+      pool_task<void> task,
+      std::function<void(std::exception_ptr)> done)
+{
+  coro_detail::run_spawned(pool, stage, std::move(task), std::move(done));
+}
+
+void
+spawn(thread_pool& pool,
+      pool_task<void> task,
+      std::function<void(std::exception_ptr)> done)
+{
+  spawn(pool, 0, std::move(task), std::move(done));
+}
+
+#endif // CORO_HPP
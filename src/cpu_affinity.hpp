@@ -0,0 +1,226 @@
+#ifndef CPU_AFFINITY_HPP
+#define CPU_AFFINITY_HPP
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "utils.hpp"
+
+/** Parse CPU numbers in the format of Linux cpulist files, e.g. "0-3,8,11" */
+std::vector<unsigned>
+parse_cpu_list(std::string_view s)
+{
+  std::vector<unsigned> result;
+  std::size_t start = 0;
+  while (start < s.size()) {
+    auto end = s.find(',', start);
+    if (end == std::string_view::npos)
+      end = s.size();
+    auto item = s.substr(start, end - start);
+    auto dash = item.find('-');
+    if (dash == std::string_view::npos) {
+      result.push_back(string_view_to_int(item));
+    } else {
+      unsigned first = string_view_to_int(item.substr(0, dash));
+      unsigned last = string_view_to_int(item.substr(dash + 1));
+      if (last < first)
+        throw std::runtime_error("Invalid CPU range: " + std::string(item));
+      for (unsigned cpu = first; cpu <= last; cpu++)
+        result.push_back(cpu);
+    }
+    start = end + 1;
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+/** CPUs the process may run on */
+std::vector<unsigned>
+get_allowed_cpus()
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  std::vector<unsigned> result;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return result;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &set))
+      result.push_back(cpu);
+  return result;
+}
+
+/** Restrict the calling thread to the given CPUs, returns false on failure */
+bool
+pin_current_thread(std::vector<unsigned> const& cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/** CPUs of each NUMA node, as far as the process may use them */
+struct cpu_topology
+{
+  std::vector<std::vector<unsigned>> nodes;
+
+  /**
+   * Read the nodes from /sys/devices/system/node. Without it (not Linux, or a
+   * kernel without NUMA), all CPUs are a single node.
+   */
+  static cpu_topology detect()
+  {
+    auto allowed = get_allowed_cpus();
+    cpu_topology result;
+
+    std::map<unsigned, std::vector<unsigned>> by_id;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it("/sys/devices/system/node", ec),
+         end;
+         !ec && it != end;
+         it.increment(ec)) {
+      auto name = it->path().filename().string();
+      if (name.substr(0, 4) != "node" || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != std::string::npos)
+        continue;
+      std::ifstream file(it->path() / "cpulist");
+      std::string line;
+      if (!std::getline(file, line))
+        continue;
+      std::vector<unsigned> cpus;
+      for (auto cpu : parse_cpu_list(line))
+        if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+          cpus.push_back(cpu);
+      if (!cpus.empty())
+        by_id[string_view_to_int(std::string_view(name).substr(4))] =
+          std::move(cpus);
+    }
+
+    for (auto& [_, cpus] : by_id)
+      result.nodes.push_back(std::move(cpus));
+    if (result.nodes.empty() && !allowed.empty())
+      result.nodes.push_back(std::move(allowed));
+    return result;
+  }
+
+  /**
+   * The same CPUs split into n nodes of consecutive CPUs, to try the node
+   * placement on a machine with fewer nodes
+   */
+  cpu_topology simulate(unsigned n) const
+  {
+    std::vector<unsigned> all;
+    for (auto const& node : nodes)
+      all.insert(all.end(), node.begin(), node.end());
+    n = std::clamp<unsigned>(n, 1, std::max<std::size_t>(all.size(), 1));
+
+    cpu_topology result;
+    result.nodes.resize(n);
+    for (std::size_t i = 0; i < all.size(); i++)
+      result.nodes[i * n / all.size()].push_back(all[i]);
+    return result;
+  }
+};
+
+/** How the threads of thread_pool are pinned */
+enum class worker_affinity
+{
+  /** Not pinned, the OS places and migrates them */
+  none,
+  /** Each worker is pinned to the CPUs of one NUMA node */
+  node,
+  /** Each worker is pinned to a single CPU */
+  core,
+};
+
+/** NUMA node and CPUs of a worker of thread_pool */
+struct worker_placement
+{
+  unsigned node = 0;
+  /** Empty if the worker isn't pinned */
+  std::vector<unsigned> cpus;
+};
+
+/**
+ * Spread n workers over the nodes in turn (the nodes of a machine are usually
+ * the same size), with the workers of a node on its CPUs in turn for
+ * worker_affinity::core. Returns no placements for worker_affinity::none.
+ */
+std::vector<worker_placement>
+place_workers(cpu_topology const& topology, worker_affinity mode, unsigned n)
+{
+  std::vector<worker_placement> result;
+  if (mode == worker_affinity::none || topology.nodes.empty())
+    return result;
+
+  std::vector<unsigned> used(topology.nodes.size(), 0);
+  for (unsigned i = 0; i < n; i++) {
+    unsigned node = i % topology.nodes.size();
+    auto const& cpus = topology.nodes[node];
+    worker_placement placement;
+    placement.node = node;
+    if (mode == worker_affinity::core)
+      placement.cpus = { cpus[used[node]++ % cpus.size()] };
+    else
+      placement.cpus = cpus;
+    result.push_back(std::move(placement));
+  }
+  return result;
+}
+
+/**
+ * Pinning of the server threads, configured as
+ *
+ *   affinity.workers=none|node|core
+ *   affinity.io_cpus=<cpu list>        (e.g. 0-1, empty is not pinned)
+ *   affinity.simulated_nodes=<n>       (0 uses the real topology)
+ */
+struct affinity_config
+{
+  worker_affinity workers = worker_affinity::none;
+  std::vector<unsigned> io_cpus;
+  unsigned simulated_nodes = 0;
+
+  /** Set an option from a config entry, key is the part after "affinity." */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "workers") {
+      if (value == "none")
+        workers = worker_affinity::none;
+      else if (value == "node")
+        workers = worker_affinity::node;
+      else if (value == "core")
+        workers = worker_affinity::core;
+      else
+        throw std::runtime_error("Expected none, node or core");
+    } else if (key == "io_cpus") {
+      io_cpus = parse_cpu_list(value);
+    } else if (key == "simulated_nodes") {
+      simulated_nodes = string_view_to_int(value);
+    } else {
+      throw std::runtime_error("Unknown affinity option");
+    }
+  }
+
+  cpu_topology get_topology() const
+  {
+    auto topology = cpu_topology::detect();
+    if (simulated_nodes)
+      return topology.simulate(simulated_nodes);
+    return topology;
+  }
+};
+
+#endif // CPU_AFFINITY_HPP
@@ -0,0 +1,170 @@
+#ifndef ENCODE_PRESETS_HPP
+#define ENCODE_PRESETS_HPP
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * Encoder options for each output format, configured as
+ *
+ *   encode.<format>=<name>=<value>,<name>=<value>,...
+ *   encode.<format>.maxwidth<=<width>=<name>=<value>,...
+ *
+ * The options are those of the libvips saver of the format (e.g. Q and effort
+ * for webpsave). The maxwidth variants apply to variants at most that wide,
+ * the narrowest matching one wins, and their options are added to (or
+ * override) the ones of encode.<format>. This way, more CPU can be spent on
+ * small variants, which are served most often, and less on large ones.
+ *
+ * Everything is resolved when the config is loaded, so looking up the options
+ * of an encode is a single map lookup.
+ */
+class encode_presets
+{
+private:
+  using options_t = std::vector<std::pair<std::string, std::string>>;
+
+  struct format_presets
+  {
+    options_t default_options;
+    std::map<dimension_t, options_t> by_max_width;
+
+    /** Resolved by finalize(): the save suffix for libvips, e.g. .webp[Q=80] */
+    std::string default_suffix;
+    std::map<dimension_t, std::string> suffix_by_max_width;
+  };
+
+  std::unordered_map<std::string, format_presets> formats;
+
+  static options_t parse_options(std::string_view s)
+  {
+    options_t result;
+    std::size_t start = 0;
+    while (start < s.size()) {
+      auto end = s.find(',', start);
+      if (end == std::string_view::npos)
+        end = s.size();
+      auto option = s.substr(start, end - start);
+      auto eq = option.find('=');
+      if (eq == std::string_view::npos || eq == 0 || eq + 1 == option.size())
+        throw std::runtime_error("Invalid encoder option '" +
+                                 std::string(option) +
+                                 "', expected name=value");
+      // these would break the libvips option string
+      if (option.find_first_of("[]") != std::string_view::npos)
+        throw std::runtime_error("Invalid characters in encoder option '" +
+                                 std::string(option) + "'");
+      result.emplace_back(option.substr(0, eq), option.substr(eq + 1));
+      start = end + 1;
+    }
+    if (result.empty())
+      throw std::runtime_error("No encoder options specified");
+    return result;
+  }
+
+  static std::string make_suffix(std::string const& format,
+                                 options_t const& options)
+  {
+    std::string result = "." + format;
+    if (options.empty())
+      return result;
+
+    result += "[";
+    for (std::size_t i = 0; i < options.size(); i++) {
+      if (i > 0)
+        result += ",";
+      result += options[i].first + "=" + options[i].second;
+    }
+    return result + "]";
+  }
+
+public:
+  /**
+   * Set options from a config entry. key is the part after "encode.", e.g.
+   * "avif" or "avif.maxwidth<=512".
+   */
+  void set(std::string_view key, std::string_view value)
+  {
+    auto dot = key.find('.');
+    auto& presets = formats[std::string(key.substr(0, dot))];
+    auto options = parse_options(value);
+
+    if (dot == std::string_view::npos) {
+      presets.default_options = std::move(options);
+      return;
+    }
+
+    constexpr std::string_view prefix = "maxwidth<=";
+    auto condition = key.substr(dot + 1);
+    if (!condition.starts_with(prefix))
+      throw std::runtime_error("Invalid encoder preset condition '" +
+                               std::string(condition) +
+                               "', expected maxwidth<=<width>");
+    dimension_t max_width =
+      string_view_to_int(condition.substr(prefix.size()));
+    if (!presets.by_max_width.emplace(max_width, std::move(options)).second)
+      throw std::runtime_error("Duplicate encoder preset");
+  }
+
+  /** Resolve the save suffixes, must be called after all set() calls */
+  void finalize()
+  {
+    for (auto& [format, presets] : formats) {
+      presets.default_suffix = make_suffix(format, presets.default_options);
+      for (auto const& [max_width, options] : presets.by_max_width) {
+        auto merged = presets.default_options;
+        for (auto const& option : options) {
+          auto it =
+            std::find_if(merged.begin(), merged.end(), [&](auto const& other) {
+              return other.first == option.first;
+            });
+          if (it != merged.end())
+            it->second = option.second;
+          else
+            merged.push_back(option);
+        }
+        presets.suffix_by_max_width[max_width] = make_suffix(format, merged);
+      }
+    }
+  }
+
+  /**
+   * Return the suffix to pass to vips::VImage::write_to_buffer, which selects
+   * the saver and its options, for a variant of the given width
+   */
+  std::string get_save_suffix(std::string const& format,
+                              dimension_t width) const
+  {
+    auto it = formats.find(format);
+    if (it == formats.end())
+      return "." + format;
+
+    auto const& by_width = it->second.suffix_by_max_width;
+    auto rule = by_width.lower_bound(width);
+    if (rule != by_width.end())
+      return rule->second;
+    return it->second.default_suffix;
+  }
+
+  /** All resolved suffixes, for validation at startup */
+  std::vector<std::string> get_all_suffixes() const
+  {
+    std::vector<std::string> result;
+    for (auto const& [format, presets] : formats) {
+      result.push_back(presets.default_suffix);
+      for (auto const& [max_width, suffix] : presets.suffix_by_max_width)
+        result.push_back(suffix);
+    }
+    return result;
+  }
+};
+
+#endif // ENCODE_PRESETS_HPP
@@ -0,0 +1,192 @@
+#ifndef FORMAT_SNIFFING_HPP
+#define FORMAT_SNIFFING_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <magic.h>
+
+#include "logger.hpp"
+
+/**
+ * Detection of the format of uploaded images from their first bytes.
+ *
+ * The formats we accept all have short signatures at fixed offsets, so these
+ * are matched against a built-in table. The returned names are the same as the
+ * keys used in the formats.* configuration (see config::get_formats). Only if
+ * no signature matches, libmagic can be used as a fallback.
+ */
+
+struct format_signature_part
+{
+  std::size_t offset;
+  std::string_view bytes;
+};
+
+struct format_signature
+{
+  std::string_view format;
+  /** All parts must match. Unused second part has empty bytes. */
+  std::array<format_signature_part, 2> parts;
+};
+
+using namespace std::string_view_literals;
+
+// clang-format off
+static constexpr format_signature format_signatures[] = {
+  { "jpeg", { { { 0, "\xFF\xD8\xFF"sv }, { 0, ""sv } } } },
+  { "png",  { { { 0, "\x89PNG\r\n\x1A\n"sv }, { 0, ""sv } } } },
+  { "gif",  { { { 0, "GIF87a"sv }, { 0, ""sv } } } },
+  { "gif",  { { { 0, "GIF89a"sv }, { 0, ""sv } } } },
+  { "webp", { { { 0, "RIFF"sv }, { 8, "WEBP"sv } } } },
+  { "jxl",  { { { 0, "\xFF\x0A"sv }, { 0, ""sv } } } },
+  { "jxl",  { { { 0, "\x00\x00\x00\x0CJXL \r\n\x87\n"sv }, { 0, ""sv } } } },
+  { "tiff", { { { 0, "II*\x00"sv }, { 0, ""sv } } } },
+  { "tiff", { { { 0, "MM\x00*"sv }, { 0, ""sv } } } },
+};
+
+/** ISO base media file (ftyp box) brands of the HEIF-based formats */
+static constexpr std::pair<std::string_view, std::string_view> ftyp_brands[] = {
+  { "avif", "avif" }, { "avis", "avif" },
+  { "heic", "heic" }, { "heix", "heic" }, { "heim", "heic" },
+  { "heis", "heic" }, { "hevc", "heic" }, { "hevx", "heic" },
+};
+// clang-format on
+
+/** Number of bytes after which no signature can start matching anymore */
+static constexpr std::size_t format_sniffing_max_bytes = 64;
+
+bool
+signature_part_matches(format_signature_part const& part,
+                       std::uint8_t const* data,
+                       std::size_t size)
+{
+  if (part.offset + part.bytes.size() > size)
+    return false;
+  return std::memcmp(
+           data + part.offset, part.bytes.data(), part.bytes.size()) == 0;
+}
+
+/**
+ * HEIF containers (AVIF, HEIC) start with an ftyp box. The major brand tells
+ * the format in most files, but generic major brands such as mif1 are also
+ * common, so the compatible brands are checked too, AVIF taking precedence.
+ */
+std::optional<std::string_view>
+sniff_ftyp(std::uint8_t const* data, std::size_t size)
+{
+  if (size < 16 || std::memcmp(data + 4, "ftyp", 4) != 0)
+    return std::nullopt;
+
+  std::size_t box_size = (std::size_t(data[0]) << 24) |
+                         (std::size_t(data[1]) << 16) |
+                         (std::size_t(data[2]) << 8) | data[3];
+  box_size = std::min({ box_size, size, format_sniffing_max_bytes });
+
+  std::optional<std::string_view> result;
+  // major brand at offset 8, then minor version, then compatible brands
+  for (std::size_t offset = 8; offset + 4 <= box_size;
+       offset += (offset == 8 ? 8 : 4)) {
+    std::string_view brand(reinterpret_cast<char const*>(data + offset), 4);
+    for (auto const& [name, format] : ftyp_brands) {
+      if (brand != name)
+        continue;
+      if (format == "avif")
+        return format;
+      result = format;
+    }
+  }
+  return result;
+}
+
+/**
+ * Determine the format from the built-in signature table. Returns nullopt if
+ * the data doesn't look like any format we know.
+ */
+std::optional<std::string_view>
+sniff_format_builtin(std::uint8_t const* data, std::size_t size)
+{
+  for (auto const& signature : format_signatures) {
+    if (signature_part_matches(signature.parts[0], data, size) &&
+        signature_part_matches(signature.parts[1], data, size))
+      return signature.format;
+  }
+  return sniff_ftyp(data, size);
+}
+
+/**
+ * libmagic cookies can't be shared between threads, so every thread opens its
+ * own on first use, and closes it when the thread exits.
+ */
+class thread_local_magic
+{
+private:
+  magic_t cookie = nullptr;
+
+public:
+  thread_local_magic()
+  {
+    cookie = magic_open(MAGIC_EXTENSION);
+    if (cookie && magic_load(cookie, nullptr) != 0) {
+      magic_close(cookie);
+      cookie = nullptr;
+    }
+    if (!cookie)
+      log_warning("Failed to load default libmagic database");
+  }
+
+  thread_local_magic(thread_local_magic const&) = delete;
+  thread_local_magic& operator=(thread_local_magic const&) = delete;
+
+  ~thread_local_magic()
+  {
+    if (cookie)
+      magic_close(cookie);
+  }
+
+  /**
+   * Return the first extension libmagic suggests for the data (e.g. "jpeg" for
+   * "jpeg/jpg/jpe/jfif"), or nullopt if it doesn't know
+   */
+  std::optional<std::string> sniff(std::uint8_t const* data, std::size_t size)
+  {
+    if (!cookie)
+      return std::nullopt;
+
+    auto magic_format = magic_buffer(cookie, data, size);
+    if (!magic_format || std::string_view(magic_format) == "???"sv)
+      return std::nullopt;
+
+    std::string_view extensions(magic_format);
+    return std::string(extensions.substr(0, extensions.find('/')));
+  }
+
+  static thread_local_magic& get()
+  {
+    thread_local thread_local_magic instance;
+    return instance;
+  }
+};
+
+/**
+ * Determine the format of an image. Returns nullopt if the format couldn't be
+ * determined.
+ */
+std::optional<std::string>
+sniff_format(std::uint8_t const* data, std::size_t size, bool libmagic_fallback)
+{
+  if (auto format = sniff_format_builtin(data, size))
+    return std::string(*format);
+
+  if (libmagic_fallback)
+    return thread_local_magic::get().sniff(data, size);
+  return std::nullopt;
+}
+
+#endif // FORMAT_SNIFFING_HPP
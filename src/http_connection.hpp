@@ -1,6 +1,10 @@
 #ifndef HTTP_CONNECTION_HPP
 #define HTTP_CONNECTION_HPP
 
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <optional>
 #include <string>
 
 #include <ada.h>
@@ -11,7 +15,12 @@
 #include <openssl/crypto.h>
 
 #include "image_processing.hpp"
+#include "logger.hpp"
+#include "response_cache.hpp"
 #include "server_state.hpp"
+#include "tracing.hpp"
+#include "upload_sessions.hpp"
+#include "upload_stream.hpp"
 
 struct error_result
 {
@@ -30,16 +39,35 @@ private:
 
   server_state state;
 
-  boost::beast::http::request_parser<
-    boost::beast::http::vector_body<std::uint8_t>>
+  /**
+   * The header is read first, and the body of uploads is then read in parts,
+   * which are passed to the image processor as they arrive
+   */
+  boost::beast::http::request_parser<boost::beast::http::buffer_body>
     request_parser;
+  std::array<std::uint8_t, 64 * 1024> body_buffer;
+  std::shared_ptr<upload_stream> upload;
+  std::size_t body_size = 0;
+  /** Session of a resumable upload this request works on, if any */
+  upload_sessions::lease session;
   boost::beast::http::response<boost::beast::http::dynamic_body> response;
+  /** Used instead of response for responses from state.responses */
+  boost::beast::http::response<boost::beast::http::span_body<char const>>
+    cached_response;
+  response_cache::response cached_body;
 
   boost::asio::steady_timer socket_kill_deadline;
   boost::asio::steady_timer processing_stop_deadline;
 
   std::atomic<bool> responded{ false };
 
+  /** Set if this request is sampled for tracing, see tracing.hpp */
+  std::shared_ptr<request_trace> trace;
+  std::optional<trace_wait> trace_request;
+  std::optional<trace_wait> trace_admission;
+  std::optional<trace_wait> trace_receiving;
+  std::optional<trace_wait> trace_sending;
+
   /**
    * Returns true if response should be sent, false otherwise (in the case
    * response was already sent)
@@ -55,13 +83,39 @@ private:
   void send_response()
   {
     response.content_length(response.body().size());
+    write_response(response);
+  }
+
+  /** Send a response which was serialized before, see response_cache */
+  void send_cached_response(response_cache::response body)
+  {
+    cached_body = std::move(body);
+    cached_response.version(response.version());
+    cached_response.keep_alive(false);
+    cached_response.result(boost::beast::http::status::ok);
+    cached_response.set(boost::beast::http::field::content_type,
+                        "application/json");
+    cached_response.body() = { cached_body->data(), cached_body->size() };
+    cached_response.content_length(cached_body->size());
+    write_response(cached_response);
+  }
+
+  template<typename Message>
+  void write_response(Message& message)
+  {
+    if (trace)
+      trace_sending.emplace(trace.get(), "send response");
 
     boost::beast::http::async_write(
       socket,
-      response,
+      message,
       [self = shared_from_this()](boost::beast::error_code ec, std::size_t) {
         self->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
         self->socket.close();
+        // the trace is written once the processing is done with it as well
+        self->trace_sending.reset();
+        self->trace_request.reset();
+        self->trace.reset();
       });
   }
 
@@ -83,6 +137,12 @@ private:
     if (!start_response())
       return;
 
+    // sent as it is, without writing the JSON again
+    if (auto const& cached = processor.get_cached_response()) {
+      send_cached_response(cached);
+      return;
+    }
+
     response.result(boost::beast::http::status::ok);
     response.set(boost::beast::http::field::content_type, "application/json");
     {
@@ -93,6 +153,22 @@ private:
     send_response();
   }
 
+  void respond_with_session(boost::beast::http::status status,
+                            upload_session const& session)
+  {
+    if (!start_response())
+      return;
+
+    response.result(status);
+    response.set(boost::beast::http::field::content_type, "application/json");
+    {
+      auto stream = boost::beast::ostream(response.body());
+      session.write_json(stream);
+    }
+
+    send_response();
+  }
+
   template<typename T>
   bool is_authorized(boost::beast::http::request<T> const& request)
   {
@@ -112,50 +188,429 @@ private:
 
   void process_upload_request(std::string_view filename)
   {
-    auto const& request = request_parser.get();
-
-    if (!is_authorized(request)) {
+    if (!is_authorized(request_parser.get())) {
       respond_with_error(
         { "error.unauthorized", boost::beast::http::status::unauthorized });
       return;
     }
 
-    stop_processing_on_deadline();
-
-    std::cerr << "Starting processing of image of size "
-              << request.body().size() << " bytes" << std::endl;
+    trace = state.tracer.start_request();
+    if (trace) {
+      trace_request.emplace(trace.get(), "request");
+      trace_admission.emplace(trace.get(), "wait for memory");
+    }
 
-    image_processor::run(
-      state,
-      [self = weak_from_this()](std::exception const* e, std::shared_ptr<image_processor> proc) {
+    // the body is held in memory for the whole processing, so it is reserved
+    // before it is read. Chunked uploads reserve the upload limit
+    auto size = request_parser.content_length().value_or(
+      state.server_config.upload_limit_bytes);
+    bool admitted = state.memory.admit(
+      size,
+      [self = weak_from_this(), filename = std::string(filename)](
+        memory_budget::reservation memory) mutable {
         auto shared = self.lock();
-        if (!e) {
-          if (!shared) {
-            std::cerr << "Processing finished, but connection is dead"
-                      << std::endl;
-            return;
-          }
+        if (!shared)
+          return;
+        auto executor = shared->socket.get_executor();
+        boost::asio::post(executor,
+                          [shared = std::move(shared),
+                           filename = std::move(filename),
+                           memory = std::move(memory)]() mutable {
+                            shared->start_upload(filename, std::move(memory));
+                          });
+      });
+    if (!admitted) {
+      trace_admission.reset();
+      respond_with_error({ "error.server_busy",
+                           boost::beast::http::status::service_unavailable });
+    }
+  }
 
-          shared->respond_ok(*proc);
+  /** Response to the processing of an upload, once it is done */
+  auto processing_done_hook()
+  {
+    return [self = weak_from_this()](std::exception const* e,
+                                     std::shared_ptr<image_processor> proc) {
+      auto shared = self.lock();
+      if (!e) {
+        if (!shared) {
+          log_info("Processing finished, but connection is dead");
           return;
         }
 
-        auto loading_error = dynamic_cast<image_loading_error const*>(e);
-        if (loading_error && shared) {
-          shared->respond_with_error(
-            { "error.invalid_image", boost::beast::http::status::bad_request });
+        shared->respond_ok(*proc);
+        return;
+      }
+
+      auto loading_error = dynamic_cast<image_loading_error const*>(e);
+      if (loading_error && shared) {
+        shared->respond_with_error(
+          { "error.invalid_image", boost::beast::http::status::bad_request });
+        return;
+      }
+
+      // the connection already responded when reading the body failed
+      if (dynamic_cast<upload_failed_error const*>(e))
+        return;
+
+      auto too_large_error = dynamic_cast<image_too_large_error const*>(e);
+      if (too_large_error && shared) {
+        shared->respond_with_error(
+          { "error.image_too_large",
+            boost::beast::http::status::payload_too_large });
+        return;
+      }
+
+      auto busy_error = dynamic_cast<server_busy_error const*>(e);
+      if (busy_error && shared) {
+        shared->respond_with_error(
+          { "error.server_busy",
+            boost::beast::http::status::service_unavailable });
+        return;
+      }
+
+      log_error("Error processing image: ", e->what());
+      if (shared) {
+        shared->respond_with_error(
+          { "error.internal",
+            boost::beast::http::status::internal_server_error });
+      }
+    };
+  }
+
+  void start_upload(std::string const& filename,
+                    memory_budget::reservation memory)
+  {
+    trace_admission.reset();
+    // killed by the deadline while waiting for the memory
+    if (!socket.is_open())
+      return;
+
+    if (trace)
+      trace_receiving.emplace(trace.get(), "receive upload");
+
+    upload = std::make_shared<upload_stream>(
+      state.server_config.hash, request_parser.content_length().value_or(0));
+
+    image_processor::run(state,
+                         processing_done_hook(),
+                         upload,
+                         filename,
+                         trace,
+                         std::move(memory));
+
+    continue_reading_body();
+  }
+
+  void continue_reading_body()
+  {
+    if (request_parser.is_done()) {
+      log_debug("Received image of size ", body_size, " bytes");
+      trace_receiving.reset();
+      upload->finish();
+      stop_processing_on_deadline();
+      return;
+    }
+
+    auto& body = request_parser.get().body();
+    body.data = body_buffer.data();
+    body.size = body_buffer.size();
+    boost::beast::http::async_read(
+      socket,
+      buffer,
+      request_parser,
+      [self = shared_from_this()](boost::beast::error_code ec, std::size_t) {
+        // the buffer is full, which is what we want
+        if (ec == boost::beast::http::error::need_buffer)
+          ec = {};
+        if (ec) {
+          self->trace_receiving.reset();
+          self->upload->fail();
+          self->respond_with_read_error(ec);
           return;
         }
 
-        std::cerr << "Error processing image: " << e->what() << std::endl;
-        if (shared) {
-          shared->respond_with_error(
+        auto received =
+          self->body_buffer.size() - self->request_parser.get().body().size;
+        self->upload->append(self->body_buffer.data(), received);
+        self->body_size += received;
+        self->continue_reading_body();
+      });
+  }
+
+  void respond_with_read_error(boost::beast::error_code ec)
+  {
+    if (ec == boost::beast::http::error::body_limit) {
+      respond_with_error({ "error.payload_too_large",
+                           boost::beast::http::status::payload_too_large });
+    } else {
+      log_info("Error reading request: ", ec.message());
+      respond_with_error(
+        { "error.bad_request", boost::beast::http::status::bad_request });
+    }
+  }
+
+  /** Value of a numeric header of the resumable upload protocol */
+  std::optional<std::uint64_t> numeric_header(char const* name)
+  {
+    auto value = request_parser.get()[name];
+    std::uint64_t result;
+    auto end = value.data() + value.size();
+    auto err = std::from_chars(value.data(), end, result);
+    if (value.empty() || err.ec != std::errc() || err.ptr != end)
+      return std::nullopt;
+    return result;
+  }
+
+  /**
+   * Take the upload session of the request, responding with an error if it
+   * can't be used
+   */
+  bool acquire_session(std::string const& id)
+  {
+    auto [status, lease] = state.uploads->acquire(id);
+    if (status == upload_sessions::acquire_status::not_found) {
+      respond_with_error(
+        { "error.upload_not_found", boost::beast::http::status::not_found });
+      return false;
+    }
+    if (status == upload_sessions::acquire_status::in_use) {
+      respond_with_error(
+        { "error.upload_in_use", boost::beast::http::status::conflict });
+      return false;
+    }
+    session = std::move(lease);
+    return true;
+  }
+
+  /** POST /api/uploads?filename=..., with the size in Upload-Length */
+  void process_create_session_request(std::string_view filename)
+  {
+    auto length = numeric_header("Upload-Length");
+    if (!length) {
+      respond_with_error({ "error.missing_upload_length",
+                           boost::beast::http::status::bad_request });
+      return;
+    }
+    // the whole image is processed in memory, like a single upload
+    if (*length > state.server_config.upload_limit_bytes) {
+      respond_with_error({ "error.payload_too_large",
+                           boost::beast::http::status::payload_too_large });
+      return;
+    }
+
+    auto created = state.uploads->create(std::string(filename), *length);
+    if (!created.has_session()) {
+      respond_with_error({ "error.server_busy",
+                           boost::beast::http::status::service_unavailable });
+      return;
+    }
+    respond_with_session(boost::beast::http::status::created, *created);
+  }
+
+  /**
+   * PATCH /api/uploads/<id>, with a chunk starting at Upload-Offset. The data
+   * is kept as it arrives, so if the connection breaks, the client continues
+   * from the offset reported by GET.
+   */
+  void process_chunk_request(std::string const& id)
+  {
+    if (!acquire_session(id))
+      return;
+    auto offset = numeric_header("Upload-Offset");
+    if (!offset || *offset != session->get_offset()) {
+      respond_with_error({ "error.offset_mismatch",
+                           boost::beast::http::status::conflict });
+      return;
+    }
+    continue_reading_chunk();
+  }
+
+  void continue_reading_chunk()
+  {
+    if (request_parser.is_done()) {
+      respond_with_session(boost::beast::http::status::ok, *session);
+      session.reset();
+      return;
+    }
+
+    auto& body = request_parser.get().body();
+    body.data = body_buffer.data();
+    body.size = body_buffer.size();
+    boost::beast::http::async_read(
+      socket,
+      buffer,
+      request_parser,
+      [self = shared_from_this()](boost::beast::error_code ec, std::size_t) {
+        if (ec == boost::beast::http::error::need_buffer)
+          ec = {};
+
+        // what was received before an error is kept as well. The file is
+        // written on the pool, not to block the network thread, and the
+        // buffer is reused only once that is done
+        auto received =
+          self->body_buffer.size() - self->request_parser.get().body().size;
+        auto& pool = self->state.pool;
+        pool.add_task(self->state.stages.storage, [self, ec, received] {
+          bool fits = false;
+          bool failed = false;
+          try {
+            fits = self->session->append(self->body_buffer.data(), received);
+          } catch (std::exception const& e) {
+            log_error("Error writing upload chunk: ", e.what());
+            failed = true;
+          }
+          auto executor = self->socket.get_executor();
+          boost::asio::post(executor, [self, ec, fits, failed] {
+            self->chunk_appended(ec, fits, failed);
+          });
+        });
+      });
+  }
+
+  /** Continue reading the chunk after a part of it was appended */
+  void chunk_appended(boost::beast::error_code ec, bool fits, bool failed)
+  {
+    if (ec || !fits || failed) {
+      session.reset();
+      if (failed)
+        respond_with_error(
+          { "error.internal",
+            boost::beast::http::status::internal_server_error });
+      else if (!fits)
+        respond_with_error({ "error.payload_too_large",
+                             boost::beast::http::status::payload_too_large });
+      else
+        respond_with_read_error(ec);
+      return;
+    }
+    continue_reading_chunk();
+  }
+
+  /** POST /api/uploads/<id>/finalize, processes the complete upload */
+  void process_finalize_request(std::string const& id)
+  {
+    if (!acquire_session(id))
+      return;
+    if (session->get_offset() != session->get_length()) {
+      respond_with_error({ "error.upload_incomplete",
+                           boost::beast::http::status::conflict });
+      return;
+    }
+
+    trace = state.tracer.start_request();
+    if (trace) {
+      trace_request.emplace(trace.get(), "request");
+      trace_admission.emplace(trace.get(), "wait for memory");
+    }
+    bool admitted = state.memory.admit(
+      session->get_length(),
+      [self = weak_from_this()](memory_budget::reservation memory) mutable {
+        auto shared = self.lock();
+        if (!shared)
+          return;
+        auto executor = shared->socket.get_executor();
+        boost::asio::post(
+          executor,
+          [shared = std::move(shared), memory = std::move(memory)]() mutable {
+            shared->start_finalized_upload(std::move(memory));
+          });
+      });
+    if (!admitted) {
+      trace_admission.reset();
+      // the client may finalize the session again later
+      session.reset();
+      respond_with_error({ "error.server_busy",
+                           boost::beast::http::status::service_unavailable });
+    }
+  }
+
+  void start_finalized_upload(memory_budget::reservation memory)
+  {
+    trace_admission.reset();
+    // killed by the deadline while waiting for the memory
+    if (!socket.is_open())
+      return;
+    // the lease keeps the session until its data is taken
+    state.uploads->remove(session->get_id());
+    stop_processing_on_deadline();
+
+    // the file is read on the pool, not to block the network thread
+    state.pool.add_task(
+      state.stages.storage,
+      [self = shared_from_this(), memory = std::move(memory)]() mutable {
+        try {
+          auto [data, hash] = self->session->take();
+          auto filename = self->session->get_filename();
+          self->session.reset();
+          image_processor::run(self->state,
+                               self->processing_done_hook(),
+                               std::move(data),
+                               filename,
+                               self->trace,
+                               std::move(memory),
+                               std::move(hash));
+        } catch (std::exception const& e) {
+          log_error("Error finalizing upload: ", e.what());
+          self->respond_with_error(
             { "error.internal",
               boost::beast::http::status::internal_server_error });
         }
-      },
-      request.body(),
-      std::string(filename));
+      });
+  }
+
+  /** Requests of the resumable upload protocol, see upload_sessions.hpp */
+  void process_session_request(std::string_view path)
+  {
+    if (!is_authorized(request_parser.get())) {
+      respond_with_error(
+        { "error.unauthorized", boost::beast::http::status::unauthorized });
+      return;
+    }
+
+    auto method = request_parser.get().method();
+    auto slash = path.find('/');
+    auto id = std::string(path.substr(0, slash));
+    auto action = slash == std::string_view::npos ? "" : path.substr(slash + 1);
+
+    if (action == "finalize" && method == boost::beast::http::verb::post)
+      return process_finalize_request(id);
+    if (!action.empty()) {
+      respond_with_error(
+        { "error.not_found", boost::beast::http::status::not_found });
+      return;
+    }
+    if (method == boost::beast::http::verb::patch)
+      return process_chunk_request(id);
+    if (method == boost::beast::http::verb::get) {
+      if (!acquire_session(id))
+        return;
+      respond_with_session(boost::beast::http::status::ok, *session);
+      session.reset();
+      return;
+    }
+    respond_with_error({ "error.method_not_allowed",
+                         boost::beast::http::status::method_not_allowed });
+  }
+
+  void process_metrics_request()
+  {
+    if (!is_authorized(request_parser.get())) {
+      respond_with_error(
+        { "error.unauthorized", boost::beast::http::status::unauthorized });
+      return;
+    }
+
+    if (!start_response())
+      return;
+
+    response.result(boost::beast::http::status::ok);
+    {
+      auto stream = boost::beast::ostream(response.body());
+      state.metrics.write_json(stream);
+    }
+
+    send_response();
   }
 
   void process_request(boost::beast::error_code read_ec)
@@ -166,16 +621,7 @@ private:
     response.set(boost::beast::http::field::content_type, "application/json");
 
     if (read_ec) {
-      if (read_ec == boost::beast::http::error::body_limit) {
-        respond_with_error({ "error.payload_too_large",
-                             boost::beast::http::status::payload_too_large });
-      } else {
-        std::cerr << "Error reading request: " << read_ec.message()
-                  << std::endl;
-        respond_with_error(
-          { "error.bad_request", boost::beast::http::status::bad_request });
-      }
-
+      respond_with_read_error(read_ec);
       return;
     }
 
@@ -188,7 +634,7 @@ private:
       std::string_view(target_path.data(), target_path.size()), &base_url);
 
     if (!url) {
-      std::cerr << "Error parsing URL: " << request.target() << std::endl;
+      log_warning("Error parsing URL: ", request.target());
       respond_with_error({ "error.internal",
                            boost::beast::http::status::internal_server_error });
       return;
@@ -210,6 +656,41 @@ private:
       return process_upload_request(*filename);
     }
 
+    // resumable uploads, if enabled
+    if (state.uploads && url->get_pathname() == "/api/uploads") {
+      if (request.method() != boost::beast::http::verb::post) {
+        respond_with_error({ "error.method_not_allowed",
+                             boost::beast::http::status::method_not_allowed });
+        return;
+      }
+      if (!is_authorized(request)) {
+        respond_with_error(
+          { "error.unauthorized", boost::beast::http::status::unauthorized });
+        return;
+      }
+
+      ada::url_search_params params(url->get_search());
+      auto filename = params.get("filename");
+      if (!filename) {
+        respond_with_error({ "error.missing_filename",
+                             boost::beast::http::status::bad_request });
+        return;
+      }
+      return process_create_session_request(*filename);
+    }
+    auto pathname = url->get_pathname();
+    if (state.uploads && pathname.substr(0, 13) == "/api/uploads/")
+      return process_session_request(pathname.substr(13));
+
+    if (url->get_pathname() == "/api/metrics") {
+      if (request.method() != boost::beast::http::verb::get) {
+        respond_with_error({ "error.method_not_allowed",
+                             boost::beast::http::status::method_not_allowed });
+        return;
+      }
+      return process_metrics_request();
+    }
+
     // any other handlers here
 
     respond_with_error(
@@ -226,11 +707,10 @@ private:
       [self = shared_from_this()](boost::beast::error_code ec) {
         if (ec) {
           if (ec.value() != boost::asio::error::operation_aborted)
-            std::cerr << "Error waiting on socket deadline: " << ec.message()
-                      << std::endl;
+            log_error("Error waiting on socket deadline: ", ec.message());
           return;
         }
-        std::cerr << "Timeout: killing socket" << std::endl;
+        log_info("Timeout: killing socket");
         self->socket.close(ec);
       });
   }
@@ -243,12 +723,11 @@ private:
     processing_stop_deadline.async_wait([self = shared_from_this()](boost::beast::error_code ec) {
       if (ec) {
         if (ec.value() != boost::asio::error::operation_aborted)
-          std::cerr << "Error waiting on processing deadline: " << ec.message()
-                    << std::endl;
+          log_error("Error waiting on processing deadline: ", ec.message());
         return;
       }
 
-      std::cerr << "Timeout: stopping processing" << std::endl;
+      log_info("Timeout: stopping processing");
 
       // if we already responded before, it gets noticed inside
       // respond_with_error
@@ -271,7 +750,8 @@ public:
   {
     request_parser.body_limit(state.server_config.upload_limit_bytes);
 
-    boost::beast::http::async_read(
+    // a Content-Length over the limit is reported already here
+    boost::beast::http::async_read_header(
       socket,
       buffer,
       request_parser,
@@ -1,17 +1,30 @@
 #ifndef IMAGE_PROCESSING_HPP
 #define IMAGE_PROCESSING_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <functional>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <string_view>
+#include <tuple>
 
 using namespace std::string_view_literals;
 
-#include <magic.h>
 #include <vips/vips8>
 
+#include "claims.hpp"
+#include "coro.hpp"
+#include "format_sniffing.hpp"
+#include "logger.hpp"
+#include "metadata.hpp"
+#include "response_cache.hpp"
 #include "server_state.hpp"
 #include "thread_pool.hpp"
+#include "tracing.hpp"
+#include "upload_stream.hpp"
 #include "utils.hpp"
 
 class image_loading_error : public std::runtime_error
@@ -23,6 +36,40 @@ public:
   }
 };
 
+class image_too_large_error : public std::runtime_error
+{
+public:
+  image_too_large_error()
+    : std::runtime_error("")
+  {
+  }
+};
+
+/** The memory budget can't fit the processing of the image at the moment */
+class server_busy_error : public std::runtime_error
+{
+public:
+  server_busy_error()
+    : std::runtime_error("")
+  {
+  }
+};
+
+/** Properties of an image that can be read from its header, without decoding */
+struct image_header
+{
+  dimension_t width = 0;
+  dimension_t height = 0;
+  int bands = 0;
+  VipsBandFormat band_format = VIPS_FORMAT_UCHAR;
+  int pages = 1;
+
+  std::uint64_t pixels() const
+  {
+    return std::uint64_t(width) * height * pages;
+  }
+};
+
 struct dimensions_spec
 {
   dimension_t width;
@@ -57,84 +104,261 @@ struct dimensions_spec
   }
 };
 
+/** Header of a lazily loaded image, no pixel data is decoded */
+image_header
+read_header(vips::VImage const& image)
+{
+  image_header result;
+  result.width = image.width();
+  result.height = image.height();
+  result.bands = image.bands();
+  result.band_format = image.format();
+  result.pages = vips_image_get_n_pages(image.get_image());
+  return result;
+}
+
+/** Output formats which keep all frames of an animated image */
+bool
+supports_animation(std::string_view format)
+{
+  return format == "gif" || format == "webp";
+}
+
+/**
+ * Options of thumbnail_buffer implementing the metadata policy. Rotation and
+ * colour conversion are done by the thumbnail operation itself, after
+ * shrink-on-load, so they run on the (usually much smaller) variant instead of
+ * the full original.
+ */
+vips::VOption*
+thumbnail_options(metadata_policy const& policy,
+                  std::string const& option_string = "")
+{
+  auto options = vips::VImage::option();
+  if (!option_string.empty())
+    options->set("option_string", option_string.c_str());
+  if (!policy.autorotate)
+    options->set("no_rotate", true);
+  if (policy.convert_to_srgb)
+    options->set("export_profile", "srgb");
+  return options;
+}
+
+/** Remove the metadata fields the policy doesn't keep */
+vips::VImage
+apply_metadata_policy(metadata_policy const& policy, vips::VImage image)
+{
+  if (!policy.strip)
+    return image;
+
+  // metadata of an image may be shared with other references, only a fresh
+  // copy can be modified
+  image = image.copy();
+  gchar** fields = vips_image_get_fields(image.get_image());
+  for (gchar** field = fields; *field; ++field) {
+    if (!policy.keeps_field(*field))
+      image.remove(*field);
+  }
+  g_strfreev(fields);
+  return image;
+}
+
+/**
+ * Rough peak memory of creating variants of the given widths, which are
+ * resized in parallel: each task holds its variant decoded, and about as much
+ * again in the buffers of the encoders.
+ */
+std::uint64_t
+estimate_variants_memory(image_header const& header,
+                         std::vector<dimension_t> const& widths)
+{
+  double pixel_size =
+    double(header.bands) * vips_format_sizeof(header.band_format);
+  double total = 0;
+  for (auto width : widths) {
+    double scale = double(width) / header.width;
+    total += scale * scale * header.pixels() * pixel_size;
+  }
+  return std::uint64_t(2 * total);
+}
+
+static std::atomic<bool> image_processing_initialized{ false };
+
 void
 init_image_processing(server_state& state)
 {
   if (VIPS_INIT("asset-server")) {
     throw std::runtime_error("Failed to initialize libvips");
   }
+  // libvips spawns its own workers for each operation, on top of our thread
+  // pool, so the two must be sized together to avoid oversubscribing the CPU
+  vips_concurrency_set(state.server_config.get_vips_concurrency());
+  // the operation cache is part of the memory budget, the uploads share the
+  // rest of it
+  if (auto cache_size = state.server_config.memory.get_vips_cache_size())
+    vips_cache_set_max_mem(cache_size);
 
-  state.magic_cookie = magic_open(MAGIC_EXTENSION);
-  int result = magic_load(state.magic_cookie, nullptr);
-  if (result != 0)
-    throw std::runtime_error("Failed to load default libmagic database");
+  // encoder presets are checked by encoding a tiny image, so that a typo in
+  // the config fails the startup, not every upload
+  auto probe =
+    vips::VImage::black(16, 16, vips::VImage::option()->set("bands", 3));
+  for (auto const& suffix : state.server_config.encoding.get_all_suffixes()) {
+    try {
+      void* buffer;
+      size_t size;
+      probe.write_to_buffer(suffix.c_str(), &buffer, &size);
+      g_free(buffer);
+    } catch (vips::VError const& e) {
+      throw std::runtime_error("Invalid encoder preset " + suffix + ": " +
+                               e.what());
+    }
+  }
+
+  image_processing_initialized = true;
 }
 
 void
-destroy_image_processing(server_state& state)
+destroy_image_processing(server_state&)
 {
-  magic_close(state.magic_cookie);
+  image_processing_initialized = false;
   vips_shutdown();
 }
 
-class image_processor : public std::enable_shared_from_this<image_processor>
+/**
+ * The processing of one upload, as a coroutine (see process()) running on the
+ * thread pool. Waiting for the upload, for other threads or processes
+ * processing the same image, or for parallel resize and encode tasks suspends
+ * the coroutine, so no pool thread is blocked.
+ *
+ * Each step moves to its stage of the pool (see pipeline_stages) when it
+ * starts, so that e.g. the lookup of an already stored image doesn't wait for
+ * the encoders of other uploads.
+ */
+class image_processor
 {
 private:
   using ReadyHook = std::function<void(std::exception const*,
                                        std::shared_ptr<image_processor>)>;
 
-  task_group group;
   server_state state;
   ReadyHook ready_hook;
+  cancellation_token cancellation;
+  /** Set if the request is traced, see tracing.hpp */
+  std::shared_ptr<request_trace> trace;
+
+  /**
+   * Memory budget of the processing: the upload while it is held, and the
+   * variants while they are created. Declared before `data`, so that it is
+   * released after it.
+   */
+  memory_budget::reservation memory;
+
+  /** The uploaded file, owned by the processor for the whole processing */
+  std::vector<std::uint8_t> data;
+  /** libvips view of `data` (no copy), shared by all resize tasks */
+  VipsBlob* data_blob = nullptr;
+  image_header header;
+
+  /** Body of an upload that is still being received, null otherwise */
+  std::shared_ptr<upload_stream> upload;
+  /** Position of the libvips source reading from the upload */
+  std::size_t upload_offset = 0;
+  /**
+   * The largest variant, created while the upload was being received or
+   * before the other variants, which are then resized from it.
+   */
+  std::optional<vips::VImage> decoded;
+  dimension_t decoded_width = 0;
+
+  /** All frames of an animated image are processed */
+  bool animated = false;
 
   /**
-   * Notifier from the server's hashmap, either to sleep on, or to notify
-   * others waiting for this image
+   * Notifier from the server's hashmap, set if this processor processes the
+   * image, to notify others waiting for it
    */
-  std::shared_ptr<std::atomic<bool>> processing_done_notifier;
+  std::shared_ptr<async_event> processing_done_notifier;
+  /** Claim of this image across server processes, see claims.hpp */
+  std::unique_ptr<claim_registry::claim> claim;
   std::unique_ptr<staged_folder> temp_folder;
 
   std::vector<dimensions_spec> dimensions;
+  /** Response of a stored image found in state.responses */
+  response_cache::response cached_response;
   std::string hash;
   std::string filename;
   dimensions_spec
     original; // the vector of formats MUST contain exactly one item
   bool is_new = false;
 
+  /** Move to a stage of the pool, see pipeline_stages */
+  traced_schedule_awaiter enter_stage(stage_id stage)
+  {
+    return {
+      state.pool, stage, trace.get(), state.stages.options[stage].name, {}
+    };
+  }
+
   /**
-   * This is called as a callback when task_group is done
+   * This is called when process() is done, error is null if it succeeded
    */
-  void finalize(std::exception const* e)
+  void finalize(std::exception_ptr error,
+                std::shared_ptr<image_processor> self)
   {
     if (processing_done_notifier) {
-      if (!e) {
-        state.server_config.storage->commit_staged_folder(*temp_folder);
-      }
+      claim.reset();
 
       {
         std::lock_guard lock(state.currently_processing_mutex);
         state.currently_processing.erase(hash);
       }
-      processing_done_notifier->store(false);
-      processing_done_notifier->notify_all();
+      processing_done_notifier->set(state.pool, state.stages.dedup);
     }
     // here you can add any work that needs to be done after all files are
     // ready in the staged folder
 
-    std::invoke(ready_hook, e, shared_from_this());
+    if (!error) {
+      std::invoke(ready_hook, nullptr, std::move(self));
+      return;
+    }
+    try {
+      std::rethrow_exception(error);
+    } catch (std::exception const& e) {
+      std::invoke(ready_hook, &e, std::move(self));
+    } catch (...) {
+      std::runtime_error e("Unknown error");
+      std::invoke(ready_hook, &e, std::move(self));
+    }
   }
 
-  void save_to_format(std::shared_ptr<vips::VImage> img,
-                      unsigned dimension_index,
-                      unsigned format_index)
+  pool_task<void> save_to_format(vips::VImage img,
+                                 unsigned dimension_index,
+                                 unsigned format_index)
   {
     auto& spec = dimensions[dimension_index];
     auto& format = spec.formats[format_index];
+    co_await enter_stage(state.stages.encoder(format));
+    cancellation.throw_if_cancelled();
 
     std::uint8_t* buffer;
     size_t size;
-    img->write_to_buffer(("." + format).c_str(), (void**)&buffer, &size);
+    auto suffix = state.server_config.get_save_suffix(format, spec.width);
+    {
+      trace_span span(trace.get(), "encode");
+      if (span)
+        span.arg("format", format).arg("width", spec.width);
+      if (animated && !supports_animation(format)) {
+        // the frames are stacked vertically, keep only the first one
+        img.extract_area(0, 0, img.width(), spec.height)
+          .write_to_buffer(suffix.c_str(), (void**)&buffer, &size);
+      } else {
+        img.write_to_buffer(suffix.c_str(), (void**)&buffer, &size);
+      }
+    }
 
+    trace_span span(trace.get(), "write variant");
+    if (span)
+      span.arg("format", format).arg("width", spec.width).arg("bytes", size);
     temp_folder->create_file(std::to_string(spec.width) + "x" +
                                std::to_string(spec.height) + "/" + filename +
                                "." + format,
@@ -143,13 +367,166 @@ private:
     g_free(buffer);
   }
 
-  void resize(std::shared_ptr<vips::VImage> img, unsigned index)
+  vips::VOption* load_options(std::string const& option_string = "") const
+  {
+    return thumbnail_options(state.server_config.metadata, option_string);
+  }
+
+  vips::VImage normalize_metadata(vips::VImage image) const
+  {
+    return apply_metadata_policy(state.server_config.metadata, image);
+  }
+
+  pool_task<void> resize(unsigned index)
+  {
+    co_await enter_stage(state.stages.resize);
+    cancellation.throw_if_cancelled();
+    auto& spec = dimensions[index];
+
+    // the source is decoded only once, into the largest variant (see
+    // decode_largest), and the smaller ones are resized from it
+    vips::VImage resized;
+    try {
+      trace_span span(trace.get(), "resize");
+      if (span)
+        span.arg("width", spec.width);
+      if (spec.width == decoded_width) {
+        resized = normalize_metadata(*decoded);
+      } else {
+        // rotation and colour conversion were already applied to it
+        resized = normalize_metadata(decoded->thumbnail_image(
+          spec.width, vips::VImage::option()->set("no_rotate", true)));
+      }
+    } catch (vips::VError const& e) {
+      log_warning("Failed to load image: ", e.what());
+      throw image_loading_error();
+    }
+    spec.height = resized.height();
+    co_await save_variant(index, std::move(resized));
+  }
+
+  /**
+   * Decode the image into its largest variant, unless that was done during
+   * the upload. thumbnail_buffer picks the cheapest way of loading for that
+   * size (e.g. JPEG shrink-on-load), and formats which can't shrink on load
+   * (like PNG) are decoded once instead of once per variant. All frames of an
+   * animated image are decoded, stacked vertically.
+   */
+  pool_task<void> decode_largest()
+  {
+    co_await enter_stage(state.stages.resize);
+    cancellation.throw_if_cancelled();
+    dimension_t width = 0;
+    for (auto const& spec : dimensions)
+      width = std::max(width, spec.width);
+    try {
+      trace_span span(trace.get(), "decode");
+      if (span)
+        span.arg("width", width);
+      decoded = vips::VImage::thumbnail_buffer(
+                  data_blob, width, load_options(animated ? "n=-1" : ""))
+                  .copy_memory();
+      decoded_width = width;
+    } catch (vips::VError const& e) {
+      log_warning("Failed to load image: ", e.what());
+      throw image_loading_error();
+    }
+  }
+
+  /**
+   * Resize an animated image for the variant from its decoded frames (see
+   * decode_largest). The frames are split into ranges resized by parallel
+   * tasks, so that a long animation doesn't keep one worker busy for the whole
+   * time, and then joined.
+   */
+  pool_task<void> resize_animated(unsigned index)
   {
+    co_await enter_stage(state.stages.resize);
     auto& spec = dimensions[index];
+    int source_page_height = vips_image_get_page_height(decoded->get_image());
+    int pages = decoded->height() / source_page_height;
+    if (spec.width == decoded_width) {
+      spec.height = source_page_height;
+      co_await save_variant(index, normalize_metadata(*decoded));
+      co_return;
+    }
+
+    // the frames were fitted into a decoded_width square like resize() does,
+    // fit them into the square of the variant, keeping their aspect ratio
+    double scale = std::min(double(spec.width) / decoded->width(),
+                            double(spec.width) / source_page_height);
+    int per_task = state.server_config.animation_frames_per_task;
+    int range_count = (pages + per_task - 1) / per_task;
+
+    std::vector<vips::VImage> ranges(range_count);
+    std::vector<pool_task<void>> tasks;
+    for (int range = 0; range < range_count; ++range) {
+      int first = range * per_task;
+      int count = std::min(per_task, pages - first);
+      tasks.push_back(resize_frames(index, first, count, scale, ranges[range]));
+    }
+    co_await when_all(state.pool, std::move(tasks));
+    // all frames are resized alike, so each has the height of the first one
+    int page_height = ranges[0].height() / std::min(per_task, pages);
+
+    auto joined =
+      vips::VImage::arrayjoin(ranges, vips::VImage::option()->set("across", 1));
+    ranges.clear();
+    joined.set("page-height", page_height);
+    joined.set("n-pages", pages);
+    if (decoded->get_typeof("delay") != 0)
+      joined.set("delay", decoded->get_array_int("delay"));
+    if (decoded->get_typeof("loop") != 0)
+      joined.set("loop", decoded->get_int("loop"));
+
+    spec.height = page_height;
+    co_await save_variant(index, normalize_metadata(joined));
+  }
+
+  /**
+   * Resize decoded frames [first, first + count) for the variant by scale
+   * into `out`
+   */
+  pool_task<void> resize_frames(unsigned index,
+                                int first,
+                                int count,
+                                double scale,
+                                vips::VImage& out)
+  {
+    co_await enter_stage(state.stages.resize);
+    cancellation.throw_if_cancelled();
+    try {
+      trace_span span(trace.get(), "resize frames");
+      if (span)
+        span.arg("width", dimensions[index].width)
+          .arg("first", first)
+          .arg("count", count);
+      int source_page_height =
+        vips_image_get_page_height(decoded->get_image());
+      // resize each frame on its own, so that all of them get the same height
+      std::vector<vips::VImage> frames;
+      for (int page = first; page < first + count; ++page)
+        frames.push_back(decoded
+                           ->extract_area(0,
+                                          page * source_page_height,
+                                          decoded->width(),
+                                          source_page_height)
+                           .resize(scale));
+      // render now, in this task, rather than lazily when the ranges are
+      // joined
+      out = vips::VImage::arrayjoin(frames,
+                                    vips::VImage::option()->set("across", 1))
+              .copy_memory();
+    } catch (vips::VError const& e) {
+      log_warning("Failed to load image: ", e.what());
+      throw image_loading_error();
+    }
+  }
 
-    auto resized =
-      std::make_shared<vips::VImage>(img->thumbnail_image(spec.width));
-    spec.height = resized->height();
+  /** Create the folder of a resized variant, and save it in all formats */
+  pool_task<void> save_variant(unsigned index, vips::VImage resized)
+  {
+    auto& spec = dimensions[index];
 
     temp_folder->create_folder(std::to_string(spec.width) + "x" +
                                std::to_string(spec.height));
@@ -158,51 +535,81 @@ private:
       spec.formats.push_back(std::move(format));
     }
 
-    auto self = shared_from_this();
-    for (unsigned i = 0; i < spec.formats.size(); ++i) {
-      group.add_task([resized, index, i, self]() {
-        self->save_to_format(resized, index, i);
-      });
+    std::vector<pool_task<void>> saves;
+    for (unsigned i = 0; i < spec.formats.size(); ++i)
+      saves.push_back(save_to_format(resized, index, i));
+    co_await when_all(state.pool, std::move(saves));
+  }
+
+  /**
+   * Read the image header (no pixel data is decoded), and reject images that
+   * would be too large to process.
+   */
+  image_header probe_header() const
+  {
+    image_header result;
+    try {
+      // libvips loads lazily: until pixels are requested, only the header is
+      // parsed
+      result = read_header(vips::VImage::new_from_buffer(
+        data.data(),
+        data.size(),
+        "",
+        vips::VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL)));
+    } catch (vips::VError const& e) {
+      log_warning("Failed to load image: ", e.what());
+      throw image_loading_error();
     }
+
+    if (result.pixels() > state.server_config.max_image_pixels) {
+      log_info("Rejecting image of ",
+               result.width,
+               "x",
+               result.height,
+               " pixels and ",
+               result.pages,
+               " pages");
+      throw image_too_large_error();
+    }
+    return result;
   }
 
   /**
    * Start processing after we've determined that this image is new, and any
    * necessary synchronization was set up.
    */
-  void load_image(std::vector<std::uint8_t> const& data)
+  pool_task<void> load_image()
   {
+    co_await enter_stage(state.stages.storage);
+    cancellation.throw_if_cancelled();
     temp_folder = state.server_config.storage->create_staged_folder(hash);
 
-    auto magic_format =
-      magic_buffer(state.magic_cookie, data.data(), data.size());
-    if (!magic_format || std::string_view(magic_format) == "???"sv) {
-      std::cerr << "Failed to determine correct original format of image, "
-                   "trusting the uploader"
-                << std::endl;
-    } else {
-      std::size_t first_noninclusive = 0;
-      while (magic_format[first_noninclusive] != '/' &&
-             magic_format[first_noninclusive] != '\0') {
-        ++first_noninclusive;
+    {
+      trace_span span(trace.get(), "probe");
+      auto format = sniff_format(
+        data.data(), data.size(), state.server_config.libmagic_fallback);
+      if (!format) {
+        log_info("Failed to determine correct original format of image, "
+                 "trusting the uploader");
+      } else {
+        original.formats[0] = std::move(*format);
       }
-      original.formats[0] = std::string(magic_format, first_noninclusive);
-    }
 
-    temp_folder->create_file(
-      filename + "." + original.formats[0], data.data(), data.size());
+      header = probe_header();
+      original.width = header.width;
+      original.height = header.height;
+    }
 
-    std::shared_ptr<vips::VImage> image;
-    try {
-      image = std::make_shared<vips::VImage>(
-        vips::VImage::new_from_buffer(data.data(), data.size(), nullptr));
-    } catch (vips::VError const& e) {
-      std::cerr << "Failed to load image: " << e.what() << std::endl;
-      throw image_loading_error();
+    {
+      trace_span span(trace.get(), "write original");
+      if (span)
+        span.arg("bytes", std::int64_t(data.size()));
+      temp_folder->create_file(
+        filename + "." + original.formats[0], data.data(), data.size());
     }
-    original.width = image->width();
-    original.height = image->height();
 
+    // the whole plan is known from the header, so all resize tasks can start
+    // right away.
     // we won't need any lock on the dimensions array: we push all the elements
     // here, and then each parallel resize task will only write to its own
     // element
@@ -213,10 +620,59 @@ private:
       dimensions.push_back(spec);
     }
 
-    auto self = shared_from_this();
-    for (unsigned i = 0; i < dimensions.size(); ++i) {
-      group.add_task([image, i, self]() { self->resize(image, i); });
+    data_blob = vips_blob_new(nullptr, data.data(), data.size());
+    // only the first page is loaded, unless some output keeps the animation
+    auto formats = state.server_config.get_formats(original.formats[0]);
+    animated = header.pages > 1 && supports_animation(original.formats[0]) &&
+               std::any_of(formats.begin(), formats.end(), supports_animation);
+    if (!animated)
+      header.pages = 1;
+
+    auto variants_memory = estimate_variants_memory();
+    co_await reserve_memory(variants_memory);
+
+    if (!decoded && !dimensions.empty())
+      co_await decode_largest();
+
+    std::vector<pool_task<void>> variants;
+    for (unsigned i = 0; i < dimensions.size(); ++i)
+      variants.push_back(animated ? resize_animated(i) : resize(i));
+    co_await when_all(state.pool, std::move(variants));
+    memory.release(variants_memory);
+  }
+
+  std::uint64_t estimate_variants_memory() const
+  {
+    std::vector<dimension_t> widths;
+    for (auto const& spec : dimensions)
+      widths.push_back(spec.width);
+    return ::estimate_variants_memory(header, widths);
+  }
+
+  /** Grow the memory reservation, waiting until the budget allows it */
+  pool_task<void> reserve_memory(std::uint64_t size)
+  {
+    auto result = memory_budget::grow_result::granted;
+    {
+      trace_wait wait(trace.get(), "wait for memory");
+      co_await resume_on_callback(
+        state.pool, state.stages.storage, [this, size, &result](auto resume) {
+          state.memory.grow(
+            memory,
+            size,
+            [&result, resume = std::move(resume)](auto grown) {
+              result = grown;
+              resume();
+            });
+        });
     }
+    if (result == memory_budget::grow_result::too_large) {
+      log_info("Rejecting image needing ", size, " bytes to process");
+      throw image_too_large_error();
+    }
+    if (result == memory_budget::grow_result::busy)
+      throw server_busy_error();
+    cancellation.throw_if_cancelled();
   }
 
   /**
@@ -230,6 +686,15 @@ private:
    */
   bool find_existing_data(std::string const& hash)
   {
+    trace_span span(trace.get(), "lookup");
+    std::uint64_t epoch = 0;
+    if (state.responses) {
+      cached_response = state.responses->find(hash);
+      if (cached_response)
+        return true;
+      epoch = state.responses->epoch(hash);
+    }
+
     auto folder = state.server_config.storage->walk_folder(hash);
     if (!folder)
       return false;
@@ -240,9 +705,11 @@ private:
         continue;
 
       if (original_filename) {
-        std::cerr << "Warning: multiple files found in root folder for hash "
-                  << hash << ", using " << original_filename << " as original"
-                  << std::endl;
+        log_warning("Multiple files found in root folder for hash ",
+                    hash,
+                    ", using ",
+                    *original_filename,
+                    " as original");
       }
       original_filename = &entry.name;
     }
@@ -272,52 +739,253 @@ private:
       dimensions.push_back(std::move(spec));
     }
 
+    if (state.responses)
+      state.responses->insert(hash, stored_result_json(), epoch);
     return true;
   }
 
-  void check_existence(std::vector<std::uint8_t> const& data)
+  /**
+   * The response to this image as find_existing_data() reads it from the
+   * storage, i.e. without the dimensions of the original and with sorted
+   * formats, so that cached and uncached responses are the same
+   */
+  std::string stored_result_json() const
   {
-    hash = sha256(data);
-    hash.resize(16);
-    if (find_existing_data(hash))
-      // existing data was found and filled into fields of this class, this task
-      // can end, which will cause the task_group to finish and call finalize()
+    std::ostringstream stream;
+    stream << "{\"hash\": \"" << hash << "\", \"filename\": \"" << filename
+           << "\", \"original\": ";
+    dimensions_spec{ 0, 0, original.formats }.write_json(stream);
+    stream << ", \"variants\": [";
+    bool first = true;
+    for (auto spec : dimensions) {
+      if (!first)
+        stream << ", ";
+      first = false;
+      std::sort(spec.formats.begin(), spec.formats.end());
+      spec.write_json(stream);
+    }
+    stream << "]}";
+    return std::move(stream).str();
+  }
+
+  /** Enough of an upload to recognize its format */
+  static constexpr std::size_t SNIFF_SIZE = 64;
+
+  /**
+   * Wait for an upload that is still being received. Once its format is
+   * known, it is decoded during the transfer if possible.
+   */
+  pool_task<void> receive_upload()
+  {
+    {
+      trace_wait wait(trace.get(), "wait for start of upload");
+      co_await resume_on_callback(
+        state.pool, state.stages.decode, [this](auto resume) {
+          upload->when_received(SNIFF_SIZE, std::move(resume));
+        });
+    }
+    decode_during_upload();
+
+    trace_wait wait(trace.get(), "wait for end of upload");
+    co_await resume_on_callback(
+      state.pool, state.stages.dedup, [this](auto resume) {
+        upload->when_ended(std::move(resume));
+      });
+    if (upload->failed())
+      throw upload_failed_error();
+    std::tie(data, hash) = upload->take();
+  }
+
+  /**
+   * For formats which libvips decodes sequentially, create the largest
+   * variant from the upload as it arrives, so that the decoding overlaps with
+   * the network transfer. This occupies a pool thread for the rest of the
+   * transfer, so only max_progressive_decodes uploads do it at once.
+   *
+   * Any failure here is not reported, the upload is then processed as if
+   * this didn't happen, and the normal loading reports invalid images.
+   */
+  void decode_during_upload()
+  {
+    auto prefix = upload->peek(SNIFF_SIZE);
+    auto format = sniff_format(prefix.data(), prefix.size(), false);
+    if (!format || (*format != "jpeg" && *format != "png"))
       return;
 
-    bool should_process_here;
+    auto& active = state.metrics.progressive_decodes;
+    auto limit = state.server_config.get_max_progressive_decodes();
+    if (active.fetch_add(1) >= limit) {
+      active.fetch_sub(1);
+      return;
+    }
+    state.metrics.progressive_decodes_total.fetch_add(1);
+    trace_span span(trace.get(), "decode during upload");
+
+    auto custom = vips_source_custom_new();
+    g_signal_connect(custom, "read", G_CALLBACK(read_upload), this);
+    vips::VSource source(VIPS_SOURCE(custom));
+    try {
+      auto image = vips::VImage::new_from_source(
+        source,
+        "",
+        vips::VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+      auto info = read_header(image);
+      auto sizes = state.server_config.get_sizes(info.width);
+      if (info.pixels() <= state.server_config.max_image_pixels &&
+          info.pages == 1 && !sizes.empty()) {
+        decoded_width = *sizes.rbegin();
+        // copy_memory pulls the pixels through now, while the data arrives
+        decoded = image.thumbnail_image(decoded_width, load_options())
+                    .copy_memory();
+      }
+    } catch (vips::VError const& e) {
+      log_info("Failed to decode image during upload: ", e.what());
+      decoded.reset();
+    }
+    active.fetch_sub(1);
+  }
+
+  /** Read callback of the libvips source decoding the upload */
+  static gint64 read_upload(VipsSourceCustom*,
+                            void* buffer,
+                            gint64 length,
+                            image_processor* self)
+  {
+    try {
+      auto size = self->upload->read(self->upload_offset, buffer, length);
+      self->upload_offset += size;
+      return size;
+    } catch (upload_failed_error const&) {
+      return -1;
+    }
+  }
+
+  /** The whole processing, from the upload to the stored variants */
+  pool_task<void> process()
+  {
+    if (upload)
+      co_await receive_upload();
+
+    // the hash of an upload is computed as it is received
+    if (hash.empty()) {
+      trace_span span(trace.get(), "hash");
+      hash = image_hash(state.server_config.hash, data);
+    }
+    if (trace)
+      trace->set_name(filename + " (" + hash + ")");
+
+    if (co_await find_or_claim())
+      // existing data was found and filled into fields of this class
+      co_return;
+
+    is_new = true;
+    co_await load_image();
+    co_await commit();
+  }
+
+  /**
+   * Make the stored files visible, once all of them were created. If the
+   * image was stored meanwhile (by another process), the response describes
+   * the stored folder instead.
+   */
+  pool_task<void> commit()
+  {
+    co_await enter_stage(state.stages.storage);
+    trace_span span(trace.get(), "commit");
+    auto epoch = state.responses ? state.responses->epoch(hash) : 0;
+    if (!state.server_config.storage->commit_staged_folder(*temp_folder)) {
+      is_new = false;
+      dimensions.clear();
+      if (!find_existing_data(hash))
+        throw std::runtime_error("Folder " + hash +
+                                 " disappeared while it was committed");
+      co_return;
+    }
+    if (state.responses)
+      state.responses->insert(hash, stored_result_json(), epoch);
+  }
+
+  /**
+   * Look for existing data of the image, waiting for other threads or
+   * processes which are processing it. Returns true if the data was found,
+   * false if this processor should process the image.
+   */
+  pool_task<bool> find_or_claim()
+  {
+    if (find_existing_data(hash))
+      co_return true;
 
+    bool should_process_here;
+    std::shared_ptr<async_event> notifier;
     {
       std::lock_guard lock(state.currently_processing_mutex);
 
       auto result = state.currently_processing.emplace(
-        hash, std::make_shared<std::atomic<bool>>(true));
+        hash, std::make_shared<async_event>());
       should_process_here = result.second;
-      processing_done_notifier = result.first->second;
+      notifier = result.first->second;
     }
 
     if (!should_process_here) {
-      processing_done_notifier->wait(true);
+      {
+        trace_wait wait(trace.get(), "wait for processing of same image");
+        co_await notifier->wait();
+      }
       if (!find_existing_data(hash))
         throw std::runtime_error("Failed to find data after another thread "
                                  "reportedly finished processing");
-      return;
+      co_return true;
     }
+    processing_done_notifier = std::move(notifier);
 
     if (find_existing_data(hash)) {
-      std::cerr << "Wow! The rare scenario happened: another thread finished "
-                   "processing while we were waiting for the lock"
-                << std::endl;
-      return;
+      log_debug("Wow! The rare scenario happened: another thread finished "
+                "processing while we were waiting for the lock");
+      co_return true;
     }
 
-    is_new = true;
+    if (!state.claims)
+      co_return false;
+
+    // claim the image across server processes sharing the storage. If another
+    // process is processing it, check again when the registry reports its
+    // claim may have been released
+    while (true) {
+      auto [status, acquired] = state.claims->try_claim(hash);
+      if (status != claim_registry::claim_status::held) {
+        if (status == claim_registry::claim_status::taken_over)
+          log_warning(
+            "Took over stale claim of ", hash, " held by another process");
+        claim = std::move(acquired);
+        break;
+      }
+
+      {
+        trace_wait wait(trace.get(), "wait for claim");
+        co_await resume_on_callback(
+          state.pool, state.stages.dedup, [this](auto resume) {
+            state.claims->wait(hash, std::move(resume));
+          });
+      }
+      cancellation.throw_if_cancelled();
+      if (find_existing_data(hash))
+        co_return true;
+    }
 
-    group.add_task(
-      [&data, self = shared_from_this()]() { self->load_image(data); });
+    // the other process may have finished right before we claimed the image
+    co_return find_existing_data(hash);
+  }
 
-    // add here any other tasks that can be done in parallel to image
-    // processing. Note that at this point, the original dimensions_spec and the
-    // dimensions vector are empty.
+  static void start(std::shared_ptr<image_processor> processor)
+  {
+    auto& pool = processor->state.pool;
+    auto pipeline = processor->process();
+    spawn(pool,
+          processor->state.stages.dedup,
+          std::move(pipeline),
+          [processor = std::move(processor)](std::exception_ptr error) {
+            processor->finalize(error, processor);
+          });
   }
 
   struct PrivateTag
@@ -335,45 +1003,90 @@ public:
   image_processor(PrivateTag,
                   server_state state,
                   ReadyHook&& ready_hook,
+                  std::vector<std::uint8_t>&& data,
                   std::string const& suggested_filename)
-    : group(
-        state.pool,
-        [this](std::exception const& e) { finalize(&e); },
-        [this]() { finalize(nullptr); })
-    , state(state)
+    : state(state)
     , ready_hook(std::move(ready_hook))
+    , data(std::move(data))
     , filename(
         sanitize_filename(get_filename_without_extension(suggested_filename)))
     , original{ 0, 0, { sanitize_filename(get_extension(suggested_filename)) } }
   {
   }
 
+  ~image_processor()
+  {
+    if (data_blob)
+      vips_area_unref(VIPS_AREA(data_blob));
+  }
+
   /**
    * Runs the image processing pipeline. When everything is done, ready_hook is
    * called with a pointer to the processor, which you can use to read metadata
    * about the created files.
    *
-   * Since this class starts background tasks, it needs to ensure that it is not
-   * destroyed, so it manages itself inside through shared_ptr, and passes this
-   * ptr to the callback.
+   * The processor is kept alive through a shared_ptr until the processing is
+   * done, and this ptr is passed to the callback.
+   *
+   * `memory` is released when the processing is done, and a non-empty `hash`
+   * is used instead of hashing data again, e.g. for upload sessions.
    */
   static void run(server_state state,
                   ReadyHook&& ready_hook,
-                  std::vector<std::uint8_t> const& data,
-                  std::string const& suggested_filename)
+                  std::vector<std::uint8_t>&& data,
+                  std::string const& suggested_filename,
+                  std::shared_ptr<request_trace> trace = nullptr,
+                  memory_budget::reservation memory = {},
+                  std::string hash = "")
   {
-    if (!state.magic_cookie) {
+    if (!image_processing_initialized) {
       throw std::runtime_error("Image processing not initialized");
     }
 
-    auto shared = std::make_shared<image_processor>(
-      PrivateTag{}, state, std::move(ready_hook), suggested_filename);
+    auto shared = std::make_shared<image_processor>(PrivateTag{},
+                                                    state,
+                                                    std::move(ready_hook),
+                                                    std::move(data),
+                                                    suggested_filename);
+    shared->trace = std::move(trace);
+    shared->memory = std::move(memory);
+    shared->hash = std::move(hash);
+    start(std::move(shared));
+  }
+
+  /**
+   * Like the other run(), but processing starts while the upload is still
+   * being received, see upload_stream. If the upload fails, ready_hook gets
+   * upload_failed_error. `memory` is the reservation the upload was admitted
+   * with, see memory_budget.
+   */
+  static void run(server_state state,
+                  ReadyHook&& ready_hook,
+                  std::shared_ptr<upload_stream> upload,
+                  std::string const& suggested_filename,
+                  std::shared_ptr<request_trace> trace = nullptr,
+                  memory_budget::reservation memory = {})
+  {
+    if (!image_processing_initialized) {
+      throw std::runtime_error("Image processing not initialized");
+    }
 
-    shared->group.add_task(
-      [&data, shared]() { shared->check_existence(data); });
+    auto shared = std::make_shared<image_processor>(PrivateTag{},
+                                                    state,
+                                                    std::move(ready_hook),
+                                                    std::vector<std::uint8_t>(),
+                                                    suggested_filename);
+    shared->upload = std::move(upload);
+    shared->trace = std::move(trace);
+    shared->memory = std::move(memory);
+    start(std::move(shared));
   }
 
-  void cancel() { group.cancel(); }
+  /**
+   * Stop the processing at the next step. It then finishes with
+   * operation_cancelled.
+   */
+  void cancel() { cancellation.cancel(); }
 
   std::vector<dimensions_spec> const& get_dimensions() const
   {
@@ -388,8 +1101,21 @@ public:
 
   bool get_is_new() const { return is_new; }
 
+  /**
+   * Set if the image was found in state.responses. The other getters are
+   * then empty, and write_result_json() writes this.
+   */
+  response_cache::response const& get_cached_response() const
+  {
+    return cached_response;
+  }
+
   void write_result_json(std::ostream& stream) const
   {
+    if (cached_response) {
+      stream << *cached_response;
+      return;
+    }
     stream << "{\"hash\": \"" << hash << "\", \"filename\": \"" << filename
            << "\", \"original\": ";
     original.write_json(stream);
@@ -0,0 +1,450 @@
+/**
+ * Import of images into the storage without the HTTP API, e.g. to migrate an
+ * existing library. The images are processed by the same image_processor as
+ * uploads, with the config of the server, so images already stored are found
+ * by their hash and not processed again, and the importer can run next to
+ * servers sharing the storage (with claim_dir set).
+ *
+ * For each image, a line with the same JSON as the response to its upload is
+ * written to the results file, in the order of the input. Images that fail
+ * get {"error": "error.<code>", "file": "<path>"} instead.
+ *
+ * With --checkpoint, the number of images done is saved to the file, and a
+ * later run with the same input continues after them (the results file is
+ * then truncated to the lines of those images, and appended to). The
+ * checkpoint is saved about every second, and when the import is interrupted
+ * by SIGINT or SIGTERM, after the images in progress are done.
+ *
+ * Usage: asset-server-import [--config-file <file>] [--in-flight <n>]
+ *          [--results <file>] [--checkpoint <file>]
+ *          (--list <file> | <directory>)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "claims.hpp"
+#include "config.hpp"
+#include "cpu_affinity.hpp"
+#include "image_processing.hpp"
+#include "logger.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "server_state.hpp"
+#include "thread_pool.hpp"
+#include "tracing.hpp"
+
+static std::atomic<bool> interrupted{ false };
+
+void
+print_usage(char const* argv0)
+{
+  std::cerr << "Usage: " << argv0
+            << " [--config-file <file>] [--in-flight <n>] [--results <file>]"
+               " [--checkpoint <file>] (--list <file> | <directory>)"
+            << std::endl;
+  std::cerr << "  --in-flight   images processed at once (default twice the "
+               "thread pool size)"
+            << std::endl;
+  std::cerr << "  --results     file for a JSON line per image (default "
+               "import-results.ndjson)"
+            << std::endl;
+  std::cerr << "  --checkpoint  file with the progress, to continue an "
+               "interrupted import"
+            << std::endl;
+  std::cerr << "  --list        file with a path of an image on each line, "
+               "instead of all files in the directory"
+            << std::endl;
+}
+
+/** Paths of the images to import, in a stable order */
+std::vector<std::filesystem::path>
+collect_inputs(std::string const& directory, std::string const& list)
+{
+  std::vector<std::filesystem::path> result;
+  if (!list.empty()) {
+    std::ifstream file(list);
+    if (!file)
+      throw std::runtime_error("Failed to open " + list);
+    std::string line;
+    while (std::getline(file, line))
+      if (!line.empty())
+        result.emplace_back(line);
+    return result;
+  }
+
+  for (auto const& entry :
+       std::filesystem::recursive_directory_iterator(directory))
+    if (entry.is_regular_file())
+      result.push_back(entry.path());
+  // directory order isn't stable, the checkpoint relies on the order
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::vector<std::uint8_t>
+read_image(std::filesystem::path const& path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Failed to open " + path.string());
+  return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+/** Progress of the import, see --checkpoint */
+struct import_checkpoint
+{
+  /** The --list file or the directory */
+  std::string source;
+  /** Inputs done, their lines are in the results file */
+  std::size_t done = 0;
+  /** Size of the results file with those lines */
+  std::uint64_t results_size = 0;
+
+  static import_checkpoint load(std::filesystem::path const& path)
+  {
+    import_checkpoint result;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      auto pos = line.find('=');
+      if (pos == std::string::npos)
+        throw std::runtime_error("Invalid line in " + path.string());
+      auto key = std::string_view(line).substr(0, pos);
+      auto value = std::string_view(line).substr(pos + 1);
+      if (key == "source")
+        result.source = value;
+      else if (key == "done")
+        result.done = string_view_to_int(value);
+      else if (key == "results_size")
+        result.results_size = std::stoull(std::string(value));
+    }
+    return result;
+  }
+
+  void save(std::filesystem::path const& path) const
+  {
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+      std::ofstream file(temp_path, std::ios::trunc);
+      file << "source=" << source << "\n"
+           << "done=" << done << "\n"
+           << "results_size=" << results_size << "\n";
+      if (!file)
+        throw std::runtime_error("Failed to write " + temp_path.string());
+    }
+    std::filesystem::rename(temp_path, path);
+  }
+};
+
+/**
+ * Images being processed, and the results of finished ones until all before
+ * them are finished too, so that the results are written in input order
+ */
+struct import_window
+{
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::size_t in_flight = 0;
+  std::map<std::size_t, std::string> finished;
+  /** Inputs refused by the memory budget, to be submitted again */
+  std::vector<std::size_t> retry;
+
+  std::uint64_t imported = 0;
+  std::uint64_t existing = 0;
+  std::uint64_t failed = 0;
+};
+
+/** Result line of an image that failed, with the error codes of the API */
+std::string
+error_line(std::exception const& e, std::filesystem::path const& path)
+{
+  char const* code = "error.internal";
+  if (dynamic_cast<image_loading_error const*>(&e))
+    code = "error.invalid_image";
+  else if (dynamic_cast<image_too_large_error const*>(&e))
+    code = "error.image_too_large";
+  else
+    log_error("Error processing ", path.string(), ": ", e.what());
+
+  std::string line = "{\"error\": \"";
+  line += code;
+  line += "\", \"file\": ";
+  trace_detail::append_json_string(line, path.string());
+  line += "}";
+  return line;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const char* cfg_file = "asset-server.cfg";
+  std::string results_file = "import-results.ndjson";
+  std::string checkpoint_file;
+  std::string list_file;
+  std::string directory;
+  unsigned max_in_flight = 0;
+  try {
+    for (int i = 1; i < argc; i++) {
+      auto option_value = [&] {
+        if (i + 1 >= argc)
+          throw std::runtime_error("Expected argument for " +
+                                   std::string(argv[i]));
+        return argv[++i];
+      };
+      if (strcmp(argv[i], "--help") == 0) {
+        print_usage(argv[0]);
+        return 0;
+      } else if (strcmp(argv[i], "--config-file") == 0) {
+        cfg_file = option_value();
+      } else if (strcmp(argv[i], "--in-flight") == 0) {
+        max_in_flight = string_view_to_int(option_value());
+        if (max_in_flight == 0)
+          throw std::runtime_error("--in-flight must be greater than 0");
+      } else if (strcmp(argv[i], "--results") == 0) {
+        results_file = option_value();
+      } else if (strcmp(argv[i], "--checkpoint") == 0) {
+        checkpoint_file = option_value();
+      } else if (strcmp(argv[i], "--list") == 0) {
+        list_file = option_value();
+      } else if (argv[i][0] != '-' && directory.empty()) {
+        directory = argv[i];
+      } else {
+        throw std::runtime_error("Unknown argument: " + std::string(argv[i]));
+      }
+    }
+    if (directory.empty() == list_file.empty())
+      throw std::runtime_error("Expected either a directory or --list");
+  } catch (std::exception const& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  try {
+    config cfg = config::parse(cfg_file);
+    server_logger().set_level(cfg.logging_level);
+    server_logger().start(cfg.log_json);
+    cfg.storage->init(cfg.get_storage_layout());
+
+    auto inputs = collect_inputs(directory, list_file);
+    import_checkpoint checkpoint;
+    checkpoint.source = list_file.empty() ? directory : list_file;
+    if (!checkpoint_file.empty() &&
+        std::filesystem::exists(checkpoint_file)) {
+      auto saved = import_checkpoint::load(checkpoint_file);
+      if (saved.source != checkpoint.source)
+        throw std::runtime_error("Checkpoint " + checkpoint_file +
+                                 " is of another import: " + saved.source);
+      std::error_code ec;
+      auto results_size = std::filesystem::file_size(results_file, ec);
+      if (ec || results_size < saved.results_size) {
+        // the stored images are found again quickly, only their lines are
+        // written again
+        log_warning("Results file ",
+                    results_file,
+                    " is missing or shorter than at the checkpoint, starting "
+                    "over");
+      } else {
+        checkpoint = saved;
+        // lines written after the checkpoint are written again
+        std::filesystem::resize_file(results_file, checkpoint.results_size);
+        log_info("Continuing after ", checkpoint.done, " imported images");
+      }
+    }
+    std::ofstream results(results_file,
+                          checkpoint.done ? std::ios::app : std::ios::trunc);
+    if (!results)
+      throw std::runtime_error("Failed to open " + results_file);
+
+    std::unique_ptr<claim_registry> claims;
+    if (!cfg.claim_dir.empty()) {
+      claims = std::make_unique<claim_registry>(cfg.claim_dir,
+                                                cfg.claim_timeout_secs);
+      claims->start();
+    }
+    request_tracer tracer(cfg.tracing);
+    memory_budget memory(cfg.memory);
+
+    // used by the tasks, so declared before the pool, which joins them when
+    // it's destroyed
+    std::unordered_map<std::string, std::shared_ptr<async_event>>
+      currently_processing;
+    std::mutex currently_processing_mutex;
+    server_metrics metrics;
+    import_window window;
+
+    auto stages = cfg.get_pipeline_stages();
+    auto placements = place_workers(cfg.affinity.get_topology(),
+                                    cfg.affinity.workers,
+                                    cfg.get_thread_pool_size());
+    thread_pool pool(cfg.get_thread_pool_size(), stages.options, placements);
+    if (!max_in_flight)
+      max_in_flight = 2 * cfg.get_thread_pool_size();
+
+    server_state state{ cfg,
+                        pool,
+                        stages,
+                        currently_processing,
+                        currently_processing_mutex,
+                        claims.get(),
+                        memory,
+                        metrics,
+                        tracer,
+                        nullptr,
+                        nullptr };
+    init_image_processing(state);
+
+    std::signal(SIGINT, [](int) { interrupted = true; });
+    std::signal(SIGTERM, [](int) { interrupted = true; });
+
+    auto submit = [&](std::size_t index) {
+      auto const& path = inputs[index];
+      auto finish = [&window, index](std::string line) {
+        std::lock_guard lock(window.mutex);
+        window.in_flight--;
+        window.finished.emplace(index, std::move(line));
+        window.cv.notify_one();
+      };
+
+      {
+        std::lock_guard lock(window.mutex);
+        window.in_flight++;
+      }
+      std::vector<std::uint8_t> data;
+      try {
+        data = read_image(path);
+      } catch (std::exception const& e) {
+        {
+          std::lock_guard lock(window.mutex);
+          window.failed++;
+        }
+        finish(error_line(e, path));
+        return;
+      }
+
+      image_processor::run(
+        state,
+        [&window, index, path, finish](std::exception const* e,
+                                       std::shared_ptr<image_processor> proc) {
+          if (e && dynamic_cast<server_busy_error const*>(e)) {
+            std::lock_guard lock(window.mutex);
+            window.in_flight--;
+            window.retry.push_back(index);
+            window.cv.notify_one();
+            return;
+          }
+          std::ostringstream line;
+          if (e) {
+            line << error_line(*e, path);
+          } else {
+            proc->write_result_json(line);
+          }
+          {
+            std::lock_guard lock(window.mutex);
+            if (!e)
+              (proc->get_is_new() ? window.imported : window.existing)++;
+            else
+              window.failed++;
+          }
+          finish(line.str());
+        },
+        std::move(data),
+        path.filename().string());
+    };
+
+    auto last_save = std::chrono::steady_clock::now();
+    auto last_log = last_save;
+    std::size_t next_input = checkpoint.done;
+    std::unique_lock lock(window.mutex);
+    while (true) {
+      // write the results that are next in order
+      bool wrote = false;
+      for (auto it = window.finished.begin();
+           it != window.finished.end() && it->first == checkpoint.done;
+           it = window.finished.erase(it)) {
+        results << it->second << "\n";
+        checkpoint.done++;
+        wrote = true;
+      }
+
+      bool stopping = interrupted || next_input == inputs.size();
+      bool all_done = stopping && window.in_flight == 0;
+      auto now = std::chrono::steady_clock::now();
+      if (wrote && (all_done || now - last_save >= std::chrono::seconds(1))) {
+        results.flush();
+        if (!results)
+          throw std::runtime_error("Failed to write " + results_file);
+        checkpoint.results_size = std::filesystem::file_size(results_file);
+        if (!checkpoint_file.empty())
+          checkpoint.save(checkpoint_file);
+        last_save = now;
+      }
+      if (now - last_log >= std::chrono::seconds(10)) {
+        log_info("Imported ",
+                 checkpoint.done,
+                 " of ",
+                 inputs.size(),
+                 " images (",
+                 window.imported,
+                 " new, ",
+                 window.existing,
+                 " already stored, ",
+                 window.failed,
+                 " failed)");
+        last_log = now;
+      }
+      if (all_done && window.retry.empty())
+        break;
+
+      if (window.in_flight >= max_in_flight ||
+          (stopping && window.retry.empty())) {
+        window.cv.wait_for(lock, std::chrono::seconds(1));
+        continue;
+      }
+
+      std::size_t index;
+      if (!window.retry.empty()) {
+        index = window.retry.back();
+        window.retry.pop_back();
+      } else {
+        index = next_input++;
+      }
+      lock.unlock();
+      submit(index);
+      lock.lock();
+    }
+    lock.unlock();
+
+    log_info("Imported ",
+             checkpoint.done,
+             " of ",
+             inputs.size(),
+             " images (",
+             window.imported,
+             " new, ",
+             window.existing,
+             " already stored, ",
+             window.failed,
+             " failed)");
+    destroy_image_processing(state);
+    return checkpoint.done == inputs.size() ? 0 : 1;
+  } catch (std::exception const& e) {
+    log_error("Error: ", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,516 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+enum class log_level : std::uint8_t
+{
+  debug,
+  info,
+  warning,
+  error,
+};
+
+std::string_view
+log_level_name(log_level level)
+{
+  switch (level) {
+    case log_level::debug:
+      return "debug";
+    case log_level::info:
+      return "info";
+    case log_level::warning:
+      return "warning";
+    case log_level::error:
+      return "error";
+  }
+  return "unknown";
+}
+
+log_level
+parse_log_level(std::string_view value)
+{
+  for (auto level : { log_level::debug,
+                      log_level::info,
+                      log_level::warning,
+                      log_level::error })
+    if (value == log_level_name(level))
+      return level;
+  throw std::runtime_error("Unknown log level '" + std::string(value) +
+                           "', expected debug, info, warning or error");
+}
+
+/** One message in a log_ring, with its text truncated to TEXT_SIZE */
+struct log_record
+{
+  static constexpr std::size_t TEXT_SIZE = 232;
+
+  std::int64_t time_us;
+  unsigned thread;
+  log_level level;
+  std::uint16_t size;
+  char text[TEXT_SIZE];
+};
+
+/**
+ * Formats the arguments of a log call right into the text of a record:
+ * strings are copied, numbers are written with to_chars, and whatever doesn't
+ * fit is cut off, so nothing is allocated.
+ */
+class log_text_writer
+{
+private:
+  char* out;
+  std::size_t capacity;
+  std::size_t size = 0;
+
+  template<typename T>
+  static constexpr bool always_false = false;
+
+public:
+  log_text_writer(char* out, std::size_t capacity)
+    : out(out)
+    , capacity(capacity)
+  {
+  }
+
+  std::size_t get_size() const { return size; }
+
+  void append(std::string_view text)
+  {
+    auto n = std::min(text.size(), capacity - size);
+    std::memcpy(out + size, text.data(), n);
+    size += n;
+  }
+
+  template<typename T>
+  void append(T const& value)
+  {
+    if constexpr (std::is_same_v<T, bool>) {
+      append(std::string_view(value ? "true" : "false"));
+    } else if constexpr (std::is_same_v<T, char>) {
+      append(std::string_view(&value, 1));
+    } else if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+      auto number = [&] {
+        if constexpr (std::is_enum_v<T>)
+          return std::underlying_type_t<T>(value);
+        else
+          return value;
+      }();
+      auto [end, ec] = std::to_chars(out + size, out + capacity, number);
+      if (ec == std::errc())
+        size = end - out;
+    } else if constexpr (std::is_convertible_v<T const&, std::string_view>) {
+      append(std::string_view(value));
+    } else if constexpr (requires { value.native(); }) {
+      // std::filesystem::path
+      append(std::string_view(value.native()));
+    } else if constexpr (requires {
+                           value.data();
+                           value.size();
+                         }) {
+      // other string types, e.g. boost string_view
+      append(std::string_view(value.data(), value.size()));
+    } else {
+      static_assert(always_false<T>, "This type can't be logged");
+    }
+  }
+};
+
+/**
+ * Messages of one thread waiting to be written. The thread is the only
+ * producer and the flusher the only consumer, so the two only exchange the
+ * head and tail counters. When the ring is full, messages are dropped (and
+ * counted) rather than blocking the thread.
+ */
+class log_ring
+{
+public:
+  static constexpr std::size_t CAPACITY = 256;
+
+private:
+  std::array<log_record, CAPACITY> records;
+  alignas(64) std::atomic<std::uint64_t> head{ 0 };
+  alignas(64) std::atomic<std::uint64_t> tail{ 0 };
+
+public:
+  std::atomic<std::uint64_t> dropped{ 0 };
+  /** Set when the thread exits, the ring is removed once drained */
+  std::atomic<bool> abandoned{ false };
+  unsigned const thread;
+
+  explicit log_ring(unsigned thread)
+    : thread(thread)
+  {
+  }
+
+  /** Slot for the next message, or null if the ring is full */
+  log_record* reserve()
+  {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == CAPACITY) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &records[h % CAPACITY];
+  }
+
+  /** Publish the slot returned by reserve() */
+  void commit() { head.fetch_add(1, std::memory_order_release); }
+
+  /** Pass the waiting messages to fn, from the flusher */
+  template<typename Fn>
+  void drain(Fn&& fn)
+  {
+    auto t = tail.load(std::memory_order_relaxed);
+    auto h = head.load(std::memory_order_acquire);
+    for (; t != h; ++t)
+      fn(records[t % CAPACITY]);
+    tail.store(t, std::memory_order_release);
+  }
+
+  bool empty() const
+  {
+    return tail.load(std::memory_order_acquire) ==
+           head.load(std::memory_order_acquire);
+  }
+};
+
+/**
+ * Logger with levels, writing text or JSON lines to a file (stderr for the
+ * server).
+ *
+ * While started, a message is formatted into a ring buffer of the calling
+ * thread, and a background thread writes the rings out every FLUSH_INTERVAL
+ * (or right away for warnings and errors), ordered by time. Messages below the
+ * level are skipped before formatting. Before start() and after stop(),
+ * messages are written synchronously, so that errors during startup and
+ * shutdown still appear.
+ */
+class logger
+{
+public:
+  static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(50);
+
+private:
+  /** Distinguishes the rings of loggers created at the same address */
+  static inline std::atomic<std::uint64_t> next_id{ 1 };
+  std::uint64_t const id = next_id.fetch_add(1);
+
+  std::FILE* out;
+  std::atomic<log_level> level{ log_level::info };
+  bool json = false;
+
+  std::mutex rings_mutex;
+  std::vector<std::shared_ptr<log_ring>> rings;
+  std::atomic<unsigned> next_thread{ 0 };
+
+  std::atomic<bool> running{ false };
+  std::mutex flusher_mutex;
+  std::condition_variable flusher_cv;
+  bool stopping = false;
+  bool urgent = false;
+  std::thread flusher;
+
+  /** Serializes writes to `out` */
+  std::mutex out_mutex;
+
+  /** Ring of the calling thread for this logger, registered on first use */
+  log_ring& local_ring()
+  {
+    struct holder
+    {
+      std::uint64_t owner = 0;
+      std::shared_ptr<log_ring> ring;
+
+      ~holder()
+      {
+        if (ring)
+          ring->abandoned = true;
+      }
+    };
+    thread_local holder local;
+    if (local.owner != id) {
+      if (local.ring)
+        local.ring->abandoned = true;
+      local.owner = id;
+      local.ring = std::make_shared<log_ring>(next_thread.fetch_add(1));
+      std::lock_guard lock(rings_mutex);
+      rings.push_back(local.ring);
+    }
+    return *local.ring;
+  }
+
+  static void format_time(std::int64_t time_us, std::string& out)
+  {
+    std::time_t seconds = time_us / 1'000'000;
+    std::tm utc;
+    gmtime_r(&seconds, &utc);
+    char buffer[32];
+    auto size = std::snprintf(buffer,
+                              sizeof(buffer),
+                              "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                              utc.tm_year + 1900,
+                              utc.tm_mon + 1,
+                              utc.tm_mday,
+                              utc.tm_hour,
+                              utc.tm_min,
+                              utc.tm_sec,
+                              int(time_us / 1000 % 1000));
+    out.append(buffer, size);
+  }
+
+  static void append_json_string(std::string_view text, std::string& out)
+  {
+    out += '"';
+    for (char c : text) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      } else {
+        out += c;
+      }
+    }
+    out += '"';
+  }
+
+  void format_record(log_record const& record, std::string& out) const
+  {
+    std::string_view text(record.text, record.size);
+    if (json) {
+      out += "{\"time\": \"";
+      format_time(record.time_us, out);
+      out += "\", \"level\": \"";
+      out += log_level_name(record.level);
+      out += "\", \"thread\": ";
+      out += std::to_string(record.thread);
+      out += ", \"message\": ";
+      append_json_string(text, out);
+      out += "}\n";
+    } else {
+      format_time(record.time_us, out);
+      out += ' ';
+      out += log_level_name(record.level);
+      out += " [";
+      out += std::to_string(record.thread);
+      out += "] ";
+      out += text;
+      out += '\n';
+    }
+  }
+
+  void write_out(std::string const& text)
+  {
+    std::lock_guard lock(out_mutex);
+    std::fwrite(text.data(), 1, text.size(), out);
+    std::fflush(out);
+  }
+
+  /** Write out all waiting messages, called only by one thread at a time */
+  void drain_all()
+  {
+    std::vector<std::shared_ptr<log_ring>> current;
+    {
+      std::lock_guard lock(rings_mutex);
+      current = rings;
+    }
+
+    std::vector<log_record> records;
+    std::uint64_t dropped = 0;
+    for (auto const& ring : current) {
+      ring->drain([&](log_record const& record) { records.push_back(record); });
+      dropped += ring->dropped.exchange(0);
+    }
+    if (records.empty() && dropped == 0)
+      return;
+
+    std::stable_sort(records.begin(),
+                     records.end(),
+                     [](log_record const& a, log_record const& b) {
+                       return a.time_us < b.time_us;
+                     });
+    std::string text;
+    for (auto const& record : records)
+      format_record(record, text);
+    if (dropped) {
+      log_record note;
+      stamp(note, log_level::warning, 0);
+      fill(note, dropped, " log messages were dropped, the buffers were full");
+      format_record(note, text);
+    }
+    write_out(text);
+
+    std::lock_guard lock(rings_mutex);
+    std::erase_if(rings, [](auto const& ring) {
+      return ring->abandoned && ring->empty();
+    });
+  }
+
+  void run_flusher()
+  {
+    std::unique_lock lock(flusher_mutex);
+    while (true) {
+      flusher_cv.wait_for(
+        lock, FLUSH_INTERVAL, [this] { return stopping || urgent; });
+      bool stop_now = stopping;
+      urgent = false;
+      lock.unlock();
+      drain_all();
+      lock.lock();
+      if (stop_now)
+        return;
+    }
+  }
+
+  /** Fill in the record, apart from its text */
+  static void stamp(log_record& record, log_level level, unsigned thread)
+  {
+    record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+    record.thread = thread;
+    record.level = level;
+  }
+
+  template<typename... Args>
+  static void fill(log_record& record, Args const&... args)
+  {
+    log_text_writer writer(record.text, log_record::TEXT_SIZE);
+    (writer.append(args), ...);
+    record.size = writer.get_size();
+  }
+
+public:
+  explicit logger(std::FILE* out = stderr)
+    : out(out)
+  {
+  }
+
+  ~logger() { stop(); }
+
+  void set_level(log_level new_level) { level = new_level; }
+
+  bool enabled(log_level message_level) const
+  {
+    return message_level >= level.load(std::memory_order_relaxed);
+  }
+
+  /** Start writing in the background, in JSON lines if json is set */
+  void start(bool json_lines)
+  {
+    if (running)
+      return;
+    json = json_lines;
+    stopping = false;
+    flusher = std::thread([this] { run_flusher(); });
+    running = true;
+  }
+
+  /** Write out the waiting messages and stop the background thread */
+  void stop()
+  {
+    if (!running.exchange(false))
+      return;
+    {
+      std::lock_guard lock(flusher_mutex);
+      stopping = true;
+    }
+    flusher_cv.notify_one();
+    flusher.join();
+    // messages of threads that saw the logger still running
+    drain_all();
+  }
+
+  template<typename... Args>
+  void write(log_level message_level, Args const&... args)
+  {
+    if (!enabled(message_level))
+      return;
+
+    if (!running.load(std::memory_order_acquire)) {
+      log_record record;
+      stamp(record, message_level, 0);
+      fill(record, args...);
+      std::string text;
+      format_record(record, text);
+      write_out(text);
+      return;
+    }
+
+    auto& ring = local_ring();
+    log_record* record = ring.reserve();
+    if (!record)
+      return;
+    stamp(*record, message_level, ring.thread);
+    fill(*record, args...);
+    ring.commit();
+
+    if (message_level >= log_level::warning) {
+      {
+        std::lock_guard lock(flusher_mutex);
+        urgent = true;
+      }
+      flusher_cv.notify_one();
+    }
+  }
+};
+
+/** The logger of the server, writing to stderr */
+logger&
+server_logger()
+{
+  static logger instance;
+  return instance;
+}
+
+template<typename... Args>
+void
+log_debug(Args const&... args)
+{
+  server_logger().write(log_level::debug, args...);
+}
+
+template<typename... Args>
+void
+log_info(Args const&... args)
+{
+  server_logger().write(log_level::info, args...);
+}
+
+template<typename... Args>
+void
+log_warning(Args const&... args)
+{
+  server_logger().write(log_level::warning, args...);
+}
+
+template<typename... Args>
+void
+log_error(Args const&... args)
+{
+  server_logger().write(log_level::error, args...);
+}
+
+#endif // LOGGER_HPP
@@ -6,9 +6,14 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 
+#include "backfill.hpp"
+#include "claims.hpp"
 #include "config.hpp"
+#include "cpu_affinity.hpp"
 #include "http_connection.hpp"
 #include "image_processing.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
 #include "server_state.hpp"
 #include "thread_pool.hpp"
 
@@ -31,7 +36,11 @@ http_server(boost::asio::ip::tcp::acceptor& acceptor,
 void
 print_usage(char const* argv0)
 {
-  std::cerr << "Usage: " << argv0 << " [--config-file <file>]" << std::endl;
+  std::cerr << "Usage: " << argv0
+            << " [--config-file <file>] [--migrate-storage]" << std::endl;
+  std::cerr << "  --migrate-storage  convert the stored data to the layout "
+               "given by the config file, then exit"
+            << std::endl;
 }
 
 enum class argv_parse_state
@@ -44,6 +53,7 @@ int
 main(int argc, char* argv[])
 {
   const char* cfg_file = "asset-server.cfg";
+  bool migrate_storage = false;
   try {
     // load command-line arguments
     argv_parse_state state = argv_parse_state::none;
@@ -56,6 +66,8 @@ main(int argc, char* argv[])
         state = argv_parse_state::none;
       } else if (strcmp(argv[i], "--config-file") == 0) {
         state = argv_parse_state::cfg_file;
+      } else if (strcmp(argv[i], "--migrate-storage") == 0) {
+        migrate_storage = true;
       } else {
         throw std::runtime_error("Unknown argument: " + std::string(argv[i]));
       }
@@ -70,19 +82,84 @@ main(int argc, char* argv[])
 
   try {
     config cfg = config::parse(cfg_file);
-    cfg.storage->init();
+    server_logger().set_level(cfg.logging_level);
+    if (migrate_storage) {
+      cfg.storage->migrate(cfg.get_storage_layout());
+      return 0;
+    }
+    // from here on, messages are written in the background. The logger
+    // writes out the rest when it is destroyed at exit
+    server_logger().start(cfg.log_json);
+    cfg.storage->init(cfg.get_storage_layout());
+
+    // created before the pool, so that it outlives the tasks using it
+    std::unique_ptr<claim_registry> claims;
+    if (!cfg.claim_dir.empty()) {
+      claims = std::make_unique<claim_registry>(cfg.claim_dir,
+                                                cfg.claim_timeout_secs);
+      claims->start();
+    }
 
-    thread_pool pool(cfg.get_thread_pool_size());
+    // also outlives the connections and tasks holding traces
+    request_tracer tracer(cfg.tracing);
+    // and the uploads holding reservations
+    memory_budget memory(cfg.memory);
+    // and the connections holding upload sessions
+    std::unique_ptr<upload_sessions> uploads;
+    if (!cfg.upload_sessions.dir.empty()) {
+      uploads =
+        std::make_unique<upload_sessions>(cfg.upload_sessions, cfg.hash);
+      uploads->init();
+    }
+    // and the processing using the cached responses
+    std::unique_ptr<response_cache> responses;
+    if (cfg.response_cache.max_size)
+      responses = std::make_unique<response_cache>(cfg.response_cache);
 
-    std::unordered_map<std::string, std::shared_ptr<std::atomic<bool>>>
+    // and the tasks updating the map of images being processed and the metrics
+    std::unordered_map<std::string, std::shared_ptr<async_event>>
       currently_processing;
     std::mutex currently_processing_mutex;
-
-    server_state state{
-      cfg, pool, currently_processing, currently_processing_mutex
-    };
+    server_metrics metrics;
+
+    auto stages = cfg.get_pipeline_stages();
+    auto placements = place_workers(cfg.affinity.get_topology(),
+                                    cfg.affinity.workers,
+                                    cfg.get_thread_pool_size());
+    thread_pool pool(cfg.get_thread_pool_size(), stages.options, placements);
+    if (!placements.empty())
+      log_info("Pinned ",
+               placements.size(),
+               " worker threads to ",
+               pool.get_node_count(),
+               " NUMA nodes");
+
+    metrics.thread_pool_size = cfg.get_thread_pool_size();
+    metrics.vips_concurrency = cfg.get_vips_concurrency();
+    metrics.numa_nodes = pool.get_node_count();
+    metrics.pool = &pool;
+    metrics.memory = &memory;
+    metrics.uploads = uploads.get();
+    metrics.responses = responses.get();
+    metrics.storage = cfg.storage.get();
+
+    server_state state{ cfg,
+                        pool,
+                        stages,
+                        currently_processing,
+                        currently_processing_mutex,
+                        claims.get(),
+                        memory,
+                        metrics,
+                        tracer,
+                        uploads.get(),
+                        responses.get() };
     init_image_processing(state);
 
+    // declared after the pool, so it is stopped before the pool goes away
+    backfill_job backfill(state, cfg.backfill);
+    backfill.start();
+
     // prepare the boost async runtime
     boost::asio::io_context ctx;
     boost::asio::signal_set signals(ctx, SIGINT, SIGTERM);
@@ -100,15 +177,20 @@ main(int argc, char* argv[])
                                              { address, cfg.listen_port } };
     boost::asio::ip::tcp::socket socket{ ctx };
 
-    std::cerr << "Listening on http://" << cfg.listen_host << ":"
-              << cfg.listen_port << std::endl;
+    log_info("Listening on http://", cfg.listen_host, ":", cfg.listen_port);
     http_server(acceptor, socket, state);
 
+    // pinned only now, the threads started before would inherit its CPUs
+    if (!cfg.affinity.io_cpus.empty() &&
+        !pin_current_thread(cfg.affinity.io_cpus))
+      log_warning("Failed to pin the network thread to affinity.io_cpus");
+
     ctx.run();
 
+    backfill.stop();
     destroy_image_processing(state);
   } catch (std::exception const& e) {
-    std::cerr << "Error: " << e.what() << std::endl;
+    log_error("Error: ", e.what());
     return 1;
   }
 
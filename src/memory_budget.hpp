@@ -0,0 +1,316 @@
+#ifndef MEMORY_BUDGET_HPP
+#define MEMORY_BUDGET_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * Server-wide memory budget, configured as
+ *
+ *   memory.budget=<bytes>          (0 disables the budget)
+ *   memory.max_waiting=<n>
+ *   memory.vips_cache_pct=<0..99>
+ *
+ * vips_cache_pct of the budget is given to the libvips operation cache, the
+ * rest is shared by the uploads (see memory_budget).
+ */
+struct memory_config
+{
+  std::uint64_t budget = 0;
+  unsigned max_waiting = 64;
+  unsigned vips_cache_pct = 10;
+
+  /** Set an option from a config entry, key is the part after "memory." */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "budget") {
+      budget = parse_bytes(value);
+    } else if (key == "max_waiting") {
+      max_waiting = string_view_to_int(value);
+    } else if (key == "vips_cache_pct") {
+      vips_cache_pct = string_view_to_int(value);
+      if (vips_cache_pct >= 100)
+        throw std::runtime_error("vips_cache_pct must be less than 100");
+    } else {
+      throw std::runtime_error("Unknown memory option");
+    }
+  }
+
+  /** Limit of the libvips operation cache, 0 if the budget is disabled */
+  std::uint64_t get_vips_cache_size() const
+  {
+    return budget / 100 * vips_cache_pct;
+  }
+
+  /** Bytes shared by the uploads, 0 if the budget is disabled */
+  std::uint64_t get_upload_budget() const
+  {
+    return budget - get_vips_cache_size();
+  }
+};
+
+/**
+ * Bytes reserved by the uploads being processed. An upload is admitted with a
+ * reservation of its body, once that fits into the budget, and the
+ * reservation then grows by the estimated memory of decoding and encoding its
+ * variants, and shrinks again when they are done. Uploads which don't fit
+ * wait in FIFO order; when too many are waiting already, new ones are turned
+ * away, so that the server answers them right away (with a 503) instead of
+ * letting them time out.
+ *
+ * Growing reservations go before new admissions, since they are needed to
+ * finish the uploads already in progress. If every reservation is waiting to
+ * grow, none of them would ever be released, so the oldest one is refused
+ * instead.
+ *
+ * Callbacks are called without the lock held, either directly from admit() or
+ * grow(), or from the thread releasing the memory.
+ */
+class memory_budget
+{
+public:
+  enum class grow_result
+  {
+    granted,
+    /** The reservation would be larger than the whole budget */
+    too_large,
+    /** Every upload waits to grow, this one is refused to let others finish */
+    busy,
+  };
+
+  /** Memory held by one upload, released on destruction */
+  class reservation
+  {
+  private:
+    friend class memory_budget;
+
+    memory_budget* budget = nullptr;
+    std::uint64_t size = 0;
+
+    reservation(memory_budget* budget, std::uint64_t size)
+      : budget(budget)
+      , size(size)
+    {
+    }
+
+  public:
+    reservation() = default;
+
+    reservation(reservation&& other) noexcept
+      : budget(std::exchange(other.budget, nullptr))
+      , size(std::exchange(other.size, 0))
+    {
+    }
+
+    reservation& operator=(reservation&& other) noexcept
+    {
+      if (this != &other) {
+        reset();
+        budget = std::exchange(other.budget, nullptr);
+        size = std::exchange(other.size, 0);
+      }
+      return *this;
+    }
+
+    ~reservation() { reset(); }
+
+    std::uint64_t get_size() const { return size; }
+
+    /** Give back part of the reserved memory */
+    void release(std::uint64_t bytes)
+    {
+      if (budget)
+        budget->release(*this, std::min(bytes, size), false);
+    }
+
+    /** Give back all of the reserved memory */
+    void reset()
+    {
+      if (budget)
+        budget->release(*this, size, true);
+    }
+  };
+
+private:
+  std::uint64_t const limit;
+  std::size_t const max_waiting;
+
+  mutable std::mutex mutex;
+  std::uint64_t used = 0;
+  /** Reservations bound to this budget, see grant_waiting() */
+  std::size_t holders = 0;
+  std::uint64_t rejected = 0;
+
+  struct waiter
+  {
+    std::uint64_t size;
+    /** Set for a growing reservation, null for an admission */
+    reservation* target;
+    std::function<void(reservation)> admitted;
+    std::function<void(grow_result)> grown;
+  };
+  std::deque<waiter> growing;
+  std::deque<waiter> admitting;
+
+  /** Callback to call once the lock is released */
+  struct ready_callback
+  {
+    waiter entry;
+    reservation granted;
+    grow_result result;
+  };
+
+  bool fits(std::uint64_t size) const
+  {
+    return limit == 0 || used + size <= limit;
+  }
+
+  void grant_waiting(std::vector<ready_callback>& ready)
+  {
+    while (!growing.empty()) {
+      auto& front = growing.front();
+      bool granted = fits(front.size);
+      if (granted) {
+        used += front.size;
+        front.target->size += front.size;
+      } else if (growing.size() < holders) {
+        return;
+      }
+      ready.push_back({ std::move(front),
+                        {},
+                        granted ? grow_result::granted : grow_result::busy });
+      growing.pop_front();
+    }
+
+    while (!admitting.empty() && fits(admitting.front().size)) {
+      auto& front = admitting.front();
+      used += front.size;
+      holders++;
+      reservation granted(this, front.size);
+      ready.push_back(
+        { std::move(front), std::move(granted), grow_result::granted });
+      admitting.pop_front();
+    }
+  }
+
+  static void call(std::vector<ready_callback>& ready)
+  {
+    for (auto& callback : ready) {
+      if (callback.entry.target)
+        callback.entry.grown(callback.result);
+      else
+        callback.entry.admitted(std::move(callback.granted));
+    }
+  }
+
+  void release(reservation& target, std::uint64_t bytes, bool unbind)
+  {
+    std::vector<ready_callback> ready;
+    {
+      std::lock_guard lock(mutex);
+      used -= bytes;
+      target.size -= bytes;
+      if (unbind) {
+        holders--;
+        target.budget = nullptr;
+      }
+      grant_waiting(ready);
+    }
+    call(ready);
+  }
+
+public:
+  /** limit of 0 means unlimited, the reservations are then only counted */
+  memory_budget(std::uint64_t limit, std::size_t max_waiting)
+    : limit(limit)
+    , max_waiting(max_waiting)
+  {
+  }
+
+  explicit memory_budget(memory_config const& config)
+    : memory_budget(config.get_upload_budget(), config.max_waiting)
+  {
+  }
+
+  memory_budget(memory_budget const&) = delete;
+  memory_budget& operator=(memory_budget const&) = delete;
+
+  /**
+   * Call `admitted` with a reservation of `size` bytes once it fits into the
+   * budget (larger sizes are reduced to the whole budget). Returns false,
+   * without calling it, if too many admissions are waiting already.
+   */
+  bool admit(std::uint64_t size, std::function<void(reservation)> admitted)
+  {
+    if (limit != 0)
+      size = std::min(size, limit);
+
+    std::vector<ready_callback> ready;
+    {
+      std::lock_guard lock(mutex);
+      bool must_wait = !growing.empty() || !admitting.empty() || !fits(size);
+      if (must_wait && admitting.size() >= max_waiting) {
+        rejected++;
+        return false;
+      }
+      admitting.push_back({ size, nullptr, std::move(admitted), {} });
+      grant_waiting(ready);
+    }
+    call(ready);
+    return true;
+  }
+
+  /**
+   * Grow the reservation by `size` bytes, calling `done` once it is grown or
+   * refused. An empty reservation is bound to this budget first. The
+   * reservation must not be moved or destroyed until `done` is called.
+   */
+  void grow(reservation& target,
+            std::uint64_t size,
+            std::function<void(grow_result)> done)
+  {
+    std::vector<ready_callback> ready;
+    {
+      std::unique_lock lock(mutex);
+      if (!target.budget) {
+        target.budget = this;
+        holders++;
+      }
+      if (limit != 0 && target.size + size > limit) {
+        lock.unlock();
+        done(grow_result::too_large);
+        return;
+      }
+      growing.push_back({ size, &target, {}, std::move(done) });
+      grant_waiting(ready);
+    }
+    call(ready);
+  }
+
+  std::uint64_t get_used() const
+  {
+    std::lock_guard lock(mutex);
+    return used;
+  }
+
+  void write_metrics_json(std::ostream& stream) const
+  {
+    std::lock_guard lock(mutex);
+    stream << "{\"limit\": " << limit << ", \"reserved\": " << used
+           << ", \"uploads\": " << holders
+           << ", \"waiting\": " << growing.size() + admitting.size()
+           << ", \"rejected_total\": " << rejected << "}";
+  }
+};
+
+#endif // MEMORY_BUDGET_HPP
@@ -0,0 +1,102 @@
+#ifndef METADATA_HPP
+#define METADATA_HPP
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "utils.hpp"
+
+/**
+ * What happens to the metadata and colours of the variants, configured as
+ *
+ *   metadata.strip=<bool>
+ *   metadata.keep=<item>,<item>,...   (orientation, copyright)
+ *   metadata.srgb=<bool>
+ *   metadata.autorotate=<bool>
+ *
+ * Camera images carry EXIF (with an embedded thumbnail), XMP and large ICC
+ * profiles, which would otherwise be copied into every variant. With strip,
+ * only the fields the variants need are kept. With srgb, the variants are
+ * converted to sRGB (the colour space browsers assume), so their ICC profile
+ * can be dropped as well. With autorotate, the pixels are rotated by the EXIF
+ * orientation, so that the variants display the same without it.
+ *
+ * The original is always stored unmodified.
+ */
+struct metadata_policy
+{
+  bool strip = false;
+  bool keep_orientation = false;
+  bool keep_copyright = false;
+  bool convert_to_srgb = false;
+  bool autorotate = true;
+
+  /** Set an option from a config entry, key is the part after "metadata." */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "strip") {
+      strip = parse_bool(value);
+    } else if (key == "srgb") {
+      convert_to_srgb = parse_bool(value);
+    } else if (key == "autorotate") {
+      autorotate = parse_bool(value);
+    } else if (key == "keep") {
+      keep_orientation = keep_copyright = false;
+      std::size_t start = 0;
+      while (start < value.size()) {
+        auto end = value.find(',', start);
+        if (end == std::string_view::npos)
+          end = value.size();
+        auto item = value.substr(start, end - start);
+        if (item == "orientation")
+          keep_orientation = true;
+        else if (item == "copyright")
+          keep_copyright = true;
+        else
+          throw std::runtime_error("Unknown metadata item '" +
+                                   std::string(item) +
+                                   "', expected orientation or copyright");
+        start = end + 1;
+      }
+    } else {
+      throw std::runtime_error("Unknown metadata option");
+    }
+  }
+
+  /**
+   * Whether a metadata field of a resized image is written to the variants.
+   * The names are those of libvips (see `vipsheader -a`).
+   */
+  bool keeps_field(std::string_view name) const
+  {
+    if (!strip)
+      return true;
+
+    // needed to save animations correctly
+    if (name == "page-height" || name == "n-pages" || name == "delay" ||
+        name == "loop" || name == "gif-delay" || name == "gif-loop")
+      return true;
+
+    // without conversion, the pixel values only make sense with the profile
+    if (name == "icc-profile-data")
+      return !convert_to_srgb;
+
+    if (keep_orientation &&
+        (name == "orientation" || name == "exif-ifd0-Orientation"))
+      return true;
+    if (keep_copyright &&
+        (name == "exif-ifd0-Copyright" || name == "exif-ifd0-Artist"))
+      return true;
+
+    // libvips rebuilds the EXIF block from the exif-* fields when saving, and
+    // drops the tags whose fields were removed, so the block itself is kept
+    // only as a carrier for the fields above
+    if (name == "exif-data")
+      return keep_orientation || keep_copyright;
+
+    return false;
+  }
+};
+
+#endif // METADATA_HPP
@@ -0,0 +1,91 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+#include "memory_budget.hpp"
+#include "response_cache.hpp"
+#include "thread_pool.hpp"
+#include "upload_sessions.hpp"
+
+#include "storage/interface.hpp"
+
+/**
+ * Counters and settings exposed on the /api/metrics endpoint. A single
+ * instance lives for the whole run of the server, and is referenced from
+ * server_state. Counters are atomics, so they can be bumped from any thread
+ * without further locking.
+ */
+struct server_metrics
+{
+  /** Active threading split, filled in at startup */
+  unsigned thread_pool_size = 0;
+  unsigned vips_concurrency = 0;
+  /** NUMA nodes the pool workers are placed on, 1 if they aren't pinned */
+  unsigned numa_nodes = 1;
+
+  /** Uploads being decoded while they are received, and their total count */
+  std::atomic<unsigned> progressive_decodes{ 0 };
+  std::atomic<std::uint64_t> progressive_decodes_total{ 0 };
+
+  /** Progress of the backfill of missing variants, see backfill.hpp */
+  std::atomic<std::uint64_t> backfill_remaining{ 0 };
+  std::atomic<std::uint64_t> backfill_extended{ 0 };
+  std::atomic<std::uint64_t> backfill_variants{ 0 };
+  std::atomic<std::uint64_t> backfill_failed{ 0 };
+
+  /** Pool whose per-stage queue statistics are included, if set */
+  thread_pool const* pool = nullptr;
+
+  /** Budget whose reservations are included, if set */
+  memory_budget const* memory = nullptr;
+
+  /** Resumable upload sessions, included if set */
+  upload_sessions const* uploads = nullptr;
+
+  /** Cache of upload responses, included if set */
+  response_cache const* responses = nullptr;
+
+  /** Backend whose own counters are included, if set */
+  storage_backend const* storage = nullptr;
+
+  void write_json(std::ostream& stream) const
+  {
+    stream << "{\"threading\": {\"thread_pool_size\": " << thread_pool_size
+           << ", \"vips_concurrency\": " << vips_concurrency
+           << ", \"numa_nodes\": " << numa_nodes << "}";
+    stream << ", \"uploads\": {\"progressive_decodes\": "
+           << progressive_decodes.load()
+           << ", \"progressive_decodes_total\": "
+           << progressive_decodes_total.load() << "}";
+    stream << ", \"backfill\": {\"remaining\": " << backfill_remaining.load()
+           << ", \"extended_folders\": " << backfill_extended.load()
+           << ", \"variants\": " << backfill_variants.load()
+           << ", \"failed\": " << backfill_failed.load() << "}";
+    if (pool) {
+      stream << ", \"stages\": ";
+      pool->write_metrics_json(stream);
+    }
+    if (memory) {
+      stream << ", \"memory\": ";
+      memory->write_metrics_json(stream);
+    }
+    if (uploads) {
+      stream << ", \"upload_sessions\": ";
+      uploads->write_metrics_json(stream);
+    }
+    if (responses) {
+      stream << ", \"response_cache\": ";
+      responses->write_metrics_json(stream);
+    }
+    if (storage) {
+      stream << ", \"storage\": ";
+      storage->write_metrics_json(stream);
+    }
+    stream << "}";
+  }
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,166 @@
+#ifndef PIPELINE_STAGES_HPP
+#define PIPELINE_STAGES_HPP
+
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+/**
+ * Scheduling of the image processing stages on the thread pool, configured as
+ *
+ *   stages.<stage>.priority=<n>
+ *   stages.<stage>.max_concurrency=<n>
+ *
+ * for the stages
+ *
+ *   dedup - hashing and lookup of existing data, the fast path of repeated
+ *     uploads, which runs first (priority 0)
+ *   storage - writing the original and committing the folder (priority 1)
+ *   decode - decoding of uploads while they are received (priority 2)
+ *   encode - saving the variants (priority 2), and encode.<format> for each
+ *     output format, sharing the cap of encode
+ *   resize - creating the variants (priority 3)
+ *   processing - no tasks of its own, its cap is shared by resize and encode
+ *     (and their encode.<format> stages)
+ *   backfill - creating variants missing from stored images after the config
+ *     changed (priority 4, one at a time, within the cap of processing), see
+ *     backfill.hpp
+ *
+ * Lower priorities run first. Work on images already in progress (encoding)
+ * goes before starting new ones (resizing). By default, processing may use all
+ * threads but one, so that lookups of existing images are never stuck behind
+ * heavy encodes; slow formats like avif can get their own lower cap.
+ */
+class stage_config
+{
+private:
+  struct settings
+  {
+    std::optional<unsigned> priority;
+    std::optional<unsigned> max_concurrency;
+  };
+
+  std::map<std::string, settings, std::less<>> stages;
+
+public:
+  static bool is_known_stage(std::string_view name)
+  {
+    return name == "dedup" || name == "storage" || name == "decode" ||
+           name == "processing" || name == "resize" || name == "encode" ||
+           name == "backfill" ||
+           (name.substr(0, 7) == "encode." && name.size() > 7);
+  }
+
+  /** Set an option from a config entry, key is the part after "stages." */
+  void set(std::string_view key, std::string_view value)
+  {
+    auto dot = key.rfind('.');
+    if (dot == std::string_view::npos)
+      throw std::runtime_error("Expected stages.<stage>.<option>");
+    auto name = key.substr(0, dot);
+    auto option = key.substr(dot + 1);
+    if (!is_known_stage(name))
+      throw std::runtime_error("Unknown stage '" + std::string(name) + "'");
+
+    auto& entry = stages[std::string(name)];
+    if (option == "priority")
+      entry.priority = string_view_to_int(value);
+    else if (option == "max_concurrency")
+      entry.max_concurrency = string_view_to_int(value);
+    else
+      throw std::runtime_error("Unknown stage option '" + std::string(option) +
+                               "'");
+  }
+
+  /** Options of a stage, with the defaults overridden by the config */
+  stage_options get(std::string const& name,
+                    unsigned default_priority,
+                    unsigned default_max_concurrency) const
+  {
+    stage_options result(name, default_priority, default_max_concurrency);
+    auto it = stages.find(name);
+    if (it != stages.end()) {
+      if (it->second.priority)
+        result.priority = *it->second.priority;
+      if (it->second.max_concurrency)
+        result.max_concurrency = *it->second.max_concurrency;
+    }
+    return result;
+  }
+
+  /** Formats with their own encode.<format> entry */
+  std::set<std::string> get_configured_encoders() const
+  {
+    std::set<std::string> result;
+    for (auto const& [name, _] : stages)
+      if (name.substr(0, 7) == "encode.")
+        result.insert(name.substr(7));
+    return result;
+  }
+};
+
+/** Stages of thread_pool used by the image processor, see stage_config */
+struct pipeline_stages
+{
+  stage_id dedup;
+  stage_id storage;
+  stage_id decode;
+  stage_id processing;
+  stage_id resize;
+  stage_id encode;
+  stage_id backfill;
+  std::unordered_map<std::string, stage_id> encoders;
+
+  /** Stages to create the pool with */
+  std::vector<stage_options> options;
+
+  /** Stage of encoding into the given format */
+  stage_id encoder(std::string const& format) const
+  {
+    auto it = encoders.find(format);
+    return it != encoders.end() ? it->second : encode;
+  }
+
+  static pipeline_stages create(stage_config const& config,
+                                unsigned pool_size,
+                                std::set<std::string> const& output_formats)
+  {
+    pipeline_stages result;
+    auto add = [&](std::string const& name,
+                   unsigned priority,
+                   unsigned max_concurrency,
+                   std::optional<stage_id> parent = std::nullopt) {
+      auto stage = config.get(name, priority, max_concurrency);
+      stage.parent = parent;
+      result.options.push_back(std::move(stage));
+      return stage_id(result.options.size() - 1);
+    };
+
+    // the first stage is the default one, used e.g. for spawn()
+    result.dedup = add("dedup", 0, 0);
+    result.storage = add("storage", 1, 0);
+    result.decode = add("decode", 2, 0);
+    result.processing = add("processing", 0, pool_size > 1 ? pool_size - 1 : 0);
+    result.resize = add("resize", 3, 0, result.processing);
+    result.encode = add("encode", 2, 0, result.processing);
+    result.backfill = add("backfill", 4, 1, result.processing);
+
+    auto formats = config.get_configured_encoders();
+    formats.insert(output_formats.begin(), output_formats.end());
+    auto encode_priority = result.options[result.encode].priority;
+    for (auto const& format : formats)
+      result.encoders[format] =
+        add("encode." + format, encode_priority, 0, result.encode);
+    return result;
+  }
+};
+
+#endif // PIPELINE_STAGES_HPP
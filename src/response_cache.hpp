@@ -0,0 +1,226 @@
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * Cache of upload responses of stored images, configured as
+ *
+ *   response_cache.max_size=<bytes>    (0 disables the cache)
+ *   response_cache.shards=<n>
+ *   response_cache.max_age_secs=<n>    (0 is not limited)
+ */
+struct response_cache_config
+{
+  std::uint64_t max_size = 16 * 1024 * 1024;
+  unsigned shards = 16;
+  unsigned max_age_secs = 600;
+
+  /**
+   * Set an option from a config entry, key is the part after
+   * "response_cache."
+   */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "max_size") {
+      max_size = parse_bytes(value);
+    } else if (key == "shards") {
+      shards = string_view_to_int(value);
+      if (shards == 0)
+        throw std::runtime_error("response_cache.shards must be positive");
+    } else if (key == "max_age_secs") {
+      max_age_secs = string_view_to_int(value);
+    } else {
+      throw std::runtime_error("Unknown response_cache option");
+    }
+  }
+};
+
+/**
+ * Serialized responses to uploads of already stored images, by image hash, so
+ * that repeated uploads of popular images don't list the stored folder and
+ * write the JSON again. Each shard evicts its least recently used responses
+ * when it is over its part of max_size.
+ *
+ * The responses are shared, so that they can be sent while they are evicted.
+ *
+ * A response is dropped by remove() when the folder of its image changes in
+ * this process. An insert of a response read before such a change would bring
+ * it back, so inserts carry the epoch() of the hash from before the folder was
+ * read, and are ignored if it was removed since. The epochs are kept for
+ * EPOCH_SLOTS groups of hashes in each shard, so a removal may also turn away
+ * the inserts of other hashes, which are then just read again next time.
+ *
+ * Changes made by other processes sharing the storage aren't seen, such
+ * responses are dropped only after max_age_secs.
+ */
+class response_cache
+{
+public:
+  using response = std::shared_ptr<std::string const>;
+
+private:
+  static constexpr std::size_t EPOCH_SLOTS = 64;
+
+  struct entry
+  {
+    std::string hash;
+    response value;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  struct shard
+  {
+    mutable std::mutex mutex;
+    /** Most recently used first */
+    std::list<entry> entries;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> by_hash;
+    std::uint64_t size = 0;
+    /** Removals of the hashes of each slot, see epoch() */
+    std::array<std::uint64_t, EPOCH_SLOTS> epochs{};
+  };
+
+  std::uint64_t const shard_max_size;
+  std::chrono::seconds const max_age;
+  std::vector<shard> shards;
+
+  std::atomic<std::uint64_t> hits{ 0 };
+  std::atomic<std::uint64_t> misses{ 0 };
+  std::atomic<std::uint64_t> evictions{ 0 };
+
+  /** The shard of the hash, and the slot of its epoch in the shard */
+  std::pair<shard&, std::size_t> locate(std::string_view hash)
+  {
+    auto h = std::hash<std::string_view>{}(hash);
+    return { shards[h % shards.size()], h / shards.size() % EPOCH_SLOTS };
+  }
+
+  /** Memory held by an entry */
+  static std::uint64_t entry_size(std::string const& hash, response const& r)
+  {
+    return hash.size() + r->size();
+  }
+
+  /** Remove an entry, the mutex of its shard must be locked */
+  static void erase(shard& s, std::list<entry>::iterator it)
+  {
+    s.size -= entry_size(it->hash, it->value);
+    s.by_hash.erase(it->hash);
+    s.entries.erase(it);
+  }
+
+public:
+  explicit response_cache(response_cache_config const& settings)
+    : shard_max_size(settings.max_size / settings.shards)
+    , max_age(settings.max_age_secs)
+    , shards(settings.shards)
+  {
+  }
+
+  response_cache(response_cache const&) = delete;
+  response_cache& operator=(response_cache const&) = delete;
+
+  /** The response for an image, or null if it isn't cached */
+  response find(std::string_view hash)
+  {
+    auto [s, _] = locate(hash);
+    std::lock_guard lock(s.mutex);
+    auto it = s.by_hash.find(hash);
+    if (it != s.by_hash.end() && max_age.count() &&
+        it->second->expires <= std::chrono::steady_clock::now()) {
+      erase(s, it->second);
+      it = s.by_hash.end();
+    }
+    if (it == s.by_hash.end()) {
+      misses++;
+      return nullptr;
+    }
+    hits++;
+    s.entries.splice(s.entries.begin(), s.entries, it->second);
+    return it->second->value;
+  }
+
+  /**
+   * Removals of the hash so far, to be passed to insert(). Call it before
+   * reading the folder the response is made from.
+   */
+  std::uint64_t epoch(std::string_view hash)
+  {
+    auto [s, slot] = locate(hash);
+    std::lock_guard lock(s.mutex);
+    return s.epochs[slot];
+  }
+
+  /**
+   * Store the response for an image, replacing any previous one, unless the
+   * hash was removed since its epoch was taken
+   */
+  void insert(std::string const& hash,
+              std::string serialized,
+              std::uint64_t epoch)
+  {
+    auto r = std::make_shared<std::string const>(std::move(serialized));
+    if (entry_size(hash, r) > shard_max_size)
+      return;
+
+    auto [s, slot] = locate(hash);
+    std::lock_guard lock(s.mutex);
+    if (s.epochs[slot] != epoch)
+      return;
+    auto it = s.by_hash.find(hash);
+    if (it != s.by_hash.end())
+      erase(s, it->second);
+
+    s.entries.push_front(
+      { hash, std::move(r), std::chrono::steady_clock::now() + max_age });
+    s.by_hash.emplace(s.entries.front().hash, s.entries.begin());
+    s.size += entry_size(hash, s.entries.front().value);
+    while (s.size > shard_max_size) {
+      erase(s, std::prev(s.entries.end()));
+      evictions++;
+    }
+  }
+
+  /** Forget the response for an image, e.g. when its folder changed */
+  void remove(std::string_view hash)
+  {
+    auto [s, slot] = locate(hash);
+    std::lock_guard lock(s.mutex);
+    s.epochs[slot]++;
+    auto it = s.by_hash.find(hash);
+    if (it != s.by_hash.end())
+      erase(s, it->second);
+  }
+
+  void write_metrics_json(std::ostream& stream) const
+  {
+    std::uint64_t entries = 0, size = 0;
+    for (auto const& s : shards) {
+      std::lock_guard lock(s.mutex);
+      entries += s.entries.size();
+      size += s.size;
+    }
+    stream << "{\"hits\": " << hits.load() << ", \"misses\": " << misses.load()
+           << ", \"evictions\": " << evictions.load()
+           << ", \"entries\": " << entries << ", \"size\": " << size << "}";
+  }
+};
+
+#endif // RESPONSE_CACHE_HPP
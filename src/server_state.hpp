@@ -1,14 +1,19 @@
 #ifndef SERVER_STATE_HPP
 #define SERVER_STATE_HPP
 
-#include <atomic>
 #include <mutex>
 #include <unordered_map>
 
-#include <magic.h>
-
+#include "claims.hpp"
 #include "config.hpp"
+#include "coro.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "pipeline_stages.hpp"
+#include "response_cache.hpp"
 #include "thread_pool.hpp"
+#include "tracing.hpp"
+#include "upload_sessions.hpp"
 
 /**
  * Lightweight structure that can be cheaply copied. It can be used to pass around references to
@@ -18,12 +23,30 @@ struct server_state
 {
   config const& server_config;
   thread_pool& pool;
+  /** Stages of the pool the processing steps are queued in */
+  pipeline_stages const& stages;
 
-  std::unordered_map<std::string, std::shared_ptr<std::atomic<bool>>>&
+  /** Images being processed in this process, see async_event */
+  std::unordered_map<std::string, std::shared_ptr<async_event>>&
     currently_processing;
   std::mutex& currently_processing_mutex;
 
-  magic_t magic_cookie = nullptr;
+  /** Deduplication across processes, null if not configured */
+  claim_registry* claims;
+
+  /** Memory reserved by the uploads being processed */
+  memory_budget& memory;
+
+  server_metrics& metrics;
+
+  /** Traces of sampled requests */
+  request_tracer& tracer;
+
+  /** Resumable uploads, null if they are disabled */
+  upload_sessions* uploads;
+
+  /** Responses to uploads of stored images, null if disabled */
+  response_cache* responses;
 };
 
 #endif // SERVER_STATE_HPP
@@ -2,14 +2,37 @@
 #define STORAGE_FS_HPP
 
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <shared_mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+#include "../utils.hpp"
 #include "interface.hpp"
+#include "record_log.hpp"
 
 /**
  * Implementation of the filesystem storage backend.
  *
+ * Optionally (storage.index=true), the backend keeps an index of the committed
+ * folders and their files in data_dir/.asset-server-index, so lookups don't
+ * need to walk the directories. It is an append-only log of checksummed
+ * records (see record_log.hpp), appended on every commit, and loaded with a
+ * single mmap at startup. Only if it is missing or damaged, it is rebuilt by
+ * scanning data_dir in parallel. The index is loaded by a single process, so
+ * it can't be used with claim_dir. When a server runs without the index, it
+ * marks the index as outdated, to be rebuilt when it is enabled again.
+ *
  * See interface.hpp for description of the methods.
  */
 
@@ -59,70 +82,626 @@ private:
   std::string data_dir;
   std::string temp_dir;
 
+  /**
+   * Number of directory levels between data_dir and the image folders. Each
+   * level is named by the next 2 characters of the image folder name, e.g.
+   * with 2 levels, folder abcdef12 is stored at data_dir/ab/cd/abcdef12.
+   */
+  unsigned shard_levels = 0;
+  static constexpr std::size_t SHARD_NAME_LENGTH = 2;
+
+  /** Name of the file in data_dir which records the layout */
+  static constexpr const char* LAYOUT_MARKER = ".asset-server-layout";
+
+  bool use_index = false;
+  static constexpr const char* INDEX_NAME = ".asset-server-index";
+  static constexpr std::uint32_t INDEX_MAGIC = 0x58495346; // "FSIX"
+  static constexpr std::uint8_t OP_PUT = 0;
+  static constexpr std::uint8_t OP_REMOVE = 1;
+
+  /** A file or folder of an indexed folder */
+  struct index_entry
+  {
+    /** Path relative to the folder, '/'-separated */
+    std::string path;
+    bool is_folder;
+    std::uint64_t size;
+  };
+
+  /** Where the current record of a folder is in the index file */
+  struct index_location
+  {
+    std::uint64_t offset;
+    std::uint64_t length;
+  };
+
+  /**
+   * Guards the index map and file. The index is updated also by lookups which
+   * find a folder missing from it, hence mutable.
+   */
+  mutable std::shared_mutex index_mutex;
+  mutable std::unordered_map<std::string, index_location> index;
+  mutable int index_fd = -1;
+  mutable std::uint64_t index_size = 0;
+
+  /** Everything that determines where and under which name data is stored */
+  struct fs_layout
+  {
+    std::string hash_algorithm;
+    unsigned shard_levels;
+
+    bool operator==(fs_layout const&) const = default;
+  };
+
+  /**
+   * Trees created before the marker was introduced have no marker, and were
+   * all created with this layout. The marker is only written for other
+   * layouts, so these trees are left untouched.
+   */
+  static fs_layout legacy_layout() { return { "sha256", 0 }; }
+
+  fs_layout configured_layout(storage_layout const& layout) const
+  {
+    return { layout.hash_algorithm, shard_levels };
+  }
+
+  std::filesystem::path marker_path() const
+  {
+    return std::filesystem::path(data_dir) / LAYOUT_MARKER;
+  }
+
+  void write_layout_marker(fs_layout const& layout) const
+  {
+    auto path = marker_path();
+    if (layout == legacy_layout()) {
+      std::filesystem::remove(path);
+      return;
+    }
+
+    std::ofstream file(path);
+    file << "hash_algorithm=" << layout.hash_algorithm << "\n"
+         << "shard_levels=" << layout.shard_levels << "\n";
+    if (!file)
+      throw std::runtime_error("Failed to write " + path.string());
+  }
+
+  fs_layout read_layout_marker() const
+  {
+    auto path = marker_path();
+    if (!std::filesystem::exists(path))
+      return legacy_layout();
+
+    std::ifstream file(path);
+    if (!file)
+      throw std::runtime_error("Failed to read " + path.string());
+
+    fs_layout result = legacy_layout();
+    std::string line;
+    while (std::getline(file, line)) {
+      auto pos = line.find('=');
+      if (pos == std::string::npos)
+        continue;
+      auto key = line.substr(0, pos);
+      if (key == "hash_algorithm")
+        result.hash_algorithm = line.substr(pos + 1);
+      else if (key == "shard_levels")
+        result.shard_levels = string_view_to_int(line.substr(pos + 1));
+      else
+        throw std::runtime_error("Unknown key in " + path.string() + ": " +
+                                 key);
+    }
+    return result;
+  }
+
+  void check_layout_marker(storage_layout const& layout) const
+  {
+    fs_layout existing = read_layout_marker();
+    fs_layout configured = configured_layout(layout);
+    // the index (and its marker) alone doesn't count as data
+    bool is_empty = std::all_of(
+      std::filesystem::directory_iterator(data_dir),
+      std::filesystem::directory_iterator(),
+      [](auto const& entry) {
+        return entry.path().filename().string().starts_with(INDEX_NAME);
+      });
+
+    if (!is_empty && existing.hash_algorithm != configured.hash_algorithm)
+      throw std::runtime_error(
+        "data_dir " + data_dir + " contains data stored with hash_algorithm=" +
+        existing.hash_algorithm + ", but the server is configured with " +
+        configured.hash_algorithm);
+
+    if (!is_empty && existing.shard_levels != configured.shard_levels)
+      throw std::runtime_error(
+        "data_dir " + data_dir + " contains data stored with shard_levels=" +
+        std::to_string(existing.shard_levels) +
+        ", but the server is configured with " +
+        std::to_string(configured.shard_levels) +
+        ". Run the server with --migrate-storage to convert the data.");
+
+    if (is_empty)
+      write_layout_marker(configured);
+  }
+
+  /** Path of the folder with the given name, including the shard levels */
+  std::filesystem::path folder_path(std::string_view name) const
+  {
+    std::filesystem::path result = data_dir;
+    for (unsigned level = 0; level < shard_levels; level++) {
+      auto start = level * SHARD_NAME_LENGTH;
+      if (start + SHARD_NAME_LENGTH > name.size())
+        break;
+      result /= name.substr(start, SHARD_NAME_LENGTH);
+    }
+    result /= name;
+    return result;
+  }
+
+  static std::vector<folder_entry> walk_directory(
+    std::filesystem::path const& path)
+  {
+    std::vector<folder_entry> result;
+    for (auto const& entry : std::filesystem::directory_iterator(path)) {
+      folder_entry folder;
+      folder.name = entry.path().filename().string();
+      if (entry.is_directory())
+        folder.children = walk_directory(entry.path());
+      // else: a file, children are nullopt
+      result.push_back(std::move(folder));
+    }
+    return result;
+  }
+
+  /**
+   * Call fn(path) for every image folder in data_dir, at any shard level.
+   * Shard directories are recognized by their name length, which can't be
+   * the length of an image folder name.
+   */
+  template<typename Fn>
+  void for_each_image_folder(std::filesystem::path const& dir,
+                             Fn const& fn) const
+  {
+    std::vector<std::filesystem::path> subdirs;
+    for (auto const& entry : std::filesystem::directory_iterator(dir)) {
+      if (entry.is_directory())
+        subdirs.push_back(entry.path());
+    }
+
+    for (auto const& subdir : subdirs) {
+      if (subdir.filename().string().size() == SHARD_NAME_LENGTH)
+        for_each_image_folder(subdir, fn);
+      else
+        fn(subdir);
+    }
+  }
+
+  /** Remove the empty shard directories below dir, but not dir itself */
+  void remove_empty_shards(std::filesystem::path const& dir)
+  {
+    for (auto const& entry : std::filesystem::directory_iterator(dir)) {
+      if (!entry.is_directory() ||
+          entry.path().filename().string().size() != SHARD_NAME_LENGTH)
+        continue;
+
+      remove_empty_shards(entry.path());
+      if (std::filesystem::is_empty(entry.path()))
+        std::filesystem::remove(entry.path());
+    }
+  }
+
+  std::filesystem::path index_path() const
+  {
+    return std::filesystem::path(data_dir) / INDEX_NAME;
+  }
+
+  /** List all files and folders below path, with their sizes */
+  static void scan_folder(std::filesystem::path const& path,
+                          std::string const& prefix,
+                          std::vector<index_entry>& result)
+  {
+    for (auto const& entry : std::filesystem::directory_iterator(path)) {
+      auto name = prefix + entry.path().filename().string();
+      if (entry.is_directory()) {
+        result.push_back({ name, true, 0 });
+        scan_folder(entry.path(), name + "/", result);
+      } else {
+        result.push_back({ name, false, entry.file_size() });
+      }
+    }
+  }
+
+  static std::string encode_index_record(
+    std::string_view name,
+    std::uint8_t op,
+    std::vector<index_entry> const& entries)
+  {
+    std::string payload;
+    record_put_string(payload, name);
+    payload.push_back(op);
+    record_put_u32(payload, entries.size());
+    for (auto const& entry : entries) {
+      record_put_string(payload, entry.path);
+      payload.push_back(entry.is_folder);
+      record_put_u64(payload, entry.size);
+    }
+    return frame_record(INDEX_MAGIC, payload);
+  }
+
+  static std::string encode_folder_record(std::filesystem::path const& path)
+  {
+    std::vector<index_entry> entries;
+    scan_folder(path, "", entries);
+    return encode_index_record(path.filename().string(), OP_PUT, entries);
+  }
+
+  /**
+   * Add the records in contents, which start at offset base of the index
+   * file, to the index map. Caller must hold index_mutex exclusively. Returns
+   * the length of the valid part of contents.
+   */
+  std::size_t apply_index_records(std::string_view contents,
+                                  std::uint64_t base) const
+  {
+    auto apply = [&](std::string_view payload, std::size_t offset) {
+      record_reader reader{ payload };
+      auto name = reader.get_string();
+      if (reader.get<std::uint8_t>() == OP_REMOVE)
+        index.erase(name);
+      else
+        index[name] = { base + offset, RECORD_HEADER_SIZE + payload.size() };
+    };
+    return parse_records(contents, INDEX_MAGIC, "fs index", apply);
+  }
+
+  /** Append a record to the index. Caller must hold index_mutex exclusively */
+  void append_index_record(std::string const& record) const
+  {
+    std::size_t written = 0;
+    while (written < record.size()) {
+      auto result =
+        ::write(index_fd, record.data() + written, record.size() - written);
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        // don't leave a partial record behind
+        (void)::ftruncate(index_fd, index_size);
+        throw std::runtime_error("Failed to write fs index: " +
+                                 std::string(std::strerror(errno)));
+      }
+      written += result;
+    }
+    // the folder is committed already, without the record it would be lost
+    // from the index after a crash
+    if (::fdatasync(index_fd) != 0)
+      throw std::runtime_error("Failed to sync fs index: " +
+                               std::string(std::strerror(errno)));
+    apply_index_records(record, index_size);
+    index_size += record.size();
+  }
+
+  /** Read the indexed entries of a folder, or nullopt if it isn't indexed */
+  std::optional<std::vector<folder_entry>> lookup_index(
+    std::string_view name) const
+  {
+    std::string record;
+    {
+      std::shared_lock lock(index_mutex);
+      auto it = index.find(std::string(name));
+      if (it == index.end())
+        return std::nullopt;
+      record.resize(it->second.length);
+      if (::pread(index_fd, record.data(), record.size(), it->second.offset) !=
+          static_cast<ssize_t>(record.size()))
+        throw std::runtime_error("Failed to read fs index");
+    }
+
+    std::vector<folder_entry> result;
+    auto read_entries = [&](std::string_view payload, std::size_t) {
+      record_reader reader{ payload };
+      reader.get_string();
+      reader.get<std::uint8_t>();
+      auto count = reader.get<std::uint32_t>();
+      for (std::uint32_t i = 0; i < count; i++) {
+        auto path = reader.get_string();
+        bool is_folder = reader.get<std::uint8_t>();
+        reader.get<std::uint64_t>();
+        insert_folder_entry(result, path, is_folder);
+      }
+    };
+    if (parse_records(record, INDEX_MAGIC, "fs index", read_entries) !=
+        record.size())
+      throw std::runtime_error("fs index record of " + std::string(name) +
+                               " is damaged");
+    return result;
+  }
+
+  /**
+   * Replace the index file with contents, atomically, and open it for
+   * appending. Caller must hold index_mutex exclusively.
+   */
+  void write_index_file(std::string_view contents) const
+  {
+    auto tmp_path = index_path();
+    tmp_path += ".tmp";
+    int fd = ::open(tmp_path.c_str(),
+                    O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create " + tmp_path.string());
+    if (::write(fd, contents.data(), contents.size()) !=
+          static_cast<ssize_t>(contents.size()) ||
+        ::fdatasync(fd) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to write " + tmp_path.string());
+    }
+    std::filesystem::rename(tmp_path, index_path());
+
+    if (index_fd >= 0)
+      ::close(index_fd);
+    index_fd = fd;
+    index_size = contents.size();
+    index.clear();
+    apply_index_records(contents, 0);
+  }
+
+  /**
+   * Load the index file. Returns false if it is missing or damaged, in which
+   * case it must be rebuilt.
+   */
+  bool load_index()
+  {
+    int fd = ::open(index_path().c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      return false;
+    }
+    std::size_t size = st.st_size;
+    std::size_t valid = 0;
+    std::uint64_t live = 0;
+    if (size > 0) {
+      void* address = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED) {
+        ::close(fd);
+        return false;
+      }
+      std::string_view contents(static_cast<char const*>(address), size);
+      valid = apply_index_records(contents, 0);
+
+      // superseded records take most of the file, rewrite it
+      for (auto const& [name, location] : index)
+        live += location.length;
+      if (valid == size && size > 1024 * 1024 && size > 2 * live) {
+        std::string compacted;
+        for (auto const& [name, location] : index)
+          compacted += contents.substr(location.offset, location.length);
+        ::munmap(address, size);
+        ::close(fd);
+        write_index_file(compacted);
+        return true;
+      }
+      ::munmap(address, size);
+    }
+
+    index_fd = fd;
+    index_size = size;
+    return valid == size;
+  }
+
+  /** Build the index by scanning all folders in data_dir */
+  void rebuild_index()
+  {
+    std::vector<std::filesystem::path> folders;
+    for_each_image_folder(data_dir, [&](std::filesystem::path const& path) {
+      folders.push_back(path);
+    });
+
+    // walking the folders is mostly waiting for the disk, so it pays off to
+    // have many requests in flight
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::future<std::string>> parts;
+    for (unsigned worker = 0; worker < workers; worker++) {
+      parts.push_back(std::async(std::launch::async, [&, worker] {
+        std::string part;
+        for (std::size_t i = worker; i < folders.size(); i += workers)
+          part += encode_folder_record(folders[i]);
+        return part;
+      }));
+    }
+    std::string contents;
+    for (auto& part : parts)
+      contents += part.get();
+
+    write_index_file(contents);
+    log_info("Rebuilt fs index of ", folders.size(), " folders");
+  }
+
 public:
+  ~storage_fs() override
+  {
+    if (index_fd >= 0)
+      ::close(index_fd);
+  }
+
   void set_config(std::string_view key, std::string_view value) override
   {
     if (key == "data_dir")
       data_dir = value;
     else if (key == "temp_dir")
       temp_dir = value;
+    else if (key == "shard_levels")
+      shard_levels = string_view_to_int(value);
+    else if (key == "index")
+      use_index = parse_bool(value);
     else
       throw std::runtime_error("Unknown storage config key: " +
                                std::string(key));
   }
 
+  /** The index is cached by each process, see the class comment */
+  bool supports_multiple_processes() const override { return !use_index; }
+
   void validate() const override
   {
     if (data_dir.empty())
       throw std::runtime_error("data_dir not specified");
     if (temp_dir.empty())
       throw std::runtime_error("temp_dir not specified");
+    // 4 levels already give 2^32 leaf directories
+    if (shard_levels > 4)
+      throw std::runtime_error("shard_levels must be at most 4");
   }
 
-  void init() override
+  void init(storage_layout const& layout) override
   {
     std::filesystem::remove_all(temp_dir);
     std::filesystem::create_directory(temp_dir);
     // ensure the directory exists
     std::filesystem::create_directory(data_dir);
+    check_layout_marker(layout);
+
+    auto outdated_path = index_path();
+    outdated_path += ".outdated";
+    if (!use_index) {
+      // an index left from an earlier run would miss the folders committed
+      // since then. It is only marked, not removed, in case another process
+      // is (wrongly) using it
+      if (std::filesystem::exists(index_path()))
+        std::ofstream{ outdated_path };
+      return;
+    }
+
+    std::unique_lock lock(index_mutex);
+    index.clear();
+    if (index_fd >= 0)
+      ::close(index_fd);
+    index_fd = -1;
+    if (std::filesystem::exists(outdated_path)) {
+      log_warning("fs index was not updated by the last run, rebuilding it");
+      rebuild_index();
+      std::filesystem::remove(outdated_path);
+    } else if (!load_index()) {
+      log_warning("fs index is missing or damaged, rebuilding it");
+      rebuild_index();
+    }
+  }
+
+  /**
+   * Move all image folders to the location given by the configured
+   * shard_levels. Folders already in the right place are skipped, so if this
+   * is interrupted, running it again continues where it stopped. The layout
+   * marker is updated only after all folders are moved, so the server refuses
+   * to start on a half-migrated tree.
+   */
+  void migrate(storage_layout const& layout) override
+  {
+    std::filesystem::create_directory(data_dir);
+
+    fs_layout existing = read_layout_marker();
+    fs_layout configured = configured_layout(layout);
+    if (existing.hash_algorithm != configured.hash_algorithm)
+      throw std::runtime_error(
+        "Can't migrate data stored with hash_algorithm=" +
+        existing.hash_algorithm + " to " + configured.hash_algorithm);
+
+    std::size_t moved = 0;
+    std::size_t total = 0;
+    for_each_image_folder(data_dir, [&](std::filesystem::path const& path) {
+      total++;
+      auto target = folder_path(path.filename().string());
+      if (target == path)
+        return;
+
+      std::filesystem::create_directories(target.parent_path());
+      std::filesystem::rename(path, target);
+      if (++moved % 10000 == 0)
+        log_info("Moved ", moved, " folders");
+    });
+    remove_empty_shards(data_dir);
+
+    write_layout_marker(configured);
+    log_info("Migration done: moved ", moved, " of ", total, " folders");
   }
 
   std::optional<std::vector<folder_entry>> walk_folder(
     std::string_view path) const override
   {
-    std::filesystem::path full_path = data_dir;
-    full_path /= path;
+    if (use_index) {
+      if (auto result = lookup_index(path))
+        return result;
+    }
+
+    auto full_path = folder_path(path);
     if (!std::filesystem::exists(full_path))
       return std::nullopt;
 
-    std::vector<folder_entry> result;
-    for (auto const& entry : std::filesystem::directory_iterator(full_path)) {
-      folder_entry folder;
-      folder.name = entry.path().filename().string();
-      if (entry.is_directory()) {
-        // take the full path, then remove the data_dir prefix, which will be
-        // added in the recursive call
-        auto subdir_path_datadir_relative =
-          entry.path().string().substr(data_dir.size() + 1);
-
-        // recursively list the subfolder
-        folder.children = walk_folder(subdir_path_datadir_relative);
-        if (!folder.children) // sanity check
-          throw std::runtime_error("walk_folder found a folder at " +
-                                   entry.path().relative_path().string() +
-                                   ", but recursive call returned nullopt");
-      } // else: a file, children are nullopt
-      result.push_back(folder);
+    // a crash between committing the folder and recording it leaves it out
+    // of the index, so it is added now
+    if (use_index) {
+      auto record = encode_folder_record(full_path);
+      std::unique_lock lock(index_mutex);
+      append_index_record(record);
     }
+    return walk_directory(full_path);
+  }
+
+  std::optional<std::vector<std::uint8_t>> read_file(
+    std::string_view folder,
+    std::string_view path) const override
+  {
+    auto full_path = folder_path(folder) / path;
+    std::ifstream file(full_path, std::ios::binary);
+    if (!file.is_open())
+      return std::nullopt;
+
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), {});
+  }
+
+  std::vector<stored_folder> list_folders() const override
+  {
+    std::vector<stored_folder> result;
+    for_each_image_folder(data_dir, [&](std::filesystem::path const& path) {
+      std::uint64_t size = 0;
+      for (auto const& entry :
+           std::filesystem::recursive_directory_iterator(path)) {
+        if (entry.is_regular_file())
+          size += entry.file_size();
+      }
+      result.push_back({ path.filename().string(), size });
+    });
     return result;
   }
 
+  void remove_folder(std::string_view name) override
+  {
+    if (use_index) {
+      std::unique_lock lock(index_mutex);
+      if (index.contains(std::string(name)))
+        append_index_record(encode_index_record(name, OP_REMOVE, {}));
+    }
+
+    // move it out of data_dir first, so it disappears all at once
+    std::filesystem::path removed = temp_dir;
+    removed /= "removed-" + std::string(name) + std::to_string(std::rand());
+    std::error_code ec;
+    std::filesystem::rename(folder_path(name), removed, ec);
+    if (ec == std::errc::no_such_file_or_directory)
+      return;
+    if (ec)
+      throw std::filesystem::filesystem_error(
+        "Failed to remove folder", folder_path(name), ec);
+    std::filesystem::remove_all(removed);
+  }
+
   std::unique_ptr<staged_folder> create_staged_folder(
     std::string_view folder) override
   {
     std::filesystem::path full_path = temp_dir;
     full_path /= std::string(folder) + std::to_string(std::rand());
-    std::cerr << "Creating staged folder at " << full_path << std::endl;
+    log_debug("Creating staged folder at ", full_path);
 
     std::filesystem::create_directory(full_path);
     auto result = std::make_unique<fs_staged_folder>();
@@ -131,14 +710,69 @@ public:
     return result;
   }
 
-  void commit_staged_folder(staged_folder& folder) override
+  bool commit_staged_folder(staged_folder& folder) override
   {
-    auto fs_folder = dynamic_cast<fs_staged_folder&>(folder);
-    std::filesystem::path full_path = data_dir;
-    full_path /= fs_folder.final_name;
-    std::filesystem::rename(fs_folder.path, full_path);
+    auto& fs_folder = dynamic_cast<fs_staged_folder&>(folder);
+    auto full_path = folder_path(fs_folder.final_name);
+    if (shard_levels > 0)
+      std::filesystem::create_directories(full_path.parent_path());
+    std::error_code ec;
+    std::filesystem::rename(fs_folder.path, full_path, ec);
+    if (ec) {
+      // another server process sharing data_dir stored the same image first,
+      // ours is dropped
+      if (std::filesystem::exists(full_path))
+        return false;
+      throw std::filesystem::filesystem_error(
+        "Failed to commit folder", fs_folder.path, full_path, ec);
+    }
     fs_folder.should_cleanup = false;
+
+    if (use_index) {
+      auto record = encode_folder_record(full_path);
+      std::unique_lock lock(index_mutex);
+      append_index_record(record);
+    }
+    return true;
+  }
+
+  /**
+   * The existing files are hard-linked into the staged folder, which is then
+   * swapped with the committed one in a single rename
+   */
+  void extend_folder(staged_folder& folder) override
+  {
+    auto& fs_folder = dynamic_cast<fs_staged_folder&>(folder);
+    auto full_path = folder_path(fs_folder.final_name);
+    for (auto const& entry :
+         std::filesystem::recursive_directory_iterator(full_path)) {
+      auto target =
+        fs_folder.path / std::filesystem::relative(entry.path(), full_path);
+      if (entry.is_directory())
+        std::filesystem::create_directories(target);
+      else if (!std::filesystem::exists(target))
+        std::filesystem::create_hard_link(entry.path(), target);
+    }
+
+    if (::renameat2(AT_FDCWD,
+                    fs_folder.path.c_str(),
+                    AT_FDCWD,
+                    full_path.c_str(),
+                    RENAME_EXCHANGE) != 0)
+      throw std::filesystem::filesystem_error(
+        "Failed to extend folder",
+        fs_folder.path,
+        full_path,
+        std::error_code(errno, std::generic_category()));
+    // the staged path now holds the old folder, which the destructor of the
+    // staged folder removes
+
+    if (use_index) {
+      auto record = encode_folder_record(full_path);
+      std::unique_lock lock(index_mutex);
+      append_index_record(record);
+    }
   }
 };
 
-#endif // STORAGE_FS_HPP
\ No newline at end of file
+#endif // STORAGE_FS_HPP
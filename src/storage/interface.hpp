@@ -1,7 +1,14 @@
 #ifndef STORAGE_INTERFACE_HPP
 #define STORAGE_INTERFACE_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <vector>
 
 /**
  * This file defines an interface for a storage backend.
@@ -22,6 +29,58 @@ struct folder_entry
   std::optional<std::vector<folder_entry>> children;
 };
 
+/**
+ * Insert an entry given by a '/'-separated path into a tree of entries,
+ * creating the parent folders as needed. This is useful for backends which
+ * store flat lists of paths instead of real folders.
+ */
+void
+insert_folder_entry(std::vector<folder_entry>& tree,
+                    std::string_view path,
+                    bool is_folder)
+{
+  auto slash = path.find('/');
+  auto name = path.substr(0, slash);
+  bool is_last = slash == std::string_view::npos;
+
+  auto it = std::find_if(tree.begin(), tree.end(), [&](auto const& entry) {
+    return entry.name == name;
+  });
+  if (it == tree.end()) {
+    folder_entry entry{ std::string(name), std::nullopt };
+    if (!is_last || is_folder)
+      entry.children.emplace();
+    tree.push_back(std::move(entry));
+    it = tree.end() - 1;
+  }
+
+  if (!is_last) {
+    if (!it->children)
+      throw std::runtime_error("Path " + std::string(path) +
+                               " goes through a file");
+    insert_folder_entry(*it->children, path.substr(slash + 1), is_folder);
+  }
+}
+
+/** A committed folder, as returned by storage_backend::list_folders */
+struct stored_folder
+{
+  std::string name;
+  /** Total size of the files in the folder, in bytes */
+  std::uint64_t size;
+};
+
+/**
+ * Server-wide properties of the stored data, which must not change while the
+ * storage is in use (e.g. data stored under hashes of one algorithm can't be
+ * found by hashes of another one). Backends should persist these, and refuse
+ * to start with a different layout.
+ */
+struct storage_layout
+{
+  std::string hash_algorithm;
+};
+
 /**
  * An interface (abstract class) for a temporary folder where the image
  * processing results can be stored and later atomically committed to
@@ -88,8 +147,24 @@ public:
   /**
    * Initialize the storage backend. This is called after the configuration is
    * loaded and validated.
+   *
+   * If the storage already contains data stored with a different layout, this
+   * should throw an exception.
    */
-  virtual void init() = 0;
+  virtual void init(storage_layout const& layout) = 0;
+
+  /**
+   * Convert data stored in the backend with an older layout or configuration
+   * to the current one. This is run offline (instead of init()), by the
+   * --migrate-storage command-line option. It should be safe to run again
+   * after an interruption.
+   *
+   * Backends which have nothing to migrate can keep this default.
+   */
+  virtual void migrate(storage_layout const&)
+  {
+    throw std::runtime_error("This storage backend has nothing to migrate");
+  }
 
   /**
    * Return a recursive listing (a tree) of all the files and folders in a folder.
@@ -102,6 +177,55 @@ public:
   virtual std::optional<std::vector<folder_entry>> walk_folder(
     std::string_view path) const = 0;
 
+  /**
+   * Read a file from a committed folder. The path is relative to the folder,
+   * with '/' as separator. Same thread-safety rules as for walk_folder apply.
+   *
+   * If the file does not exist, this should return std::nullopt.
+   */
+  virtual std::optional<std::vector<std::uint8_t>> read_file(
+    std::string_view folder,
+    std::string_view path) const = 0;
+
+  /**
+   * List all committed folders. This is needed only by backends which can be
+   * used as the fast tier of the tiered backend (see tiered.hpp), others can
+   * keep this default.
+   */
+  virtual std::vector<stored_folder> list_folders() const
+  {
+    throw std::runtime_error("This storage backend can't list its folders");
+  }
+
+  /**
+   * Remove a committed folder. Like commit, this should act atomically: a
+   * concurrent walk_folder sees either the whole folder, or nothing. Removing
+   * a folder that doesn't exist is not an error.
+   *
+   * Same as list_folders, this can keep the default if the backend isn't used
+   * as a fast tier.
+   */
+  virtual void remove_folder(std::string_view)
+  {
+    throw std::runtime_error("This storage backend can't remove folders");
+  }
+
+  /**
+   * Write backend-specific counters as a JSON object, which is included in
+   * the /api/metrics response.
+   */
+  virtual void write_metrics_json(std::ostream& stream) const
+  {
+    stream << "{}";
+  }
+
+  /**
+   * Whether several server processes may use the stored data at once (see
+   * claim_dir in config.hpp). Backends which keep state about the stored data
+   * in the memory of the process must return false.
+   */
+  virtual bool supports_multiple_processes() const { return true; }
+
   /**
    * Create a new temporary folder in the backend. See documentation of the staged_folder
    * class for more information.
@@ -126,8 +250,29 @@ public:
    * 
    * This will be called with an object returned by create_staged_folder, so you
    * can dynamic_cast it to your subclass, and throw an exception if the cast fails.
+   *
+   * Returns false if the folder was already stored (e.g. by another server
+   * process sharing the storage), and the staged copy was dropped instead. The
+   * stored folder may then differ from the staged one, so the caller must
+   * read it again.
+   */
+  virtual bool commit_staged_folder(staged_folder& folder) = 0;
+
+  /**
+   * Add the files of a staged folder to the committed folder of the same
+   * name, e.g. variants created after the sizes or formats in the config
+   * changed (see backfill.hpp). The staged folder contains only the new files,
+   * and may create folders which already exist. Like commit, this should act
+   * atomically: a concurrent walk_folder sees either the old folder, or the
+   * extended one.
+   *
+   * Backends which can't do this can keep the default, their folders are then
+   * not backfilled.
    */
-  virtual void commit_staged_folder(staged_folder& folder) = 0;
+  virtual void extend_folder(staged_folder&)
+  {
+    throw std::runtime_error("This storage backend can't extend folders");
+  }
 };
 
 #endif // STORAGE_INTERFACE_HPP
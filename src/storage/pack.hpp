@@ -0,0 +1,830 @@
+#ifndef STORAGE_PACK_HPP
+#define STORAGE_PACK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+#include "../utils.hpp"
+#include "interface.hpp"
+#include "record_log.hpp"
+
+/**
+ * Implementation of the pack storage backend, which stores many small files
+ * in a few large files, to save inodes and syscalls.
+ *
+ * The data_dir contains:
+ * - segments/<id>.pack: append-only segment files with the contents of the
+ *   stored files, one after another. A new segment is started when the current
+ *   one grows over segment_size.
+ * - index.log: append-only log of records, each listing the entries of one
+ *   folder, as (path, segment, offset, length). The last record of a folder
+ *   wins. Every record is checksummed, so a record torn by a crash is detected
+ *   and discarded on the next start.
+ * - layout: the storage_layout of the data.
+ *
+ * Staged files are appended to the current segment right away. Committing a
+ * folder appends its record to the index, so a folder becomes visible
+ * atomically. Data of uncommitted or replaced folders remains in the segments
+ * as garbage, which is reclaimed by a background compaction: segments with
+ * little live data have their live entries copied to the current segment, and
+ * are deleted.
+ *
+ * The index and the current segment are kept by the process, so a data_dir can
+ * be used by only one process at a time.
+ *
+ * See interface.hpp for description of the methods.
+ */
+
+class storage_pack;
+
+/** An open segment file, to which data is being appended */
+class pack_segment_writer
+{
+public:
+  std::uint32_t id;
+  int fd;
+  /** Bytes reserved in the file so far. Guarded by storage_pack::write_mutex */
+  std::uint64_t size = 0;
+
+  pack_segment_writer(std::uint32_t id, int fd)
+    : id(id)
+    , fd(fd)
+  {
+  }
+
+  pack_segment_writer(pack_segment_writer const&) = delete;
+  pack_segment_writer& operator=(pack_segment_writer const&) = delete;
+
+  ~pack_segment_writer() { ::close(fd); }
+
+  void write_at(std::uint64_t offset, std::uint8_t const* data, size_t size)
+  {
+    while (size > 0) {
+      auto written = ::pwrite(fd, data, size, offset);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error("Failed to write to segment " +
+                                 std::to_string(id) + ": " +
+                                 std::strerror(errno));
+      }
+      data += written;
+      offset += written;
+      size -= written;
+    }
+  }
+
+  void sync()
+  {
+    if (::fdatasync(fd) != 0)
+      throw std::runtime_error("Failed to sync segment " + std::to_string(id) +
+                               ": " + std::strerror(errno));
+  }
+};
+
+/** Read-only memory mapping of a whole segment file */
+class pack_mapping
+{
+public:
+  void* address = MAP_FAILED;
+  std::uint64_t size = 0;
+
+  explicit pack_mapping(std::filesystem::path const& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open segment " + path.string() +
+                               ": " + std::strerror(errno));
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to stat segment " + path.string());
+    }
+    size = st.st_size;
+    if (size > 0)
+      address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after closing the descriptor, and even after
+    // the file is deleted by compaction
+    ::close(fd);
+    if (size > 0 && address == MAP_FAILED)
+      throw std::runtime_error("Failed to map segment " + path.string());
+  }
+
+  pack_mapping(pack_mapping const&) = delete;
+  pack_mapping& operator=(pack_mapping const&) = delete;
+
+  ~pack_mapping()
+  {
+    if (address != MAP_FAILED)
+      ::munmap(address, size);
+  }
+
+  std::uint8_t const* data() const
+  {
+    return static_cast<std::uint8_t const*>(address);
+  }
+};
+
+struct pack_entry
+{
+  /** Path relative to the folder, '/'-separated */
+  std::string path;
+  bool is_folder = false;
+  std::uint32_t segment = 0;
+  std::uint64_t offset = 0;
+  std::uint64_t length = 0;
+
+  bool operator==(pack_entry const&) const = default;
+};
+
+class pack_staged_folder : public staged_folder
+{
+  friend class storage_pack;
+
+public:
+  // nothing to clean up: the data of an uncommitted folder is left in the
+  // segments, and reclaimed by compaction
+  ~pack_staged_folder() override = default;
+
+private:
+  storage_pack* storage;
+  std::string final_name;
+
+  std::mutex mutex;
+  std::vector<pack_entry> entries;
+  /** Keeps the segments we wrote to open (and safe from compaction) */
+  std::set<std::shared_ptr<pack_segment_writer>> segments;
+
+  void create_file(std::string_view name,
+                   std::uint8_t const* data,
+                   size_t size) override;
+
+  void create_folder(std::string_view name) override
+  {
+    std::lock_guard lock(mutex);
+    entries.push_back({ std::string(name), true });
+  }
+};
+
+class storage_pack : public storage_backend
+{
+  friend class pack_staged_folder;
+
+private:
+  std::string data_dir;
+  std::uint64_t segment_size = 256 * 1024 * 1024;
+  unsigned compaction_interval_secs = 600;
+  /** Segments with less live data than this percentage get compacted */
+  unsigned compaction_threshold_pct = 50;
+  bool fsync = true;
+
+  static constexpr std::uint32_t RECORD_MAGIC = 0x58495041; // "APIX"
+  static constexpr std::uint8_t OP_PUT = 0;
+  static constexpr std::uint8_t OP_REMOVE = 1;
+
+  struct segment_stats
+  {
+    std::uint64_t size = 0;
+    std::uint64_t live = 0;
+  };
+
+  /** Guards current_segment, open_segments and the segment sizes */
+  std::mutex write_mutex;
+  std::shared_ptr<pack_segment_writer> current_segment;
+  std::map<std::uint32_t, std::weak_ptr<pack_segment_writer>> open_segments;
+
+  /** Guards folders, segments, and the index file */
+  mutable std::shared_mutex index_mutex;
+  std::unordered_map<std::string, std::vector<pack_entry>> folders;
+  std::map<std::uint32_t, segment_stats> segments;
+  int index_fd = -1;
+  std::uint64_t index_size = 0;
+  /** Size of the index with a single record per folder */
+  std::uint64_t live_index_size = 0;
+
+  mutable std::mutex mappings_mutex;
+  mutable std::unordered_map<std::uint32_t, std::shared_ptr<pack_mapping>>
+    mappings;
+
+  std::thread compaction_thread;
+  std::mutex compaction_mutex;
+  std::condition_variable compaction_cv;
+  bool stop_compaction = false;
+
+  std::filesystem::path segment_path(std::uint32_t id) const
+  {
+    return std::filesystem::path(data_dir) / "segments" /
+           (std::to_string(id) + ".pack");
+  }
+
+  std::filesystem::path index_path() const
+  {
+    return std::filesystem::path(data_dir) / "index.log";
+  }
+
+  static std::string encode_record(std::string_view name,
+                                   std::uint8_t op,
+                                   std::vector<pack_entry> const& entries)
+  {
+    std::string payload;
+    record_put_string(payload, name);
+    payload.push_back(op);
+    record_put_u32(payload, entries.size());
+    for (auto const& entry : entries) {
+      record_put_string(payload, entry.path);
+      payload.push_back(entry.is_folder);
+      record_put_u32(payload, entry.segment);
+      record_put_u64(payload, entry.offset);
+      record_put_u64(payload, entry.length);
+    }
+    return frame_record(RECORD_MAGIC, payload);
+  }
+
+  /** encode_record(name, OP_PUT, entries).size(), without encoding it */
+  static std::uint64_t record_size(std::string_view name,
+                                   std::vector<pack_entry> const& entries)
+  {
+    std::uint64_t size = RECORD_HEADER_SIZE + 2 + name.size() + 1 + 4;
+    for (auto const& entry : entries)
+      size += 2 + entry.path.size() + 1 + 4 + 8 + 8;
+    return size;
+  }
+
+  /**
+   * Update the in-memory index with a record. Caller must hold index_mutex
+   * exclusively (or be the only thread, during init)
+   */
+  void apply_record(std::string const& name,
+                    std::uint8_t op,
+                    std::vector<pack_entry>&& entries)
+  {
+    auto it = folders.find(name);
+    if (it != folders.end()) {
+      for (auto const& entry : it->second) {
+        if (!entry.is_folder)
+          segments[entry.segment].live -= entry.length;
+      }
+      live_index_size -= record_size(it->first, it->second);
+      folders.erase(it);
+    }
+
+    if (op == OP_REMOVE)
+      return;
+
+    for (auto const& entry : entries) {
+      if (!entry.is_folder)
+        segments[entry.segment].live += entry.length;
+    }
+    live_index_size += record_size(name, entries);
+    folders.emplace(name, std::move(entries));
+  }
+
+  /** Append a record to the index file. Caller must hold index_mutex */
+  void write_record(std::string const& record)
+  {
+    std::size_t written = 0;
+    while (written < record.size()) {
+      auto result =
+        ::write(index_fd, record.data() + written, record.size() - written);
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        // don't leave a partial record behind
+        (void)::ftruncate(index_fd, index_size);
+        throw std::runtime_error("Failed to write pack index: " +
+                                 std::string(std::strerror(errno)));
+      }
+      written += result;
+    }
+    if (fsync && ::fdatasync(index_fd) != 0)
+      throw std::runtime_error("Failed to sync pack index");
+    index_size += record.size();
+  }
+
+  /**
+   * Load all valid records of the index. A damaged tail (from a crash during
+   * writing) is cut off.
+   */
+  void load_index()
+  {
+    std::ifstream file(index_path(), std::ios::binary);
+    std::string contents(std::istreambuf_iterator<char>(file), {});
+
+    auto parse_record = [&](std::string_view payload, std::size_t) {
+      record_reader reader{ payload };
+      auto name = reader.get_string();
+      auto op = reader.get<std::uint8_t>();
+      auto count = reader.get<std::uint32_t>();
+      std::vector<pack_entry> entries;
+      for (std::uint32_t i = 0; i < count; i++) {
+        pack_entry entry;
+        entry.path = reader.get_string();
+        entry.is_folder = reader.get<std::uint8_t>();
+        entry.segment = reader.get<std::uint32_t>();
+        entry.offset = reader.get<std::uint64_t>();
+        entry.length = reader.get<std::uint64_t>();
+        entries.push_back(std::move(entry));
+      }
+      apply_record(name, op, std::move(entries));
+    };
+    auto pos =
+      parse_records(contents, RECORD_MAGIC, "pack index", parse_record);
+    if (pos < contents.size())
+      log_warning("Discarding the damaged end of the pack index");
+
+    index_fd =
+      ::open(index_path().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd < 0)
+      throw std::runtime_error("Failed to open pack index: " +
+                               std::string(std::strerror(errno)));
+    if (::ftruncate(index_fd, pos) != 0 ||
+        ::lseek(index_fd, pos, SEEK_SET) < 0)
+      throw std::runtime_error("Failed to truncate pack index");
+    index_size = pos;
+  }
+
+  /** Caller must hold write_mutex */
+  void start_new_segment()
+  {
+    std::unique_lock index_lock(index_mutex);
+    std::uint32_t id = segments.empty() ? 0 : segments.rbegin()->first + 1;
+    if (current_segment)
+      id = std::max(id, current_segment->id + 1);
+
+    int fd = ::open(segment_path(id).c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create segment " +
+                               segment_path(id).string() + ": " +
+                               std::strerror(errno));
+    // the index records about to reference the segment must not survive a
+    // crash that loses its directory entry
+    if (fsync) {
+      try {
+        sync_directory(std::filesystem::path(data_dir) / "segments");
+      } catch (...) {
+        ::close(fd);
+        std::error_code ec;
+        std::filesystem::remove(segment_path(id), ec);
+        throw;
+      }
+    }
+
+    current_segment = std::make_shared<pack_segment_writer>(id, fd);
+    open_segments[id] = current_segment;
+    segments[id];
+  }
+
+  /**
+   * Reserve space for `size` bytes in the current segment, and return the
+   * segment with the reserved offset. The caller writes the data itself,
+   * without holding any lock.
+   */
+  std::pair<std::shared_ptr<pack_segment_writer>, std::uint64_t> reserve(
+    std::uint64_t size)
+  {
+    std::lock_guard lock(write_mutex);
+    if (current_segment->size > 0 &&
+        current_segment->size + size > segment_size)
+      start_new_segment();
+
+    auto offset = current_segment->size;
+    current_segment->size += size;
+    {
+      std::unique_lock index_lock(index_mutex);
+      segments[current_segment->id].size = current_segment->size;
+    }
+    return { current_segment, offset };
+  }
+
+  std::shared_ptr<pack_mapping> get_mapping(std::uint32_t segment,
+                                            std::uint64_t needed_size) const
+  {
+    std::lock_guard lock(mappings_mutex);
+    auto& mapping = mappings[segment];
+    // the current segment grows, so an older mapping may be too short
+    if (!mapping || mapping->size < needed_size)
+      mapping = std::make_shared<pack_mapping>(segment_path(segment));
+    if (mapping->size < needed_size)
+      throw std::runtime_error("Segment " + std::to_string(segment) +
+                               " is shorter than its index says");
+    return mapping;
+  }
+
+  /**
+   * Copy live entries out of a segment into the current one, and delete the
+   * segment when nothing references it anymore.
+   */
+  void compact_segment(std::uint32_t segment)
+  {
+    std::vector<std::pair<std::string, std::vector<pack_entry>>> affected;
+    {
+      std::shared_lock lock(index_mutex);
+      for (auto const& [name, entries] : folders) {
+        for (auto const& entry : entries) {
+          if (!entry.is_folder && entry.segment == segment) {
+            affected.emplace_back(name, entries);
+            break;
+          }
+        }
+      }
+    }
+
+    for (auto& [name, old_entries] : affected) {
+      std::vector<pack_entry> new_entries = old_entries;
+      std::set<std::shared_ptr<pack_segment_writer>> written;
+      for (auto& entry : new_entries) {
+        if (entry.is_folder || entry.segment != segment)
+          continue;
+        auto mapping = get_mapping(segment, entry.offset + entry.length);
+        auto [writer, offset] = reserve(entry.length);
+        writer->write_at(
+          offset, mapping->data() + entry.offset, entry.length);
+        written.insert(writer);
+        entry.segment = writer->id;
+        entry.offset = offset;
+      }
+      if (fsync) {
+        for (auto const& writer : written)
+          writer->sync();
+      }
+
+      std::unique_lock lock(index_mutex);
+      auto it = folders.find(name);
+      // the folder was replaced or removed in the meantime, the copied data
+      // is garbage now
+      if (it == folders.end() || it->second != old_entries)
+        continue;
+      write_record(encode_record(name, OP_PUT, new_entries));
+      apply_record(name, OP_PUT, std::move(new_entries));
+    }
+
+    {
+      std::unique_lock lock(index_mutex);
+      if (segments[segment].live != 0)
+        return;
+      segments.erase(segment);
+    }
+    {
+      std::lock_guard lock(mappings_mutex);
+      mappings.erase(segment);
+    }
+    std::filesystem::remove(segment_path(segment));
+  }
+
+  /**
+   * Rewrite the index with a single record per folder, if the superseded
+   * records take most of its space.
+   *
+   * The records are encoded under a shared lock, so lookups go on meanwhile.
+   * Records written in the meantime are copied from the end of the old index
+   * before the new one replaces it.
+   */
+  void compact_index()
+  {
+    std::string contents;
+    std::uint64_t encoded_size;
+    {
+      std::shared_lock lock(index_mutex);
+      if (index_size < 1024 * 1024 || index_size < 2 * live_index_size)
+        return;
+      for (auto const& [name, entries] : folders)
+        contents += encode_record(name, OP_PUT, entries);
+      encoded_size = index_size;
+    }
+
+    auto tmp_path = index_path();
+    tmp_path += ".tmp";
+    std::unique_lock lock(index_mutex);
+    {
+      std::ifstream old(index_path(), std::ios::binary);
+      old.seekg(encoded_size);
+      contents.append(std::istreambuf_iterator<char>(old), {});
+      std::ofstream tmp(tmp_path, std::ios::binary | std::ios::trunc);
+      tmp.write(contents.data(), contents.size());
+      if (!tmp)
+        throw std::runtime_error("Failed to write " + tmp_path.string());
+    }
+    int tmp_fd = ::open(tmp_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (tmp_fd < 0)
+      throw std::runtime_error("Failed to reopen " + tmp_path.string());
+    if (fsync && ::fdatasync(tmp_fd) != 0) {
+      ::close(tmp_fd);
+      throw std::runtime_error("Failed to sync " + tmp_path.string());
+    }
+    std::filesystem::rename(tmp_path, index_path());
+    ::close(index_fd);
+    index_fd = tmp_fd;
+    index_size = contents.size();
+    if (fsync)
+      sync_directory(data_dir);
+  }
+
+  void run_compaction()
+  {
+    std::vector<std::uint32_t> candidates;
+    {
+      std::lock_guard write_lock(write_mutex);
+      std::shared_lock lock(index_mutex);
+      for (auto const& [id, stats] : segments) {
+        // segments still referenced by a staged folder may get more live
+        // data when the folder is committed
+        auto open = open_segments.find(id);
+        if (open != open_segments.end() && !open->second.expired())
+          continue;
+        if (stats.live * 100 < stats.size * compaction_threshold_pct ||
+            stats.live == 0)
+          candidates.push_back(id);
+      }
+      std::erase_if(open_segments,
+                    [](auto const& item) { return item.second.expired(); });
+    }
+
+    for (auto id : candidates) {
+      try {
+        compact_segment(id);
+      } catch (std::exception const& e) {
+        log_error("Error compacting segment ", id, ": ", e.what());
+      }
+    }
+
+    try {
+      compact_index();
+    } catch (std::exception const& e) {
+      log_error("Error compacting pack index: ", e.what());
+    }
+  }
+
+  void check_layout(storage_layout const& layout)
+  {
+    auto path = std::filesystem::path(data_dir) / "layout";
+    if (std::filesystem::exists(path)) {
+      std::ifstream file(path);
+      std::string line;
+      std::getline(file, line);
+      if (line != "hash_algorithm=" + layout.hash_algorithm)
+        throw std::runtime_error("data_dir " + data_dir +
+                                 " contains data stored with " + line +
+                                 ", but the server is configured with "
+                                 "hash_algorithm=" +
+                                 layout.hash_algorithm);
+    } else {
+      std::ofstream file(path);
+      file << "hash_algorithm=" << layout.hash_algorithm << "\n";
+    }
+  }
+
+public:
+  ~storage_pack() override
+  {
+    if (compaction_thread.joinable()) {
+      {
+        std::lock_guard lock(compaction_mutex);
+        stop_compaction = true;
+      }
+      compaction_cv.notify_all();
+      compaction_thread.join();
+    }
+    if (index_fd >= 0)
+      ::close(index_fd);
+  }
+
+  void set_config(std::string_view key, std::string_view value) override
+  {
+    if (key == "data_dir")
+      data_dir = value;
+    else if (key == "segment_size")
+      segment_size = parse_bytes(value);
+    else if (key == "compaction_interval_secs")
+      compaction_interval_secs = string_view_to_int(value);
+    else if (key == "compaction_threshold_pct")
+      compaction_threshold_pct = string_view_to_int(value);
+    else if (key == "fsync")
+      fsync = parse_bool(value);
+    else
+      throw std::runtime_error("Unknown storage config key: " +
+                               std::string(key));
+  }
+
+  /** The index is kept by the process, see the class comment */
+  bool supports_multiple_processes() const override { return false; }
+
+  void validate() const override
+  {
+    if (data_dir.empty())
+      throw std::runtime_error("data_dir not specified");
+    if (segment_size == 0)
+      throw std::runtime_error("segment_size must be greater than 0");
+    if (compaction_threshold_pct > 100)
+      throw std::runtime_error("compaction_threshold_pct must be at most 100");
+  }
+
+  void init(storage_layout const& layout) override
+  {
+    std::filesystem::create_directories(std::filesystem::path(data_dir) /
+                                        "segments");
+    check_layout(layout);
+
+    for (auto const& entry : std::filesystem::directory_iterator(
+           std::filesystem::path(data_dir) / "segments")) {
+      if (entry.path().extension() != ".pack")
+        continue;
+      auto id = string_view_to_int(entry.path().stem().string());
+      segments[id].size = entry.file_size();
+    }
+    load_index();
+
+    // never append to segments of previous runs, their tail may be damaged
+    {
+      std::lock_guard lock(write_mutex);
+      start_new_segment();
+    }
+
+    if (compaction_interval_secs > 0) {
+      compaction_thread = std::thread([this] {
+        std::unique_lock lock(compaction_mutex);
+        while (!compaction_cv.wait_for(
+          lock, std::chrono::seconds(compaction_interval_secs), [this] {
+            return stop_compaction;
+          })) {
+          lock.unlock();
+          run_compaction();
+          lock.lock();
+        }
+      });
+    }
+  }
+
+  /**
+   * Run one pass of the compaction right away. It normally runs in the
+   * background every compaction_interval_secs.
+   */
+  void compact() { run_compaction(); }
+
+  std::optional<std::vector<folder_entry>> walk_folder(
+    std::string_view path) const override
+  {
+    std::shared_lock lock(index_mutex);
+    auto it = folders.find(std::string(path));
+    if (it == folders.end())
+      return std::nullopt;
+
+    std::vector<folder_entry> result;
+    for (auto const& entry : it->second)
+      insert_folder_entry(result, entry.path, entry.is_folder);
+    return result;
+  }
+
+  std::optional<std::vector<std::uint8_t>> read_file(
+    std::string_view folder,
+    std::string_view path) const override
+  {
+    // compaction can move the entry and delete its segment between the
+    // lookup and the read, in which case the lookup is simply repeated
+    for (int attempt = 0;; attempt++) {
+      pack_entry location;
+      {
+        std::shared_lock lock(index_mutex);
+        auto it = folders.find(std::string(folder));
+        if (it == folders.end())
+          return std::nullopt;
+        auto entry =
+          std::find_if(it->second.begin(), it->second.end(), [&](auto& e) {
+            return !e.is_folder && e.path == path;
+          });
+        if (entry == it->second.end())
+          return std::nullopt;
+        location = *entry;
+      }
+
+      try {
+        auto mapping =
+          get_mapping(location.segment, location.offset + location.length);
+        auto begin = mapping->data() + location.offset;
+        return std::vector<std::uint8_t>(begin, begin + location.length);
+      } catch (std::runtime_error const&) {
+        if (attempt > 0)
+          throw;
+      }
+    }
+  }
+
+  std::vector<stored_folder> list_folders() const override
+  {
+    std::shared_lock lock(index_mutex);
+    std::vector<stored_folder> result;
+    for (auto const& [name, entries] : folders) {
+      std::uint64_t size = 0;
+      for (auto const& entry : entries)
+        size += entry.length;
+      result.push_back({ name, size });
+    }
+    return result;
+  }
+
+  void remove_folder(std::string_view name) override
+  {
+    // the data is left in the segments, and reclaimed by compaction
+    auto record = encode_record(name, OP_REMOVE, {});
+    std::unique_lock lock(index_mutex);
+    if (!folders.contains(std::string(name)))
+      return;
+    write_record(record);
+    apply_record(std::string(name), OP_REMOVE, {});
+  }
+
+  std::unique_ptr<staged_folder> create_staged_folder(
+    std::string_view folder) override
+  {
+    auto result = std::make_unique<pack_staged_folder>();
+    result->storage = this;
+    result->final_name = folder;
+    return result;
+  }
+
+  /** A data_dir has a single process, so the folder is always committed */
+  bool commit_staged_folder(staged_folder& folder) override
+  {
+    auto& pack_folder = dynamic_cast<pack_staged_folder&>(folder);
+    std::lock_guard folder_lock(pack_folder.mutex);
+
+    // the data must be on disk before the index points to it
+    if (fsync) {
+      for (auto const& segment : pack_folder.segments)
+        segment->sync();
+    }
+
+    auto record =
+      encode_record(pack_folder.final_name, OP_PUT, pack_folder.entries);
+    std::unique_lock lock(index_mutex);
+    write_record(record);
+    apply_record(
+      pack_folder.final_name, OP_PUT, std::move(pack_folder.entries));
+    return true;
+  }
+
+  /** The folder is written again with the old entries and the new ones */
+  void extend_folder(staged_folder& folder) override
+  {
+    auto& pack_folder = dynamic_cast<pack_staged_folder&>(folder);
+    std::lock_guard folder_lock(pack_folder.mutex);
+
+    if (fsync) {
+      for (auto const& segment : pack_folder.segments)
+        segment->sync();
+    }
+
+    std::unique_lock lock(index_mutex);
+    auto it = folders.find(pack_folder.final_name);
+    if (it == folders.end())
+      throw std::runtime_error("Can't extend missing folder " +
+                               pack_folder.final_name);
+    auto entries = it->second;
+    for (auto& entry : pack_folder.entries) {
+      bool exists = std::any_of(entries.begin(), entries.end(), [&](auto& e) {
+        return e.path == entry.path;
+      });
+      if (!exists)
+        entries.push_back(std::move(entry));
+    }
+    write_record(encode_record(pack_folder.final_name, OP_PUT, entries));
+    apply_record(pack_folder.final_name, OP_PUT, std::move(entries));
+  }
+};
+
+void
+pack_staged_folder::create_file(std::string_view name,
+                                std::uint8_t const* data,
+                                size_t size)
+{
+  auto [segment, offset] = storage->reserve(size);
+  segment->write_at(offset, data, size);
+
+  std::lock_guard lock(mutex);
+  segments.insert(segment);
+  entries.push_back(
+    { std::string(name), false, segment->id, offset, std::uint64_t(size) });
+}
+
+#endif // STORAGE_PACK_HPP
@@ -0,0 +1,158 @@
+#ifndef STORAGE_RECORD_LOG_HPP
+#define STORAGE_RECORD_LOG_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <boost/crc.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../logger.hpp"
+
+/**
+ * Helpers for append-only logs of checksummed binary records, used for the
+ * indexes of the storage backends.
+ *
+ * Every record is framed as (magic, payload length, CRC32 of the payload),
+ * followed by the payload. Numbers are stored in native byte order, the logs
+ * are not meant to be moved between machines.
+ */
+
+static constexpr std::size_t RECORD_HEADER_SIZE = 12;
+
+/**
+ * Make a rename or creation of a file in the directory durable, which syncing
+ * the file itself doesn't do
+ */
+void
+sync_directory(std::filesystem::path const& dir)
+{
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open " + dir.string() + ": " +
+                             std::strerror(errno));
+  int result = ::fsync(fd);
+  ::close(fd);
+  if (result != 0)
+    throw std::runtime_error("Failed to sync " + dir.string());
+}
+
+void
+record_put_u16(std::string& buf, std::uint16_t value)
+{
+  buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void
+record_put_u32(std::string& buf, std::uint32_t value)
+{
+  buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void
+record_put_u64(std::string& buf, std::uint64_t value)
+{
+  buf.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void
+record_put_string(std::string& buf, std::string_view value)
+{
+  if (value.size() > UINT16_MAX)
+    throw std::runtime_error("Name too long for a record");
+  record_put_u16(buf, value.size());
+  buf.append(value);
+}
+
+/** Bounds-checked reading of a record */
+struct record_reader
+{
+  std::string_view data;
+
+  template<typename T>
+  T get()
+  {
+    if (data.size() < sizeof(T))
+      throw std::runtime_error("Truncated record");
+    T value;
+    std::memcpy(&value, data.data(), sizeof(T));
+    data.remove_prefix(sizeof(T));
+    return value;
+  }
+
+  std::string get_string()
+  {
+    auto length = get<std::uint16_t>();
+    if (data.size() < length)
+      throw std::runtime_error("Truncated record");
+    std::string value(data.substr(0, length));
+    data.remove_prefix(length);
+    return value;
+  }
+};
+
+std::uint32_t
+record_checksum(std::string_view payload)
+{
+  boost::crc_32_type crc;
+  crc.process_bytes(payload.data(), payload.size());
+  return crc.checksum();
+}
+
+/** Prepend the header to a payload */
+std::string
+frame_record(std::uint32_t magic, std::string_view payload)
+{
+  std::string record;
+  record_put_u32(record, magic);
+  record_put_u32(record, payload.size());
+  record_put_u32(record, record_checksum(payload));
+  record.append(payload);
+  return record;
+}
+
+/**
+ * Call fn(payload, offset) for each record in the log, where offset is the
+ * offset of the record header. Stops at the first damaged record, printing a
+ * warning which names the log. Returns the length of the valid part of the
+ * log, which equals contents.size() if the whole log is valid.
+ */
+template<typename Fn>
+std::size_t
+parse_records(std::string_view contents,
+              std::uint32_t magic,
+              std::string_view log_name,
+              Fn const& fn)
+{
+  std::size_t pos = 0;
+  while (pos < contents.size()) {
+    try {
+      record_reader header{ contents.substr(pos) };
+      if (header.get<std::uint32_t>() != magic)
+        throw std::runtime_error("Bad record magic");
+      auto length = header.get<std::uint32_t>();
+      auto expected_checksum = header.get<std::uint32_t>();
+      if (header.data.size() < length)
+        throw std::runtime_error("Truncated record");
+      auto payload = header.data.substr(0, length);
+      if (record_checksum(payload) != expected_checksum)
+        throw std::runtime_error("Checksum mismatch");
+
+      fn(payload, pos);
+      pos += RECORD_HEADER_SIZE + length;
+    } catch (std::runtime_error const& e) {
+      log_warning("Damaged ", log_name, " at offset ", pos, ": ", e.what());
+      break;
+    }
+  }
+  return pos;
+}
+
+#endif // STORAGE_RECORD_LOG_HPP
@@ -0,0 +1,962 @@
+#ifndef STORAGE_S3_HPP
+#define STORAGE_S3_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include "../logger.hpp"
+#include "../utils.hpp"
+#include "interface.hpp"
+
+/**
+ * Implementation of a storage backend for S3-compatible object storage (AWS
+ * S3, MinIO, ...), using path-style requests signed with AWS Signature V4.
+ *
+ * A folder is described by a manifest object <prefix><folder>/.manifest,
+ * which lists its files. Staged files are uploaded right away, from the
+ * worker threads that create them, over a pool of keep-alive connections,
+ * to keys <prefix><folder>/<generation>/<path> under a random generation of
+ * the staged folder. Large files are uploaded as multipart uploads, with the
+ * parts uploaded in parallel. Readers only go through the manifest, which is
+ * written last, so a folder becomes visible all at once, and a failed upload
+ * deletes only the objects of its own generation, never those of another
+ * process committing the same folder.
+ *
+ * See interface.hpp for description of the methods.
+ */
+
+/**
+ * Encode a string as required by AWS Signature V4: everything except
+ * unreserved characters is percent-encoded, '/' optionally kept.
+ */
+std::string
+s3_uri_encode(std::string_view s, bool keep_slash)
+{
+  std::string result;
+  for (unsigned char c : s) {
+    if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        (keep_slash && c == '/')) {
+      result += c;
+    } else {
+      result += '%';
+      result += "0123456789ABCDEF"[c >> 4];
+      result += "0123456789ABCDEF"[c & 0xf];
+    }
+  }
+  return result;
+}
+
+std::string
+sha256_hex(std::string_view data)
+{
+  std::uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<std::uint8_t const*>(data.data()), data.size(), hash);
+  return bytes_to_hex(hash, sizeof(hash));
+}
+
+std::string
+hmac_sha256(std::string_view key, std::string_view data)
+{
+  std::uint8_t result[EVP_MAX_MD_SIZE];
+  unsigned length = 0;
+  HMAC(EVP_sha256(),
+       key.data(),
+       key.size(),
+       reinterpret_cast<std::uint8_t const*>(data.data()),
+       data.size(),
+       result,
+       &length);
+  return std::string(reinterpret_cast<char*>(result), length);
+}
+
+/** Computes the Authorization header of AWS Signature V4 */
+struct sigv4_signer
+{
+  std::string access_key;
+  std::string secret_key;
+  std::string region;
+
+  /**
+   * All headers in `headers` are signed. The names must be lowercase, and
+   * must include host, x-amz-content-sha256 and x-amz-date.
+   */
+  std::string authorization(std::string_view method,
+                            std::string_view canonical_uri,
+                            std::string_view canonical_query,
+                            std::map<std::string, std::string> const& headers,
+                            std::string_view payload_hash,
+                            std::string const& amz_date) const
+  {
+    std::string date = amz_date.substr(0, 8);
+
+    std::string canonical_headers;
+    std::string signed_headers;
+    for (auto const& [name, value] : headers) {
+      canonical_headers += name + ":" + value + "\n";
+      if (!signed_headers.empty())
+        signed_headers += ";";
+      signed_headers += name;
+    }
+
+    std::string canonical_request;
+    canonical_request.append(method).append("\n");
+    canonical_request.append(canonical_uri).append("\n");
+    canonical_request.append(canonical_query).append("\n");
+    canonical_request.append(canonical_headers).append("\n");
+    canonical_request.append(signed_headers).append("\n");
+    canonical_request.append(payload_hash);
+
+    std::string scope = date + "/" + region + "/s3/aws4_request";
+    std::string string_to_sign = "AWS4-HMAC-SHA256\n" + amz_date + "\n" +
+                                 scope + "\n" + sha256_hex(canonical_request);
+
+    auto key = hmac_sha256("AWS4" + secret_key, date);
+    key = hmac_sha256(key, region);
+    key = hmac_sha256(key, "s3");
+    key = hmac_sha256(key, "aws4_request");
+    auto signature = hmac_sha256(key, string_to_sign);
+
+    return "AWS4-HMAC-SHA256 Credential=" + access_key + "/" + scope +
+           ", SignedHeaders=" + signed_headers + ", Signature=" +
+           bytes_to_hex(reinterpret_cast<std::uint8_t const*>(signature.data()),
+                        signature.size());
+  }
+};
+
+/**
+ * Return contents of all elements <tag>...</tag> in the XML. S3 responses are
+ * simple enough that this is all the parsing needed.
+ */
+std::vector<std::string>
+xml_elements(std::string_view xml, std::string_view tag)
+{
+  std::string open = "<" + std::string(tag) + ">";
+  std::string close = "</" + std::string(tag) + ">";
+  std::vector<std::string> result;
+  std::size_t pos = 0;
+  while ((pos = xml.find(open, pos)) != std::string_view::npos) {
+    pos += open.size();
+    auto end = xml.find(close, pos);
+    if (end == std::string_view::npos)
+      break;
+
+    std::string value(xml.substr(pos, end - pos));
+    // only the entities that can appear in our keys and tokens
+    for (auto [entity, c] : { std::pair{ "&quot;", '"' },
+                              std::pair{ "&lt;", '<' },
+                              std::pair{ "&gt;", '>' },
+                              std::pair{ "&amp;", '&' } }) {
+      std::size_t at;
+      while ((at = value.find(entity)) != std::string::npos)
+        value.replace(at, std::strlen(entity), 1, c);
+    }
+    result.push_back(std::move(value));
+    pos = end + close.size();
+  }
+  return result;
+}
+
+/**
+ * A line of a folder manifest: a folder, a file stored at
+ * <folder>/<generation>/<path>, or (without a generation) a file stored at
+ * <folder>/<path> by earlier versions
+ */
+struct s3_manifest_entry
+{
+  std::string path;
+  bool is_folder = false;
+  std::string generation;
+
+  bool operator==(s3_manifest_entry const&) const = default;
+};
+
+/**
+ * Lines are "<folder>/" for folders and "<path>" or "<path>\t<generation>"
+ * for files
+ */
+std::vector<s3_manifest_entry>
+parse_s3_manifest(std::string_view manifest)
+{
+  std::vector<s3_manifest_entry> result;
+  while (!manifest.empty()) {
+    auto end = manifest.find('\n');
+    auto line = manifest.substr(0, end);
+    manifest.remove_prefix(end == std::string_view::npos ? manifest.size()
+                                                         : end + 1);
+    if (line.empty())
+      continue;
+
+    s3_manifest_entry entry;
+    auto tab = line.find('\t');
+    if (tab != std::string_view::npos) {
+      entry.generation = line.substr(tab + 1);
+      line = line.substr(0, tab);
+    }
+    if (line.ends_with('/')) {
+      entry.is_folder = true;
+      line.remove_suffix(1);
+    }
+    entry.path = line;
+    result.push_back(std::move(entry));
+  }
+  return result;
+}
+
+std::string
+write_s3_manifest(std::vector<s3_manifest_entry> const& entries)
+{
+  std::string result;
+  for (auto const& entry : entries) {
+    result += entry.path;
+    if (entry.is_folder)
+      result += "/";
+    else if (!entry.generation.empty())
+      result += "\t" + entry.generation;
+    result += "\n";
+  }
+  return result;
+}
+
+/** Thrown for responses other than 2xx */
+class s3_error : public std::runtime_error
+{
+public:
+  unsigned status;
+
+  s3_error(unsigned status, std::string const& message)
+    : std::runtime_error(message)
+    , status(status)
+  {
+  }
+};
+
+/**
+ * A blocking HTTP(S) client for one S3 endpoint, keeping a pool of open
+ * connections. Requests can be made from any thread; each takes a connection
+ * from the pool for its duration.
+ */
+class s3_client
+{
+private:
+  using response_t =
+    boost::beast::http::response<boost::beast::http::string_body>;
+
+  /**
+   * The operations of a connection are asynchronous, run to completion by
+   * its own io_context in the thread making the request, so that they can
+   * time out (the timeouts of tcp_stream apply only to asynchronous
+   * operations)
+   */
+  struct connection
+  {
+    boost::asio::io_context io;
+    std::optional<boost::beast::tcp_stream> plain;
+    std::optional<boost::beast::ssl_stream<boost::beast::tcp_stream>> tls;
+    boost::beast::flat_buffer buffer;
+
+    template<typename Fn>
+    void with_stream(Fn&& fn)
+    {
+      if (tls)
+        fn(*tls);
+      else
+        fn(*plain);
+    }
+
+    /**
+     * Start an operation with `start(handler)`, and wait for it, throwing
+     * if it fails or takes longer than the timeout
+     */
+    template<typename Stream, typename Start>
+    void run(Stream& stream, std::chrono::seconds timeout, Start&& start)
+    {
+      boost::beast::get_lowest_layer(stream).expires_after(timeout);
+      boost::system::error_code result;
+      start([&result](boost::system::error_code ec, auto&&...) {
+        result = ec;
+      });
+      io.restart();
+      io.run();
+      if (result)
+        throw boost::system::system_error(result);
+    }
+  };
+
+  bool use_tls = false;
+  std::string host;
+  std::string port;
+  /** Value of the Host header */
+  std::string host_header;
+  sigv4_signer signer;
+  std::chrono::seconds timeout;
+
+  boost::asio::ssl::context ssl_ctx{ boost::asio::ssl::context::tls_client };
+
+  std::mutex pool_mutex;
+  std::condition_variable pool_cv;
+  std::vector<std::unique_ptr<connection>> idle;
+  unsigned open_connections = 0;
+  unsigned max_connections;
+
+  std::unique_ptr<connection> connect()
+  {
+    auto conn = std::make_unique<connection>();
+    boost::asio::ip::tcp::resolver resolver(conn->io);
+    auto endpoints = resolver.resolve(host, port);
+    if (use_tls) {
+      conn->tls.emplace(conn->io, ssl_ctx);
+      if (!SSL_set_tlsext_host_name(conn->tls->native_handle(), host.c_str()))
+        throw std::runtime_error("Failed to set TLS SNI host name");
+      auto& tcp = boost::beast::get_lowest_layer(*conn->tls);
+      conn->run(tcp, timeout, [&](auto handler) {
+        tcp.async_connect(endpoints, std::move(handler));
+      });
+      conn->run(*conn->tls, timeout, [&](auto handler) {
+        conn->tls->async_handshake(boost::asio::ssl::stream_base::client,
+                                   std::move(handler));
+      });
+    } else {
+      conn->plain.emplace(conn->io);
+      conn->run(*conn->plain, timeout, [&](auto handler) {
+        conn->plain->async_connect(endpoints, std::move(handler));
+      });
+    }
+    return conn;
+  }
+
+  std::unique_ptr<connection> acquire()
+  {
+    std::unique_lock lock(pool_mutex);
+    pool_cv.wait(lock, [&] {
+      return !idle.empty() || open_connections < max_connections;
+    });
+    if (!idle.empty()) {
+      auto conn = std::move(idle.back());
+      idle.pop_back();
+      return conn;
+    }
+    open_connections++;
+    lock.unlock();
+    try {
+      return connect();
+    } catch (...) {
+      release(nullptr);
+      throw;
+    }
+  }
+
+  /** Return a connection to the pool, or nullptr if it was closed */
+  void release(std::unique_ptr<connection> conn)
+  {
+    {
+      std::lock_guard lock(pool_mutex);
+      if (conn)
+        idle.push_back(std::move(conn));
+      else
+        open_connections--;
+    }
+    pool_cv.notify_one();
+  }
+
+  static std::string amz_date_now()
+  {
+    auto now = std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now());
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    char buf[17];
+    std::strftime(buf, sizeof(buf), "%Y%m%dT%H%M%SZ", &tm);
+    return buf;
+  }
+
+public:
+  s3_client(std::string_view endpoint,
+            sigv4_signer signer,
+            unsigned max_connections,
+            std::chrono::seconds timeout)
+    : signer(std::move(signer))
+    , timeout(timeout)
+    , max_connections(max_connections)
+  {
+    std::string_view rest = endpoint;
+    if (rest.starts_with("https://")) {
+      use_tls = true;
+      port = "443";
+      rest.remove_prefix(8);
+    } else if (rest.starts_with("http://")) {
+      port = "80";
+      rest.remove_prefix(7);
+    } else {
+      throw std::runtime_error("endpoint must start with http:// or https://");
+    }
+    if (rest.ends_with("/"))
+      rest.remove_suffix(1);
+
+    host_header = rest;
+    auto colon = rest.find(':');
+    host = rest.substr(0, colon);
+    if (colon != std::string_view::npos)
+      port = rest.substr(colon + 1);
+
+    if (use_tls) {
+      ssl_ctx.set_default_verify_paths();
+      ssl_ctx.set_verify_mode(boost::asio::ssl::verify_peer);
+    }
+  }
+
+  /**
+   * Make a signed request. `path` must be already URI-encoded. Query
+   * parameters are given unencoded. Throws s3_error for non-2xx responses,
+   * unless the status is listed in `allowed_statuses`.
+   *
+   * Connecting, writing the request and reading the response each time out
+   * after the configured timeout. A request which fails on a connection
+   * from the pool is retried once, unless it isn't `idempotent`: such a
+   * request may have been done before the connection failed.
+   */
+  response_t request(boost::beast::http::verb method,
+                     std::string const& path,
+                     std::map<std::string, std::string> const& query,
+                     std::string_view body,
+                     std::vector<unsigned> const& allowed_statuses = {},
+                     bool idempotent = true)
+  {
+    std::string canonical_query;
+    for (auto const& [name, value] : query) {
+      if (!canonical_query.empty())
+        canonical_query += "&";
+      canonical_query +=
+        s3_uri_encode(name, false) + "=" + s3_uri_encode(value, false);
+    }
+
+    auto payload_hash = sha256_hex(body);
+    auto amz_date = amz_date_now();
+    std::map<std::string, std::string> headers{
+      { "host", host_header },
+      { "x-amz-content-sha256", payload_hash },
+      { "x-amz-date", amz_date },
+    };
+
+    boost::beast::http::request<boost::beast::http::string_body> req{
+      method,
+      canonical_query.empty() ? path : path + "?" + canonical_query,
+      11
+    };
+    for (auto const& [name, value] : headers)
+      req.set(name, value);
+    auto method_name = std::string(boost::beast::http::to_string(method));
+    req.set(boost::beast::http::field::authorization,
+            signer.authorization(method_name,
+                                 path,
+                                 canonical_query,
+                                 headers,
+                                 payload_hash,
+                                 amz_date));
+    req.keep_alive(true);
+    req.body() = body;
+    req.prepare_payload();
+
+    response_t res;
+    // a pooled connection may have been closed by the server in the meantime,
+    // so a failed request is retried once on a fresh connection
+    for (int attempt = 0;; attempt++) {
+      auto conn = acquire();
+      try {
+        res = {};
+        conn->with_stream([&](auto& stream) {
+          conn->run(stream, timeout, [&](auto handler) {
+            boost::beast::http::async_write(stream, req, std::move(handler));
+          });
+          // the body of a HEAD response isn't sent, and objects may be
+          // larger than the default limit of the parser
+          boost::beast::http::response_parser<
+            boost::beast::http::string_body>
+            parser;
+          parser.skip(method == boost::beast::http::verb::head);
+          parser.body_limit(boost::none);
+          conn->run(stream, timeout, [&](auto handler) {
+            boost::beast::http::async_read(
+              stream, conn->buffer, parser, std::move(handler));
+          });
+          res = parser.release();
+        });
+        release(res.keep_alive() ? std::move(conn) : nullptr);
+        break;
+      } catch (boost::system::system_error const&) {
+        release(nullptr);
+        if (attempt > 0 || !idempotent)
+          throw;
+      }
+    }
+
+    auto status = res.result_int();
+    bool allowed = std::find(allowed_statuses.begin(),
+                             allowed_statuses.end(),
+                             status) != allowed_statuses.end();
+    if ((status < 200 || status >= 300) && !allowed)
+      throw s3_error(status,
+                     "S3 request " + std::string(to_string(method)) + " " +
+                       path + " failed with status " + std::to_string(status) +
+                       ": " + res.body());
+    return res;
+  }
+};
+
+class storage_s3;
+
+class s3_staged_folder : public staged_folder
+{
+  friend class storage_s3;
+
+public:
+  // remove objects which were uploaded, but never committed
+  ~s3_staged_folder() override;
+
+private:
+  storage_s3* storage;
+  std::string final_name;
+  /** Objects of this folder are stored under this, see storage_s3 */
+  std::string generation = random_hex(8);
+  bool committed = false;
+
+  std::mutex mutex;
+  /** Paths of uploaded files and created folders, relative to the folder */
+  std::vector<std::string> files;
+  std::vector<std::string> folders;
+
+  void create_file(std::string_view name,
+                   std::uint8_t const* data,
+                   size_t size) override;
+
+  void create_folder(std::string_view name) override
+  {
+    std::lock_guard lock(mutex);
+    folders.emplace_back(name);
+  }
+};
+
+class storage_s3 : public storage_backend
+{
+  friend class s3_staged_folder;
+
+private:
+  std::string endpoint;
+  std::string bucket;
+  std::string region = "us-east-1";
+  std::string access_key;
+  std::string secret_key;
+  std::string prefix;
+  unsigned max_connections = 16;
+  unsigned multipart_threshold = 16 * 1024 * 1024;
+  unsigned multipart_part_size = 8 * 1024 * 1024;
+  unsigned timeout_secs = 30;
+
+  std::unique_ptr<s3_client> client;
+
+  static constexpr const char* MANIFEST_NAME = ".manifest";
+
+  std::string object_key(std::string_view folder, std::string_view path) const
+  {
+    return prefix + std::string(folder) + "/" + std::string(path);
+  }
+
+  std::string object_key(std::string_view folder,
+                         s3_manifest_entry const& entry) const
+  {
+    if (entry.generation.empty())
+      return object_key(folder, entry.path);
+    return object_key(folder, entry.generation + "/" + entry.path);
+  }
+
+  std::string object_path(std::string const& key) const
+  {
+    return "/" + bucket + "/" + s3_uri_encode(key, true);
+  }
+
+  /** The manifest of a folder, or nullopt if the folder isn't committed */
+  std::optional<std::vector<s3_manifest_entry>> read_manifest(
+    std::string_view folder) const
+  {
+    auto res = client->request(boost::beast::http::verb::get,
+                               object_path(object_key(folder, MANIFEST_NAME)),
+                               {},
+                               "",
+                               { 404 });
+    if (res.result() == boost::beast::http::status::not_found)
+      return std::nullopt;
+    return parse_s3_manifest(res.body());
+  }
+
+  bool object_exists(std::string const& key, std::uint64_t size) const
+  {
+    auto res = client->request(
+      boost::beast::http::verb::head, object_path(key), {}, "", { 404 });
+    return res.result() != boost::beast::http::status::not_found &&
+           res[boost::beast::http::field::content_length] ==
+             std::to_string(size);
+  }
+
+  void put_object(std::string const& key, std::string_view data)
+  {
+    if (data.size() >= multipart_threshold)
+      put_object_multipart(key, data);
+    else
+      client->request(
+        boost::beast::http::verb::put, object_path(key), {}, data);
+  }
+
+  void put_object_multipart(std::string const& key, std::string_view data)
+  {
+    auto path = object_path(key);
+    auto created = client->request(
+      boost::beast::http::verb::post, path, { { "uploads", "" } }, "");
+    auto upload_ids = xml_elements(created.body(), "UploadId");
+    if (upload_ids.empty())
+      throw std::runtime_error("S3 didn't return UploadId for " + key);
+    auto const& upload_id = upload_ids[0];
+
+    try {
+      std::vector<std::future<std::string>> parts;
+      for (std::size_t offset = 0; offset < data.size();
+           offset += multipart_part_size) {
+        auto part_number = std::to_string(parts.size() + 1);
+        auto part = data.substr(offset, multipart_part_size);
+        // the client limits the number of concurrent requests
+        parts.push_back(std::async(std::launch::async, [=, this] {
+          auto res = client->request(
+            boost::beast::http::verb::put,
+            path,
+            { { "partNumber", part_number }, { "uploadId", upload_id } },
+            part);
+          return std::string(res[boost::beast::http::field::etag]);
+        }));
+      }
+
+      std::string complete = "<CompleteMultipartUpload>";
+      for (std::size_t i = 0; i < parts.size(); i++) {
+        complete += "<Part><PartNumber>" + std::to_string(i + 1) +
+                    "</PartNumber><ETag>" + parts[i].get() +
+                    "</ETag></Part>";
+      }
+      complete += "</CompleteMultipartUpload>";
+      // not retried, a repeated completion of a completed upload fails.
+      // If the response is lost, the object tells whether it was done. S3
+      // may also report an error in the body of a 200 response
+      try {
+        auto res = client->request(boost::beast::http::verb::post,
+                                   path,
+                                   { { "uploadId", upload_id } },
+                                   complete,
+                                   {},
+                                   false);
+        if (res.body().find("<Error>") != std::string::npos)
+          throw std::runtime_error("S3 failed to complete upload of " + key +
+                                   ": " + res.body());
+      } catch (std::exception const& e) {
+        if (!object_exists(key, data.size()))
+          throw;
+        log_info("Upload of ", key, " completed despite error: ", e.what());
+      }
+    } catch (...) {
+      try {
+        client->request(boost::beast::http::verb::delete_,
+                        path,
+                        { { "uploadId", upload_id } },
+                        "");
+      } catch (std::exception const& e) {
+        log_warning(
+          "Failed to abort multipart upload of ", key, ": ", e.what());
+      }
+      throw;
+    }
+  }
+
+  void delete_object(std::string const& key)
+  {
+    client->request(
+      boost::beast::http::verb::delete_, object_path(key), {}, "", { 404 });
+  }
+
+  /** List all keys with the prefix, returning (key, size) pairs */
+  std::vector<std::pair<std::string, std::uint64_t>> list_objects(
+    std::string const& key_prefix) const
+  {
+    std::vector<std::pair<std::string, std::uint64_t>> result;
+    std::optional<std::string> continuation;
+    // a folder has few objects, so this is almost always a single call
+    do {
+      std::map<std::string, std::string> query{ { "list-type", "2" },
+                                                { "prefix", key_prefix } };
+      if (continuation)
+        query.emplace("continuation-token", *continuation);
+      auto res = client->request(
+        boost::beast::http::verb::get, "/" + bucket, query, "");
+
+      auto keys = xml_elements(res.body(), "Key");
+      auto sizes = xml_elements(res.body(), "Size");
+      if (keys.size() != sizes.size())
+        throw std::runtime_error("Malformed S3 listing response");
+      for (std::size_t i = 0; i < keys.size(); i++)
+        result.emplace_back(keys[i], std::stoull(sizes[i]));
+
+      continuation.reset();
+      auto truncated = xml_elements(res.body(), "IsTruncated");
+      if (!truncated.empty() && truncated[0] == "true") {
+        auto tokens = xml_elements(res.body(), "NextContinuationToken");
+        if (tokens.empty())
+          throw std::runtime_error("S3 listing truncated without a token");
+        continuation = tokens[0];
+      }
+    } while (continuation);
+    return result;
+  }
+
+public:
+  void set_config(std::string_view key, std::string_view value) override
+  {
+    if (key == "endpoint")
+      endpoint = value;
+    else if (key == "bucket")
+      bucket = value;
+    else if (key == "region")
+      region = value;
+    else if (key == "access_key")
+      access_key = value;
+    else if (key == "secret_key")
+      secret_key = value;
+    else if (key == "prefix")
+      prefix = value;
+    else if (key == "max_connections")
+      max_connections = string_view_to_int(value);
+    else if (key == "multipart_threshold")
+      multipart_threshold = parse_bytes(value);
+    else if (key == "multipart_part_size")
+      multipart_part_size = parse_bytes(value);
+    else if (key == "timeout_secs")
+      timeout_secs = string_view_to_int(value);
+    else
+      throw std::runtime_error("Unknown storage config key: " +
+                               std::string(key));
+  }
+
+  void validate() const override
+  {
+    if (endpoint.empty())
+      throw std::runtime_error("endpoint not specified");
+    if (bucket.empty())
+      throw std::runtime_error("bucket not specified");
+    if (access_key.empty() || secret_key.empty())
+      throw std::runtime_error("access_key and secret_key must be specified");
+    if (max_connections == 0)
+      throw std::runtime_error("max_connections must be greater than 0");
+    // S3 requires all parts except the last one to be at least 5 MiB
+    if (multipart_part_size < 5 * 1024 * 1024)
+      throw std::runtime_error("multipart_part_size must be at least 5M");
+    if (timeout_secs == 0)
+      throw std::runtime_error("timeout_secs must be greater than 0");
+  }
+
+  void init(storage_layout const& layout) override
+  {
+    sigv4_signer signer{ access_key, secret_key, region };
+    client = std::make_unique<s3_client>(
+      endpoint, signer, max_connections, std::chrono::seconds(timeout_secs));
+
+    auto key = prefix + "layout";
+    auto res = client->request(
+      boost::beast::http::verb::get, object_path(key), {}, "", { 404 });
+    std::string expected = "hash_algorithm=" + layout.hash_algorithm + "\n";
+    if (res.result() == boost::beast::http::status::not_found)
+      put_object(key, expected);
+    else if (res.body() != expected)
+      throw std::runtime_error("Bucket contains data stored with " +
+                               res.body() +
+                               ", but the server is configured with " +
+                               expected);
+  }
+
+  std::optional<std::vector<folder_entry>> walk_folder(
+    std::string_view path) const override
+  {
+    // without the manifest, the folder is still being uploaded (or its
+    // upload failed)
+    auto manifest = read_manifest(path);
+    if (!manifest)
+      return std::nullopt;
+
+    std::vector<folder_entry> result;
+    for (auto const& entry : *manifest)
+      insert_folder_entry(result, entry.path, entry.is_folder);
+    return result;
+  }
+
+  void remove_folder(std::string_view name) override
+  {
+    // without the manifest the folder is invisible, so that goes first
+    auto folder_prefix = prefix + std::string(name) + "/";
+    delete_object(folder_prefix + MANIFEST_NAME);
+    for (auto const& [key, size] : list_objects(folder_prefix))
+      delete_object(key);
+  }
+
+  std::optional<std::vector<std::uint8_t>> read_file(
+    std::string_view folder,
+    std::string_view path) const override
+  {
+    auto manifest = read_manifest(folder);
+    if (!manifest)
+      return std::nullopt;
+    auto entry =
+      std::find_if(manifest->begin(), manifest->end(), [&](auto const& e) {
+        return !e.is_folder && e.path == path;
+      });
+    if (entry == manifest->end())
+      return std::nullopt;
+
+    auto res = client->request(boost::beast::http::verb::get,
+                               object_path(object_key(folder, *entry)),
+                               {},
+                               "",
+                               { 404 });
+    if (res.result() == boost::beast::http::status::not_found)
+      return std::nullopt;
+    return std::vector<std::uint8_t>(res.body().begin(), res.body().end());
+  }
+
+  std::unique_ptr<staged_folder> create_staged_folder(
+    std::string_view folder) override
+  {
+    auto result = std::make_unique<s3_staged_folder>();
+    result->storage = this;
+    result->final_name = folder;
+    return result;
+  }
+
+  bool commit_staged_folder(staged_folder& folder) override
+  {
+    auto& s3_folder = dynamic_cast<s3_staged_folder&>(folder);
+    std::lock_guard lock(s3_folder.mutex);
+
+    // another process committed the same image meanwhile. Its folder is
+    // kept, and the objects of this one are deleted with it
+    if (read_manifest(s3_folder.final_name)) {
+      log_info("Folder ", s3_folder.final_name, " was committed by another "
+               "process, discarding this copy");
+      return false;
+    }
+
+    std::vector<s3_manifest_entry> entries;
+    for (auto const& name : s3_folder.folders)
+      entries.push_back({ name, true, "" });
+    for (auto const& name : s3_folder.files)
+      entries.push_back({ name, false, s3_folder.generation });
+    put_object(object_key(s3_folder.final_name, MANIFEST_NAME),
+               write_s3_manifest(entries));
+    s3_folder.committed = true;
+    return true;
+  }
+
+  /**
+   * The new objects are in the generation of the staged folder, so they are
+   * invisible until the manifest is rewritten to list them along with the
+   * old ones
+   */
+  void extend_folder(staged_folder& folder) override
+  {
+    auto& s3_folder = dynamic_cast<s3_staged_folder&>(folder);
+    std::lock_guard lock(s3_folder.mutex);
+
+    auto entries = read_manifest(s3_folder.final_name);
+    if (!entries)
+      throw std::runtime_error("Can't extend missing folder " +
+                               s3_folder.final_name);
+    auto add = [&](s3_manifest_entry entry) {
+      auto existing =
+        std::find_if(entries->begin(), entries->end(), [&](auto const& e) {
+          return e.path == entry.path;
+        });
+      if (existing == entries->end())
+        entries->push_back(std::move(entry));
+    };
+    for (auto const& name : s3_folder.folders)
+      add({ name, true, "" });
+    for (auto const& name : s3_folder.files)
+      add({ name, false, s3_folder.generation });
+
+    put_object(object_key(s3_folder.final_name, MANIFEST_NAME),
+               write_s3_manifest(*entries));
+    s3_folder.committed = true;
+  }
+
+  std::vector<stored_folder> list_folders() const override
+  {
+    std::map<std::string, std::uint64_t> sizes;
+    std::set<std::string> committed;
+    for (auto const& [key, size] : list_objects(prefix)) {
+      auto relative = std::string_view(key).substr(prefix.size());
+      auto slash = relative.find('/');
+      if (slash == std::string_view::npos)
+        continue;
+      auto name = std::string(relative.substr(0, slash));
+      sizes[name] += size;
+      if (relative.substr(slash + 1) == MANIFEST_NAME)
+        committed.insert(name);
+    }
+
+    std::vector<stored_folder> result;
+    for (auto const& name : committed)
+      result.push_back({ name, sizes[name] });
+    return result;
+  }
+};
+
+void
+s3_staged_folder::create_file(std::string_view name,
+                              std::uint8_t const* data,
+                              size_t size)
+{
+  std::string_view contents(reinterpret_cast<char const*>(data), size);
+  storage->put_object(
+    storage->object_key(final_name, generation + "/" + std::string(name)),
+    contents);
+  std::lock_guard lock(mutex);
+  files.emplace_back(name);
+}
+
+s3_staged_folder::~s3_staged_folder()
+{
+  if (committed)
+    return;
+
+  // only objects of this generation, which no manifest refers to
+  for (auto const& name : files) {
+    try {
+      storage->delete_object(
+        storage->object_key(final_name, generation + "/" + name));
+    } catch (std::exception const& e) {
+      log_warning("Failed to delete uncommitted object ", name, ": ", e.what());
+    }
+  }
+}
+
+#endif // STORAGE_S3_HPP
@@ -0,0 +1,531 @@
+#ifndef STORAGE_TIERED_HPP
+#define STORAGE_TIERED_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "../logger.hpp"
+#include "../utils.hpp"
+#include "interface.hpp"
+
+/**
+ * Implementation of a storage backend composed of two other backends: a slow
+ * primary one (e.g. s3), which holds the authoritative copy of everything,
+ * and a fast one (e.g. fs on a local SSD), which caches recently used
+ * folders.
+ *
+ * Commits are written through to both tiers. Lookups are answered from the
+ * fast tier when possible, and folders found only in the primary tier are
+ * copied to the fast tier by a background thread, so that the lookup itself
+ * doesn't wait for the copy. The fast tier is kept within a size budget by
+ * evicting the least recently used folders. The usage of the fast tier is
+ * tracked by the process, so it can't be shared by several processes.
+ *
+ * See interface.hpp for description of the methods.
+ */
+
+using storage_factory =
+  std::function<std::unique_ptr<storage_backend>(std::string_view type)>;
+
+class storage_tiered;
+
+class tiered_staged_folder : public staged_folder
+{
+  friend class storage_tiered;
+
+public:
+  // the staged folders of the tiers clean up after themselves
+  ~tiered_staged_folder() override = default;
+
+private:
+  std::string name;
+  std::unique_ptr<staged_folder> primary;
+  /** Not used once the fast tier failed, the folder then isn't cached */
+  std::unique_ptr<staged_folder> fast;
+  std::atomic<bool> fast_failed = false;
+  std::atomic<std::uint64_t> size = 0;
+
+  void create_file(std::string_view name,
+                   std::uint8_t const* data,
+                   size_t size) override
+  {
+    primary->create_file(name, data, size);
+    this->size += size;
+    if (fast_failed)
+      return;
+    try {
+      fast->create_file(name, data, size);
+    } catch (std::exception const& e) {
+      log_warning("Failed to stage ", name, " in the fast tier: ", e.what());
+      fast_failed = true;
+    }
+  }
+
+  void create_folder(std::string_view name) override
+  {
+    primary->create_folder(name);
+    if (fast_failed)
+      return;
+    try {
+      fast->create_folder(name);
+    } catch (std::exception const& e) {
+      log_warning("Failed to stage ", name, " in the fast tier: ", e.what());
+      fast_failed = true;
+    }
+  }
+};
+
+class storage_tiered : public storage_backend
+{
+private:
+  storage_factory factory;
+  std::unique_ptr<storage_backend> primary;
+  std::unique_ptr<storage_backend> fast;
+
+  /** Size budget of the fast tier */
+  std::uint64_t cache_size = 0;
+  /** Limit of the number of folders in the fast tier, 0 means unlimited */
+  std::uint64_t cache_max_folders = 0;
+  /** Copy folders found only in the primary tier to the fast tier */
+  bool fill_on_miss = true;
+
+  struct cached_folder
+  {
+    std::list<std::string>::iterator lru_position;
+    std::uint64_t size;
+  };
+
+  /**
+   * Guards the LRU list, the cached map, cached_bytes and extensions. Lookups
+   * are const, but still update the recency, hence mutable.
+   */
+  mutable std::mutex cache_mutex;
+  /** Folders in the fast tier, most recently used first */
+  mutable std::list<std::string> lru;
+  mutable std::unordered_map<std::string, cached_folder> cached;
+  mutable std::uint64_t cached_bytes = 0;
+
+  /** Folders found only in the primary tier, waiting to be copied */
+  static constexpr std::size_t MAX_PENDING_FILLS = 64;
+  mutable std::mutex fill_mutex;
+  mutable std::condition_variable fill_cv;
+  struct pending_fill
+  {
+    std::string name;
+    std::vector<folder_entry> entries;
+    /** Value of extensions when the folder was read */
+    std::uint64_t extensions;
+  };
+  mutable std::deque<pending_fill> fill_queue;
+  mutable std::unordered_set<std::string> fill_pending;
+  /** Number of fills queued or being copied */
+  mutable std::size_t fills_in_progress = 0;
+  bool stop_fills = false;
+  std::thread fill_thread;
+  /**
+   * Counts extend_folder calls. A copy of a folder read before an extension
+   * may lack the new files, so it is dropped instead of cached.
+   */
+  mutable std::uint64_t extensions = 0;
+
+  mutable std::atomic<std::uint64_t> hits = 0;
+  mutable std::atomic<std::uint64_t> misses = 0;
+  mutable std::atomic<std::uint64_t> evictions = 0;
+
+  /** Return whether the folder is in the fast tier, and mark it as used */
+  bool touch(std::string_view name) const
+  {
+    std::lock_guard lock(cache_mutex);
+    auto it = cached.find(std::string(name));
+    if (it == cached.end())
+      return false;
+    lru.splice(lru.begin(), lru, it->second.lru_position);
+    return true;
+  }
+
+  std::uint64_t get_extensions() const
+  {
+    std::lock_guard lock(cache_mutex);
+    return extensions;
+  }
+
+  /**
+   * Record a folder which was just added to the fast tier, and evict the
+   * least recently used folders if the budget is exceeded. The new folder is
+   * never evicted, even if it alone exceeds the budget.
+   *
+   * For a copy read from the primary tier when get_extensions() returned
+   * read_at, returns false without recording it if a folder was extended
+   * since; the caller must then remove the copy.
+   */
+  bool add_cached(std::string const& name,
+                  std::uint64_t size,
+                  std::optional<std::uint64_t> read_at = std::nullopt) const
+  {
+    std::vector<std::string> victims;
+    {
+      std::lock_guard lock(cache_mutex);
+      if (read_at && *read_at != extensions)
+        return false;
+      auto it = cached.find(name);
+      if (it != cached.end()) {
+        cached_bytes -= it->second.size;
+        lru.erase(it->second.lru_position);
+        cached.erase(it);
+      }
+      lru.push_front(name);
+      cached.emplace(name, cached_folder{ lru.begin(), size });
+      cached_bytes += size;
+
+      while (lru.size() > 1 &&
+             (cached_bytes > cache_size ||
+              (cache_max_folders > 0 && lru.size() > cache_max_folders))) {
+        auto victim = cached.find(lru.back());
+        cached_bytes -= victim->second.size;
+        victims.push_back(lru.back());
+        cached.erase(victim);
+        lru.pop_back();
+      }
+    }
+
+    // a concurrent lookup of a victim may still find it in the fast tier, or
+    // fall back to the primary one, both are fine
+    for (auto const& victim : victims) {
+      try {
+        fast->remove_folder(victim);
+        evictions++;
+      } catch (std::exception const& e) {
+        log_warning(
+          "Failed to evict ", victim, " from the fast tier: ", e.what());
+      }
+    }
+    return true;
+  }
+
+  /** Copy files of a folder from the primary tier, returning their size */
+  std::uint64_t copy_entries(staged_folder& target,
+                             std::string_view folder,
+                             std::vector<folder_entry> const& entries,
+                             std::string const& prefix) const
+  {
+    std::uint64_t size = 0;
+    for (auto const& entry : entries) {
+      auto path = prefix + entry.name;
+      if (entry.children) {
+        target.create_folder(path);
+        size += copy_entries(target, folder, *entry.children, path + "/");
+        continue;
+      }
+      auto data = primary->read_file(folder, path);
+      if (!data)
+        throw std::runtime_error("File " + path + " disappeared from folder " +
+                                 std::string(folder));
+      target.create_file(path, data->data(), data->size());
+      size += data->size();
+    }
+    return size;
+  }
+
+  /**
+   * Queue a copy of the folder to the fast tier. When the copier is too far
+   * behind, the folder isn't queued, it gets another chance on its next miss.
+   */
+  void schedule_fill(std::string_view name,
+                     std::vector<folder_entry> entries,
+                     std::uint64_t read_at) const
+  {
+    {
+      std::lock_guard lock(fill_mutex);
+      if (fill_queue.size() >= MAX_PENDING_FILLS ||
+          !fill_pending.emplace(name).second)
+        return;
+      fill_queue.push_back(
+        { std::string(name), std::move(entries), read_at });
+      fills_in_progress++;
+    }
+    fill_cv.notify_all();
+  }
+
+  void run_fills()
+  {
+    std::unique_lock lock(fill_mutex);
+    while (true) {
+      fill_cv.wait(lock, [this] { return stop_fills || !fill_queue.empty(); });
+      if (stop_fills)
+        return;
+      auto fill = std::move(fill_queue.front());
+      fill_queue.pop_front();
+      lock.unlock();
+      fill_fast_tier(fill);
+      lock.lock();
+      fill_pending.erase(fill.name);
+      fills_in_progress--;
+      fill_cv.notify_all();
+    }
+  }
+
+  void fill_fast_tier(pending_fill const& fill)
+  {
+    try {
+      auto staged = fast->create_staged_folder(fill.name);
+      auto size = copy_entries(*staged, fill.name, fill.entries, "");
+      // already copied by a commit
+      if (!fast->commit_staged_folder(*staged))
+        return;
+      // checked together with recording it, so that an extension either
+      // comes first and is seen here, or removes the recorded copy
+      if (!add_cached(fill.name, size, fill.extensions))
+        fast->remove_folder(fill.name);
+    } catch (std::exception const& e) {
+      log_warning(
+        "Failed to copy ", fill.name, " to the fast tier: ", e.what());
+    }
+  }
+
+public:
+  explicit storage_tiered(storage_factory factory)
+    : factory(std::move(factory))
+  {
+  }
+
+  ~storage_tiered() override
+  {
+    if (fill_thread.joinable()) {
+      {
+        std::lock_guard lock(fill_mutex);
+        stop_fills = true;
+      }
+      fill_cv.notify_all();
+      fill_thread.join();
+    }
+  }
+
+  /** Wait until the folders queued for copying to the fast tier are copied */
+  void wait_for_fills() const
+  {
+    std::unique_lock lock(fill_mutex);
+    fill_cv.wait(lock, [this] { return fills_in_progress == 0; });
+  }
+
+  void set_config(std::string_view key, std::string_view value) override
+  {
+    auto dot = key.find('.');
+    auto tier_name = key.substr(0, dot);
+    if (dot != std::string_view::npos &&
+        (tier_name == "primary" || tier_name == "fast")) {
+      auto& tier = tier_name == "primary" ? primary : fast;
+      auto tier_key = key.substr(dot + 1);
+      if (tier_key == "type") {
+        tier = factory(value);
+      } else {
+        if (!tier)
+          throw std::runtime_error(
+            "storage." + std::string(tier_name) +
+            ".type not specified (it must come before other storage." +
+            std::string(tier_name) + ".* keys)");
+        tier->set_config(tier_key, value);
+      }
+    } else if (key == "cache_size") {
+      cache_size = parse_bytes(value);
+    } else if (key == "cache_max_folders") {
+      cache_max_folders = string_view_to_int(value);
+    } else if (key == "fill_on_miss") {
+      fill_on_miss = parse_bool(value);
+    } else {
+      throw std::runtime_error("Unknown storage config key: " +
+                               std::string(key));
+    }
+  }
+
+  /** The fast tier is tracked by the process, see the class comment */
+  bool supports_multiple_processes() const override { return false; }
+
+  void validate() const override
+  {
+    if (!primary)
+      throw std::runtime_error("storage.primary.type not specified");
+    if (!fast)
+      throw std::runtime_error("storage.fast.type not specified");
+    if (cache_size == 0)
+      throw std::runtime_error("cache_size must be greater than 0");
+    primary->validate();
+    fast->validate();
+  }
+
+  void init(storage_layout const& layout) override
+  {
+    primary->init(layout);
+    fast->init(layout);
+
+    // the recency of folders from the previous run isn't known, so they are
+    // evicted in arbitrary order
+    for (auto const& folder : fast->list_folders())
+      add_cached(folder.name, folder.size);
+
+    if (fill_on_miss)
+      fill_thread = std::thread([this] { run_fills(); });
+  }
+
+  void migrate(storage_layout const& layout) override
+  {
+    primary->migrate(layout);
+    fast->migrate(layout);
+  }
+
+  std::optional<std::vector<folder_entry>> walk_folder(
+    std::string_view path) const override
+  {
+    if (touch(path)) {
+      if (auto result = fast->walk_folder(path)) {
+        hits++;
+        return result;
+      }
+    }
+
+    // lookups of new images, which are in neither tier, aren't misses
+    auto read_at = get_extensions();
+    auto result = primary->walk_folder(path);
+    if (!result)
+      return result;
+    misses++;
+    if (fill_on_miss)
+      schedule_fill(path, *result, read_at);
+    return result;
+  }
+
+  std::optional<std::vector<std::uint8_t>> read_file(
+    std::string_view folder,
+    std::string_view path) const override
+  {
+    if (touch(folder)) {
+      if (auto result = fast->read_file(folder, path)) {
+        hits++;
+        return result;
+      }
+    }
+
+    auto result = primary->read_file(folder, path);
+    if (result)
+      misses++;
+    return result;
+  }
+
+  void remove_folder(std::string_view name) override
+  {
+    {
+      std::lock_guard lock(cache_mutex);
+      auto it = cached.find(std::string(name));
+      if (it != cached.end()) {
+        cached_bytes -= it->second.size;
+        lru.erase(it->second.lru_position);
+        cached.erase(it);
+      }
+    }
+    fast->remove_folder(name);
+    primary->remove_folder(name);
+  }
+
+  void write_metrics_json(std::ostream& stream) const override
+  {
+    std::uint64_t bytes, folders;
+    {
+      std::lock_guard lock(cache_mutex);
+      bytes = cached_bytes;
+      folders = cached.size();
+    }
+    stream << "{\"fast_hits\": " << hits << ", \"fast_misses\": " << misses
+           << ", \"fast_evictions\": " << evictions
+           << ", \"fast_bytes\": " << bytes
+           << ", \"fast_folders\": " << folders << "}";
+  }
+
+  std::unique_ptr<staged_folder> create_staged_folder(
+    std::string_view name) override
+  {
+    auto result = std::make_unique<tiered_staged_folder>();
+    result->name = name;
+    result->primary = primary->create_staged_folder(name);
+    try {
+      result->fast = fast->create_staged_folder(name);
+    } catch (std::exception const& e) {
+      log_warning("Failed to create staged folder in the fast tier: ",
+                  e.what());
+      result->fast_failed = true;
+    }
+    return result;
+  }
+
+  /**
+   * The primary tier is committed first: once that succeeds, the data is
+   * safely stored, and failure of the fast tier only means it isn't cached.
+   * If the primary tier already had the folder, the fast copy is dropped too,
+   * it would differ from the stored one.
+   */
+  bool commit_staged_folder(staged_folder& folder) override
+  {
+    auto& tiered_folder = dynamic_cast<tiered_staged_folder&>(folder);
+    if (!primary->commit_staged_folder(*tiered_folder.primary))
+      return false;
+    if (tiered_folder.fast_failed)
+      return true;
+
+    try {
+      if (!fast->commit_staged_folder(*tiered_folder.fast))
+        return true;
+    } catch (std::exception const& e) {
+      log_warning("Failed to commit to the fast tier: ", e.what());
+      return true;
+    }
+    add_cached(tiered_folder.name, tiered_folder.size);
+    return true;
+  }
+
+  /**
+   * Only the primary tier is extended. The copy in the fast tier is dropped,
+   * and filled again from the primary tier on the next miss.
+   */
+  void extend_folder(staged_folder& folder) override
+  {
+    auto& tiered_folder = dynamic_cast<tiered_staged_folder&>(folder);
+    primary->extend_folder(*tiered_folder.primary);
+    {
+      std::lock_guard lock(cache_mutex);
+      extensions++;
+      auto it = cached.find(tiered_folder.name);
+      if (it != cached.end()) {
+        cached_bytes -= it->second.size;
+        lru.erase(it->second.lru_position);
+        cached.erase(it);
+      }
+    }
+    // also when it isn't recorded, a fill may have just committed it
+    try {
+      fast->remove_folder(tiered_folder.name);
+    } catch (std::exception const& e) {
+      log_warning("Failed to remove ",
+                  tiered_folder.name,
+                  " from the fast tier: ",
+                  e.what());
+    }
+  }
+
+  /** Folders of the primary tier, which holds all of them */
+  std::vector<stored_folder> list_folders() const override
+  {
+    return primary->list_folders();
+  }
+};
+
+#endif // STORAGE_TIERED_HPP
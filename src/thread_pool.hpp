@@ -1,52 +1,501 @@
 #ifndef THREAD_POOL_HPP
 #define THREAD_POOL_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <deque>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-/** Creates a pool of N threads which then in parallel execute submitted tasks
+#include "cpu_affinity.hpp"
+#include "logger.hpp"
+
+/** Index of a stage of thread_pool, in the order the stages were given */
+using stage_id = unsigned;
+
+/**
+ * A class of tasks of thread_pool with its own queue. Idle threads take the
+ * oldest task of the stage with the lowest priority value that is below its
+ * concurrency cap, so a stage of cheap tasks with a low value never waits
+ * behind the queue of an expensive one.
+ */
+struct stage_options
+{
+  std::string name;
+  /** Stages with lower values run first */
+  unsigned priority;
+  /** Tasks of the stage (and its child stages) running at once, 0 is no cap */
+  unsigned max_concurrency;
+  /**
+   * Stage whose cap also applies to this one, so that e.g. the encoders of
+   * each format can have their own caps and a shared one. It must be listed
+   * before this stage.
+   */
+  std::optional<stage_id> parent;
+
+  stage_options(std::string name,
+                unsigned priority = 0,
+                unsigned max_concurrency = 0,
+                std::optional<stage_id> parent = std::nullopt)
+    : name(std::move(name))
+    , priority(priority)
+    , max_concurrency(max_concurrency)
+    , parent(parent)
+  {
+  }
+};
+
+/**
+ * A task in the thread_pool queue. The callable is stored inline in the node
+ * (the closures of the server, capturing a shared_ptr and a few indices, fit),
+ * and the nodes are linked into the queue directly, so submitting a task
+ * allocates neither for the closure nor for the queue. Larger callables are
+ * moved to the heap.
+ *
+ * Nodes are recycled through a freelist of the thread that ran them, and
+ * taken from the freelist of the thread submitting a task. Since most tasks
+ * are submitted by other tasks, the pool threads keep reusing the same nodes,
+ * and nothing is allocated in the steady state.
+ */
+class task_node
+{
+public:
+  static constexpr std::size_t INLINE_SIZE = 64;
+
+private:
+  friend class thread_pool;
+
+  task_node* next = nullptr;
+  stage_id stage = 0;
+  /** NUMA node whose workers should run the task, see thread_pool */
+  unsigned node = 0;
+  /** Time of submission, if this task's queue time is measured */
+  std::chrono::steady_clock::time_point enqueued;
+  void (*invoke)(task_node*) = nullptr;
+  void (*destroy)(task_node*) = nullptr;
+  alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+
+  struct freelist
+  {
+    /** More nodes than this are freed, not kept */
+    static constexpr std::size_t MAX_SIZE = 1024;
+
+    task_node* head = nullptr;
+    std::size_t size = 0;
+
+    ~freelist()
+    {
+      while (head)
+        delete std::exchange(head, head->next);
+    }
+  };
+
+  static freelist& local_freelist()
+  {
+    thread_local freelist list;
+    return list;
+  }
+
+  task_node() = default;
+
+  template<typename Fn>
+  static constexpr bool fits_inline = sizeof(Fn) <= INLINE_SIZE &&
+                                      alignof(Fn) <= alignof(std::max_align_t);
+
+  template<typename Fn>
+  static task_node* create(Fn&& fn)
+  {
+    using F = std::decay_t<Fn>;
+
+    auto& list = local_freelist();
+    task_node* node;
+    if (list.head) {
+      node = std::exchange(list.head, list.head->next);
+      list.size--;
+    } else {
+      node = new task_node();
+    }
+    node->next = nullptr;
+
+    try {
+      if constexpr (fits_inline<F>) {
+        new (node->storage) F(std::forward<Fn>(fn));
+        node->invoke = [](task_node* n) {
+          (*std::launder(reinterpret_cast<F*>(n->storage)))();
+        };
+        node->destroy = [](task_node* n) {
+          std::launder(reinterpret_cast<F*>(n->storage))->~F();
+        };
+      } else {
+        new (node->storage) F*(new F(std::forward<Fn>(fn)));
+        node->invoke = [](task_node* n) {
+          (**std::launder(reinterpret_cast<F**>(n->storage)))();
+        };
+        node->destroy = [](task_node* n) {
+          delete *std::launder(reinterpret_cast<F**>(n->storage));
+        };
+      }
+    } catch (...) {
+      release(node);
+      throw;
+    }
+    return node;
+  }
+
+  static void release(task_node* node)
+  {
+    auto& list = local_freelist();
+    if (list.size >= freelist::MAX_SIZE) {
+      delete node;
+      return;
+    }
+    node->next = std::exchange(list.head, node);
+    list.size++;
+  }
+
+  /** Destroy the callable and recycle the node, without running it */
+  void discard()
+  {
+    destroy(this);
+    release(this);
+  }
+
+  /** Run the callable, then destroy it and recycle the node */
+  void run()
+  {
+    struct discard_guard
+    {
+      task_node* node;
+      ~discard_guard() { node->discard(); }
+    } guard{ this };
+    invoke(this);
+  }
+};
+
+/**
+ * Creates a pool of N threads which then in parallel execute submitted tasks.
+ * Tasks are submitted to a stage (see stage_options), a pool created without
+ * stages has a single one.
+ *
+ * The workers may be pinned to NUMA nodes (see worker_placement). Each task
+ * then belongs to a node: tasks submitted by a running task belong to its
+ * node, so the tasks of one image stay on the node where it started, and
+ * tasks submitted from other threads are spread over the nodes in turn.
+ * Workers take the tasks of their own node first, and those of other nodes
+ * only when they would be idle otherwise. Threads started by libraries (like
+ * the libvips workers) aren't pinned.
  */
 class thread_pool
 {
+public:
+  /** Where a task was running, see current_location() */
+  struct task_location
+  {
+    thread_pool const* pool = nullptr;
+    unsigned node = 0;
+  };
+
 private:
-  using Executor = std::function<void()>;
-  std::mutex mutex;
-  std::condition_variable cv;
-  /// lock the mutex before accessing this, wait on CV if no tasks are available
-  std::deque<Executor> tasks;
-  std::vector<std::thread> threads;
+  /** FIFO of linked task_nodes */
+  struct task_queue
+  {
+    task_node* head = nullptr;
+    task_node* tail = nullptr;
+  };
+
+  struct stage
+  {
+    stage_options options;
+    /** Queue of each node */
+    std::vector<task_queue> queues;
+    std::size_t queued = 0;
+    /** Running tasks of this stage and its child stages */
+    unsigned running = 0;
+
+    std::uint64_t started = 0;
+    /** Started tasks whose queue time was measured */
+    std::uint64_t timed = 0;
+    std::chrono::nanoseconds queue_time_total{ 0 };
+    std::chrono::nanoseconds queue_time_max{ 0 };
+  };
+
+  struct worker
+  {
+    worker_placement placement;
+    /** Set when the worker is taken off the idle list to run a task */
+    bool signaled = false;
+    std::condition_variable cv;
+    std::thread thread;
+  };
+
+  /**
+   * Lock the mutex before accessing the stages and the idle lists, workers
+   * wait on their CV if no tasks can be run
+   */
+  mutable std::mutex mutex;
+  std::vector<stage> stages;
+  /** Stage ids ordered by priority */
+  std::vector<stage_id> by_priority;
+  std::vector<std::unique_ptr<worker>> workers;
+  /** Waiting workers of each node, the most recently idle last */
+  std::vector<std::vector<worker*>> idle;
+  unsigned node_count = 1;
+  /** Node of the next task submitted from outside of the pool */
+  std::atomic<unsigned> next_node{ 0 };
   std::atomic<bool> shutdown{ false };
 
+  static task_location& running_task()
+  {
+    thread_local task_location location;
+    return location;
+  }
+
+  unsigned node_for(task_location where)
+  {
+    if (where.pool == this)
+      return where.node;
+    if (node_count == 1)
+      return 0;
+    return next_node.fetch_add(1, std::memory_order_relaxed) % node_count;
+  }
+
+  /** Wake a worker for a task of the node, preferring the node's own workers */
+  void wake_worker(unsigned node)
+  {
+    auto* list = &idle[node];
+    for (unsigned i = 1; list->empty() && i < node_count; i++)
+      list = &idle[(node + i) % node_count];
+    if (list->empty())
+      return;
+    worker* w = list->back();
+    list->pop_back();
+    w->signaled = true;
+    w->cv.notify_one();
+  }
+
+  bool has_capacity(stage_id id) const
+  {
+    for (std::optional<stage_id> s = id; s; s = stages[*s].options.parent) {
+      auto const& st = stages[*s];
+      if (st.options.max_concurrency &&
+          st.running >= st.options.max_concurrency)
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * Take the next task that may run and account it as running, or null.
+   * Within a stage, the tasks of the given node go first.
+   */
+  task_node* take_runnable(unsigned node)
+  {
+    for (stage_id id : by_priority) {
+      auto& st = stages[id];
+      if (!st.queued || !has_capacity(id))
+        continue;
+
+      task_queue* queue = &st.queues[node];
+      for (unsigned i = 1; !queue->head && i < node_count; i++)
+        queue = &st.queues[(node + i) % node_count];
+      task_node* task = queue->head;
+      queue->head = task->next;
+      if (!queue->head)
+        queue->tail = nullptr;
+      st.queued--;
+
+      st.started++;
+      if (task->enqueued != std::chrono::steady_clock::time_point()) {
+        auto waited = std::chrono::steady_clock::now() - task->enqueued;
+        st.timed++;
+        st.queue_time_total += waited;
+        st.queue_time_max = std::max(
+          st.queue_time_max,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(waited));
+      }
+
+      for (std::optional<stage_id> s = id; s; s = stages[*s].options.parent)
+        stages[*s].running++;
+      return task;
+    }
+    return nullptr;
+  }
+
+  void finish_task(stage_id id)
+  {
+    for (std::optional<stage_id> s = id; s; s = stages[*s].options.parent)
+      stages[*s].running--;
+  }
+
+  void run_worker(worker& self)
+  {
+    auto const& placement = self.placement;
+    if (!placement.cpus.empty() && !pin_current_thread(placement.cpus))
+      log_warning("Failed to pin a worker thread to its CPUs");
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      task_node* task = nullptr;
+      while (!shutdown && !(task = take_runnable(placement.node))) {
+        idle[placement.node].push_back(&self);
+        self.cv.wait(lock, [&] { return shutdown || self.signaled; });
+        self.signaled = false;
+      }
+      if (shutdown)
+        break;
+      stage_id id = task->stage;
+      running_task() = { this, task->node };
+      lock.unlock();
+      task->run();
+      lock.lock();
+      // the freed slot may let a capped stage run, which this thread checks
+      // right away
+      finish_task(id);
+    }
+  }
+
 public:
+  /** One in this many tasks has its queue time measured */
+  static constexpr unsigned QUEUE_TIME_SAMPLE = 8;
+
   thread_pool(unsigned n)
+    : thread_pool(n, { stage_options("default") })
   {
-    for (unsigned i = 0; i < n; i++) {
-      threads.emplace_back([this] {
-        while (!shutdown) {
-          std::unique_lock<std::mutex> lock(mutex);
-          cv.wait(lock, [this] { return !tasks.empty() || shutdown; });
-          if (shutdown)
-            break;
-          Executor executor = std::move(tasks.front());
-          tasks.pop_front();
-          lock.unlock();
-          executor();
-        }
+  }
+
+  /**
+   * Placements are given for all n workers, or none, in which case the
+   * workers aren't pinned and all belong to a single node
+   */
+  thread_pool(unsigned n,
+              std::vector<stage_options> stage_list,
+              std::vector<worker_placement> placements = {})
+  {
+    if (!placements.empty() && placements.size() != n)
+      throw std::invalid_argument("thread_pool needs a placement per worker");
+    for (auto const& placement : placements)
+      node_count = std::max(node_count, placement.node + 1);
+    idle.resize(node_count);
+
+    if (stage_list.empty())
+      throw std::invalid_argument("thread_pool needs at least one stage");
+    for (stage_id id = 0; id < stage_list.size(); id++) {
+      auto parent = stage_list[id].parent;
+      if (parent && *parent >= id)
+        throw std::invalid_argument("Parent of stage " + stage_list[id].name +
+                                    " must be listed before it");
+      stages.push_back(stage{ std::move(stage_list[id]),
+                              std::vector<task_queue>(node_count) });
+      by_priority.push_back(id);
+    }
+    std::stable_sort(
+      by_priority.begin(), by_priority.end(), [this](stage_id a, stage_id b) {
+        return stages[a].options.priority < stages[b].options.priority;
       });
+
+    for (unsigned i = 0; i < n; i++) {
+      workers.push_back(std::make_unique<worker>());
+      if (!placements.empty())
+        workers.back()->placement = std::move(placements[i]);
     }
+    // started only now, since they access all workers through the idle lists
+    for (auto& w : workers)
+      w->thread = std::thread([this, &w = *w] { run_worker(w); });
   }
 
-  void add_task(Executor&& task)
+  unsigned get_node_count() const { return node_count; }
+
+  /** Pool and node of the task running on the calling thread, if any */
+  static task_location current_location() { return running_task(); }
+
+  /** Enqueue any callable to the first stage, see task_node */
+  template<typename Fn>
+  void add_task(Fn&& task)
+  {
+    add_task(stage_id(0), std::forward<Fn>(task));
+  }
+
+  /**
+   * Enqueue any callable to the given stage, see task_node. It runs on the
+   * node of the task calling this, if any.
+   */
+  template<typename Fn>
+  void add_task(stage_id id, Fn&& task)
+  {
+    add_task_at(running_task(), id, std::forward<Fn>(task));
+  }
+
+  /**
+   * Like add_task(), on the node of a task that ran before, see
+   * current_location(). This keeps the node when a task is submitted from a
+   * callback on another thread.
+   */
+  template<typename Fn>
+  void add_task_at(task_location where, stage_id id, Fn&& task)
   {
+    // the list of stages doesn't change after the construction
+    if (id >= stages.size())
+      throw std::out_of_range("Unknown stage of thread_pool");
+    task_node* node = task_node::create(std::forward<Fn>(task));
+    node->stage = id;
+    node->node = node_for(where);
+    // reading the clock twice costs about as much as running an empty task,
+    // so only every QUEUE_TIME_SAMPLE-th task of each thread is timed
+    thread_local unsigned submitted = 0;
+    if (submitted++ % QUEUE_TIME_SAMPLE == 0)
+      node->enqueued = std::chrono::steady_clock::now();
+    else
+      node->enqueued = {};
     std::unique_lock<std::mutex> lock(mutex);
-    tasks.push_back(std::move(task));
-    cv.notify_one();
+    auto& st = stages[id];
+    auto& queue = st.queues[node->node];
+    if (queue.tail)
+      queue.tail->next = node;
+    else
+      queue.head = node;
+    queue.tail = node;
+    st.queued++;
+    wake_worker(node->node);
+  }
+
+  /**
+   * Queue lengths, running tasks and time spent in the queue of each stage
+   * (measured on a sample of the tasks, see QUEUE_TIME_SAMPLE), as a JSON
+   * object keyed by stage names
+   */
+  void write_metrics_json(std::ostream& stream) const
+  {
+    using ms = std::chrono::duration<double, std::milli>;
+    std::lock_guard lock(mutex);
+    stream << "{";
+    bool first = true;
+    for (auto const& st : stages) {
+      if (!first)
+        stream << ", ";
+      first = false;
+      double average =
+        st.timed ? ms(st.queue_time_total).count() / st.timed : 0;
+      stream << "\"" << st.options.name << "\": {\"queued\": " << st.queued
+             << ", \"running\": " << st.running
+             << ", \"started\": " << st.started
+             << ", \"queue_time_avg_ms\": " << average
+             << ", \"queue_time_max_ms\": " << ms(st.queue_time_max).count()
+             << "}";
+    }
+    stream << "}";
   }
 
   /**
@@ -57,13 +506,26 @@ public:
   {
     if (shutdown)
       return;
-    shutdown = true;
-    cv.notify_all();
-    for (auto& t : threads)
-      t.join();
+    {
+      // taken so that no worker misses the notification between checking
+      // the flag and waiting
+      std::lock_guard lock(mutex);
+      shutdown = true;
+      for (auto& w : workers)
+        w->cv.notify_one();
+    }
+    for (auto& w : workers)
+      w->thread.join();
   }
 
-  ~thread_pool() { blocking_shutdown(); }
+  ~thread_pool()
+  {
+    blocking_shutdown();
+    for (auto& st : stages)
+      for (auto& queue : st.queues)
+        while (queue.head)
+          std::exchange(queue.head, queue.head->next)->discard();
+  }
 };
 
 /**
@@ -126,8 +588,7 @@ public:
   {
     std::int16_t pending = pending_tasks.load();
     if (pending > 0) {
-      std::cerr << "Warning: destroying task group with  " << pending
-                << " pending tasks" << std::endl;
+      log_warning("Destroying task group with ", pending, " pending tasks");
     }
   }
 
@@ -150,6 +611,31 @@ public:
 
   template<typename Fn>
   void add_task(Fn&& task)
+  {
+    if (!count_task())
+      return;
+    schedule(std::forward<Fn>(task));
+  }
+
+  /**
+   * Reserve a task which will be added later with add_deferred_task(), e.g.
+   * from a callback of some outside event. Until then, the group is kept
+   * running, even if all its other tasks finish.
+   *
+   * Returns false if the group already errored, and no task should be added.
+   */
+  bool defer_task() { return count_task(); }
+
+  /** Add the task reserved by defer_task() */
+  template<typename Fn>
+  void add_deferred_task(Fn&& task)
+  {
+    schedule(std::forward<Fn>(task));
+  }
+
+private:
+  /** Check that a task can be added, and count it as pending */
+  bool count_task()
   {
     {
       auto s = state.load();
@@ -157,14 +643,18 @@ public:
         throw std::logic_error("Cannot add task to a finished group");
 
       if (s == State::Done_Error) {
-        std::cerr << "Warning: adding task to a group that already errored"
-                  << std::endl;
-        return;
+        log_debug("Adding task to a group that already errored");
+        return false;
       }
     }
 
     pending_tasks.fetch_add(1);
+    return true;
+  }
 
+  template<typename Fn>
+  void schedule(Fn&& task)
+  {
     pool.add_task([this, task = std::move(task)]() {
       {
         auto s = state.load();
@@ -175,9 +665,7 @@ public:
         }
 
         if (s == State::Done_Error) {
-          std::cerr << "Warning: not starting task, since this group already "
-                       "errored"
-                    << std::endl;
+          log_debug("Not starting task, since this group already errored");
           pending_tasks.fetch_sub(1);
           return;
         }
@@ -205,9 +693,9 @@ public:
                                  std::string(e.what()));
         } else {
           // this is a normal scenario
-          std::cerr << "Error in task (not the first error in group, there's "
-                       "noone to report to): "
-                    << e.what() << std::endl;
+          log_warning("Error in task (not the first error in group, there's "
+                      "noone to report to): ",
+                      e.what());
         }
         return;
       }
@@ -0,0 +1,470 @@
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "logger.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+/**
+ * Tracing of sampled requests, configured as
+ *
+ *   trace.sample_rate=<0..1>        (0 disables the tracing)
+ *   trace.file=<path>
+ *   trace.max_file_size=<bytes>
+ *   trace.max_files=<n>
+ *
+ * The spans of traced requests are written to the file in the Chrome trace
+ * event format, which chrome://tracing and ui.perfetto.dev open. Each request
+ * is shown as a process named after the upload, with a row for each thread
+ * that worked on it, and the time spent in queues and waiting as async
+ * slices. When the file grows over max_file_size, it is renamed to
+ * <file>.1 (and older files to <file>.2, ...), keeping max_files of them.
+ */
+struct trace_config
+{
+  double sample_rate = 0;
+  std::string file = "asset-server-trace.json";
+  std::uint64_t max_file_size = 64 * 1024 * 1024;
+  unsigned max_files = 4;
+
+  /** Set an option from a config entry, key is the part after "trace." */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "sample_rate") {
+      auto [end, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), sample_rate);
+      if (ec != std::errc() || end != value.data() + value.size() ||
+          sample_rate < 0 || sample_rate > 1)
+        throw std::runtime_error("Expected a number between 0 and 1");
+    } else if (key == "file") {
+      file = value;
+    } else if (key == "max_file_size") {
+      max_file_size = parse_bytes(value);
+    } else if (key == "max_files") {
+      max_files = string_view_to_int(value);
+      if (max_files == 0)
+        throw std::runtime_error("max_files must be greater than 0");
+    } else {
+      throw std::runtime_error("Unknown trace option");
+    }
+  }
+};
+
+namespace trace_detail {
+
+using clock = std::chrono::steady_clock;
+
+std::int64_t
+to_us(clock::time_point time)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           time.time_since_epoch())
+    .count();
+}
+
+/** Small number of the calling thread, used as its row in the trace */
+unsigned
+thread_index()
+{
+  static std::atomic<unsigned> next{ 1 };
+  thread_local unsigned index = next.fetch_add(1);
+  return index;
+}
+
+void
+append_json_string(std::string& out, std::string_view text)
+{
+  out += '"';
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) >= 0x20) {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+} // namespace trace_detail
+
+class request_trace;
+
+/**
+ * Decides which requests are traced, and writes their traces to the file from
+ * a background thread once they are finished.
+ */
+class request_tracer
+{
+private:
+  friend class request_trace;
+
+  trace_config config;
+  std::atomic<std::uint64_t> next_request{ 1 };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> pending;
+  bool stopping = false;
+  std::thread writer;
+
+  /** Called when the last reference to a trace is gone */
+  void submit(std::string&& events)
+  {
+    {
+      std::lock_guard lock(mutex);
+      pending.push_back(std::move(events));
+    }
+    cv.notify_one();
+  }
+
+  std::filesystem::path rotated_path(unsigned n) const
+  {
+    return config.file + "." + std::to_string(n);
+  }
+
+  void rotate()
+  {
+    std::error_code ec;
+    std::filesystem::remove(rotated_path(config.max_files - 1), ec);
+    for (unsigned n = config.max_files - 1; n > 1; n--)
+      std::filesystem::rename(rotated_path(n - 1), rotated_path(n), ec);
+    if (config.max_files > 1)
+      std::filesystem::rename(config.file, rotated_path(1), ec);
+    else
+      std::filesystem::remove(config.file, ec);
+  }
+
+  void run_writer()
+  {
+    std::unique_lock lock(mutex);
+    while (true) {
+      cv.wait(lock, [this] { return stopping || !pending.empty(); });
+      auto batch = std::move(pending);
+      pending.clear();
+      bool stop_now = stopping;
+      lock.unlock();
+
+      try {
+        write_batch(batch);
+      } catch (std::exception const& e) {
+        log_warning("Failed to write traces: ", e.what());
+      }
+
+      lock.lock();
+      if (stop_now && pending.empty())
+        return;
+    }
+  }
+
+  void write_batch(std::vector<std::string> const& batch)
+  {
+    std::error_code ec;
+    std::uint64_t size = std::filesystem::file_size(config.file, ec);
+    if (ec)
+      size = 0;
+
+    std::ofstream out;
+    for (auto const& events : batch) {
+      if (size >= config.max_file_size) {
+        out.close();
+        rotate();
+        size = 0;
+      }
+      if (!out.is_open()) {
+        out.open(config.file, std::ios::app | std::ios::binary);
+        if (!out)
+          throw std::runtime_error("Can't open " + config.file);
+        // the trace format allows the closing bracket of the array to be
+        // missing, so that traces can be appended
+        if (size == 0) {
+          out << "[\n";
+          size += 2;
+        }
+      }
+      out << events;
+      size += events.size();
+    }
+    out.flush();
+  }
+
+public:
+  explicit request_tracer(trace_config config)
+    : config(std::move(config))
+  {
+    if (this->config.sample_rate > 0)
+      writer = std::thread([this] { run_writer(); });
+  }
+
+  ~request_tracer()
+  {
+    if (!writer.joinable())
+      return;
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    writer.join();
+  }
+
+  /** Trace of a new request, or null if it isn't sampled */
+  std::shared_ptr<request_trace> start_request();
+};
+
+/**
+ * Events of one traced request, shared by everything working on it. The trace
+ * is written out when the last reference to it is dropped.
+ */
+class request_trace
+{
+private:
+  request_tracer& tracer;
+  std::uint64_t const id;
+  std::atomic<std::uint64_t> next_async_id{ 1 };
+
+  std::mutex mutex;
+  std::string name;
+  std::string events;
+  std::vector<unsigned> threads;
+
+  void append_common(std::string_view event_name,
+                     char phase,
+                     std::int64_t ts,
+                     unsigned thread)
+  {
+    events += "{\"name\": ";
+    trace_detail::append_json_string(events, event_name);
+    events += ", \"ph\": \"";
+    events += phase;
+    events += "\", \"ts\": ";
+    events += std::to_string(ts);
+    events += ", \"pid\": ";
+    events += std::to_string(id);
+    events += ", \"tid\": ";
+    events += std::to_string(thread);
+  }
+
+public:
+  request_trace(request_tracer& tracer, std::uint64_t id)
+    : tracer(tracer)
+    , id(id)
+  {
+  }
+
+  request_trace(request_trace const&) = delete;
+  request_trace& operator=(request_trace const&) = delete;
+
+  ~request_trace()
+  {
+    std::string metadata;
+    metadata += "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": ";
+    metadata += std::to_string(id);
+    metadata += ", \"args\": {\"name\": ";
+    trace_detail::append_json_string(
+      metadata, name.empty() ? "request " + std::to_string(id) : name);
+    metadata += "}},\n";
+    for (auto thread : threads) {
+      metadata += "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": ";
+      metadata += std::to_string(id);
+      metadata += ", \"tid\": ";
+      metadata += std::to_string(thread);
+      metadata += ", \"args\": {\"name\": \"thread ";
+      metadata += std::to_string(thread);
+      metadata += "\"}},\n";
+    }
+    tracer.submit(metadata + events);
+  }
+
+  /** Name of the request in the trace viewer */
+  void set_name(std::string new_name)
+  {
+    std::lock_guard lock(mutex);
+    name = std::move(new_name);
+  }
+
+  /** Work done by the calling thread, see trace_span */
+  void add_span(std::string_view span_name,
+                trace_detail::clock::time_point start,
+                trace_detail::clock::time_point end,
+                std::string_view args_json)
+  {
+    auto thread = trace_detail::thread_index();
+    std::lock_guard lock(mutex);
+    if (std::find(threads.begin(), threads.end(), thread) == threads.end())
+      threads.push_back(thread);
+    append_common(span_name, 'X', trace_detail::to_us(start), thread);
+    events += ", \"dur\": ";
+    events += std::to_string(trace_detail::to_us(end) -
+                             trace_detail::to_us(start));
+    if (!args_json.empty()) {
+      events += ", \"args\": {";
+      events += args_json;
+      events += "}";
+    }
+    events += "},\n";
+  }
+
+  /**
+   * Time that isn't spent working on one thread (in a queue, waiting for the
+   * upload, ...). These may overlap, so each gets its own track.
+   */
+  void add_wait(std::string_view wait_name,
+                trace_detail::clock::time_point start,
+                trace_detail::clock::time_point end)
+  {
+    auto async_id = next_async_id.fetch_add(1);
+    std::lock_guard lock(mutex);
+    for (auto [phase, time] :
+         { std::pair{ 'b', start }, std::pair{ 'e', end } }) {
+      append_common(wait_name, phase, trace_detail::to_us(time), 0);
+      events += ", \"cat\": \"wait\", \"id\": ";
+      events += std::to_string(async_id);
+      events += "},\n";
+    }
+  }
+};
+
+std::shared_ptr<request_trace>
+request_tracer::start_request()
+{
+  if (config.sample_rate <= 0)
+    return nullptr;
+  thread_local std::minstd_rand random(std::random_device{}());
+  if (std::uniform_real_distribution<double>(0, 1)(random) >=
+      config.sample_rate)
+    return nullptr;
+  return std::make_shared<request_trace>(*this, next_request.fetch_add(1));
+}
+
+/**
+ * Records the work between its creation and destruction on the calling thread,
+ * if the trace is set. It must not live across a suspension of a coroutine,
+ * since the coroutine may continue on another thread, use trace_wait for that.
+ */
+class trace_span
+{
+private:
+  request_trace* trace;
+  char const* name;
+  trace_detail::clock::time_point start;
+  std::string args;
+
+public:
+  trace_span(request_trace* trace, char const* name)
+    : trace(trace)
+    , name(name)
+  {
+    if (trace)
+      start = trace_detail::clock::now();
+  }
+
+  trace_span(trace_span const&) = delete;
+  trace_span& operator=(trace_span const&) = delete;
+
+  ~trace_span()
+  {
+    if (trace)
+      trace->add_span(name, start, trace_detail::clock::now(), args);
+  }
+
+  /** Whether the span is recorded, arguments are only worth adding then */
+  explicit operator bool() const { return trace; }
+
+  trace_span& arg(std::string_view key, std::string_view value)
+  {
+    if (!args.empty())
+      args += ", ";
+    trace_detail::append_json_string(args, key);
+    args += ": ";
+    trace_detail::append_json_string(args, value);
+    return *this;
+  }
+
+  trace_span& arg(std::string_view key, std::int64_t value)
+  {
+    if (!args.empty())
+      args += ", ";
+    trace_detail::append_json_string(args, key);
+    args += ": ";
+    args += std::to_string(value);
+    return *this;
+  }
+};
+
+/** Records the time between its creation and destruction as a wait */
+class trace_wait
+{
+private:
+  request_trace* trace;
+  char const* name;
+  trace_detail::clock::time_point start;
+
+public:
+  trace_wait(request_trace* trace, char const* name)
+    : trace(trace)
+    , name(name)
+  {
+    if (trace)
+      start = trace_detail::clock::now();
+  }
+
+  trace_wait(trace_wait const&) = delete;
+  trace_wait& operator=(trace_wait const&) = delete;
+
+  ~trace_wait()
+  {
+    if (trace)
+      trace->add_wait(name, start, trace_detail::clock::now());
+  }
+};
+
+/**
+ * Like schedule_awaiter (see coro.hpp), recording the time spent in the queue
+ * of the stage if the trace is set
+ */
+struct traced_schedule_awaiter
+{
+  thread_pool& pool;
+  stage_id stage;
+  request_trace* trace;
+  std::string_view stage_name;
+  trace_detail::clock::time_point queued;
+
+  bool await_ready() noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle)
+  {
+    if (trace)
+      queued = trace_detail::clock::now();
+    pool.add_task(stage, [handle] { handle.resume(); });
+  }
+
+  void await_resume()
+  {
+    if (trace)
+      trace->add_wait(
+        "queue " + std::string(stage_name), queued, trace_detail::clock::now());
+  }
+};
+
+#endif // TRACING_HPP
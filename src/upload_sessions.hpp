@@ -0,0 +1,400 @@
+#ifndef UPLOAD_SESSIONS_HPP
+#define UPLOAD_SESSIONS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+/**
+ * Resumable uploads, configured as
+ *
+ *   upload_sessions.dir=<path>            (unset or empty disables them)
+ *   upload_sessions.expiry_secs=<n>
+ *   upload_sessions.max_sessions=<n>
+ *
+ * An upload session receives the image in chunks sent by separate requests,
+ * so a broken connection only costs the chunk being sent. The chunks are
+ * appended to a file in a subdirectory of dir owned by the server process,
+ * which is removed when the session is finalized, or when it wasn't used for
+ * expiry_secs.
+ */
+struct upload_session_config
+{
+  std::string dir;
+  unsigned expiry_secs = 24 * 60 * 60;
+  unsigned max_sessions = 1000;
+
+  /**
+   * Set an option from a config entry, key is the part after
+   * "upload_sessions."
+   */
+  void set(std::string_view key, std::string_view value)
+  {
+    if (key == "dir") {
+      dir = value;
+    } else if (key == "expiry_secs") {
+      expiry_secs = string_view_to_int(value);
+    } else if (key == "max_sessions") {
+      max_sessions = string_view_to_int(value);
+    } else {
+      throw std::runtime_error("Unknown upload_sessions option");
+    }
+  }
+};
+
+/**
+ * An image being uploaded in chunks. The data is hashed as it is appended, so
+ * that finalizing doesn't need to read it twice.
+ *
+ * A session is used by one request at a time, see upload_sessions::acquire.
+ */
+class upload_session
+{
+private:
+  friend class upload_sessions;
+
+  std::string const id;
+  std::string const filename;
+  std::uint64_t const length;
+  std::filesystem::path const path;
+
+  std::ofstream file;
+  image_hasher hasher;
+  std::uint64_t offset = 0;
+
+  std::chrono::steady_clock::time_point last_used;
+  /** Held by a request, see upload_sessions::acquire */
+  bool in_use = false;
+
+public:
+  upload_session(std::string id,
+                 std::string filename,
+                 std::uint64_t length,
+                 std::filesystem::path path,
+                 hash_algorithm algorithm)
+    : id(std::move(id))
+    , filename(std::move(filename))
+    , length(length)
+    , path(std::move(path))
+    , file(this->path, std::ios::binary | std::ios::trunc)
+    , hasher(algorithm)
+  {
+    if (!file)
+      throw std::runtime_error("Failed to create " + this->path.string());
+  }
+
+  upload_session(upload_session const&) = delete;
+  upload_session& operator=(upload_session const&) = delete;
+
+  ~upload_session()
+  {
+    file.close();
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+  }
+
+  std::string const& get_id() const { return id; }
+  std::string const& get_filename() const { return filename; }
+  std::uint64_t get_length() const { return length; }
+  std::uint64_t get_offset() const { return offset; }
+
+  /** Append a part of a chunk, returns false if it would exceed the length */
+  bool append(std::uint8_t const* data, std::size_t size)
+  {
+    if (size > length - offset)
+      return false;
+    file.write(reinterpret_cast<char const*>(data), size);
+    if (!file)
+      throw std::runtime_error("Failed to write " + path.string());
+    hasher.update(data, size);
+    offset += size;
+    return true;
+  }
+
+  /**
+   * The whole upload and its image_hash(), once all of it was received. The
+   * session can't be used afterwards.
+   */
+  std::pair<std::vector<std::uint8_t>, std::string> take()
+  {
+    if (offset != length)
+      throw std::logic_error("Taking an incomplete upload session");
+    file.close();
+    std::ifstream in(path, std::ios::binary);
+    std::vector<std::uint8_t> data(std::istreambuf_iterator<char>(in), {});
+    if (data.size() != length)
+      throw std::runtime_error("Failed to read " + path.string());
+    return { std::move(data), hasher.finish() };
+  }
+
+  void write_json(std::ostream& stream) const
+  {
+    stream << "{\"upload_id\": \"" << id << "\", \"offset\": " << offset
+           << ", \"length\": " << length << "}";
+  }
+};
+
+/**
+ * The upload sessions of this server process. Sessions are kept only in
+ * memory, so they don't survive a restart.
+ *
+ * Several processes may share the dir: each keeps its session files in its own
+ * subdirectory, named by SUBDIRECTORY_BYTES random bytes in hex, and holds an
+ * flock on its .lock file while it runs. At startup, the session files in
+ * subdirectories whose lock isn't held (left by processes that exited) are
+ * removed, together with the subdirectories.
+ */
+class upload_sessions
+{
+public:
+  /** Releases the session for other requests when destroyed */
+  class lease
+  {
+  private:
+    friend class upload_sessions;
+
+    upload_sessions* owner = nullptr;
+    std::shared_ptr<upload_session> session;
+
+    lease(upload_sessions* owner, std::shared_ptr<upload_session> session)
+      : owner(owner)
+      , session(std::move(session))
+    {
+    }
+
+  public:
+    lease() = default;
+
+    lease(lease&& other) noexcept
+      : owner(std::exchange(other.owner, nullptr))
+      , session(std::move(other.session))
+    {
+    }
+
+    lease& operator=(lease&& other) noexcept
+    {
+      if (this != &other) {
+        reset();
+        owner = std::exchange(other.owner, nullptr);
+        session = std::move(other.session);
+      }
+      return *this;
+    }
+
+    ~lease() { reset(); }
+
+    void reset()
+    {
+      if (owner)
+        owner->release(*session);
+      owner = nullptr;
+      session.reset();
+    }
+
+    bool has_session() const { return session != nullptr; }
+
+    upload_session* operator->() const { return session.get(); }
+    upload_session& operator*() const { return *session; }
+  };
+
+  enum class acquire_status
+  {
+    acquired,
+    not_found,
+    /** Another request is sending a chunk of the session */
+    in_use,
+  };
+
+private:
+  upload_session_config config;
+  hash_algorithm algorithm;
+
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<upload_session>> sessions;
+  std::uint64_t expired = 0;
+
+  void release(upload_session& session)
+  {
+    std::lock_guard lock(mutex);
+    session.in_use = false;
+    session.last_used = std::chrono::steady_clock::now();
+  }
+
+  /** Remove sessions unused for expiry_secs, the mutex must be locked */
+  void remove_expired()
+  {
+    auto deadline = std::chrono::steady_clock::now() -
+                    std::chrono::seconds(config.expiry_secs);
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (!it->second->in_use && it->second->last_used < deadline) {
+        it = sessions.erase(it);
+        expired++;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  static constexpr std::size_t ID_BYTES = 16;
+  static constexpr std::size_t SUBDIRECTORY_BYTES = 8;
+
+  /** Subdirectory of this process in config.dir, set by init() */
+  std::filesystem::path directory;
+  /** Locked .lock file of the subdirectory */
+  int lock_fd = -1;
+
+  static bool is_hex_name(std::string const& name, std::size_t bytes)
+  {
+    return name.size() == 2 * bytes &&
+           name.find_first_not_of("0123456789abcdef") == std::string::npos;
+  }
+
+  /**
+   * Open and lock the .lock file of a subdirectory, returns -1 if another
+   * process holds it
+   */
+  static int lock_subdirectory(std::filesystem::path const& subdirectory)
+  {
+    auto path = subdirectory / ".lock";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open " + path.string());
+    if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  /** Remove the session files of a process that exited */
+  static void remove_abandoned(std::filesystem::path const& subdirectory)
+  {
+    int fd = lock_subdirectory(subdirectory);
+    if (fd < 0)
+      return;
+    std::error_code ec;
+    for (auto const& entry :
+         std::filesystem::directory_iterator(subdirectory, ec))
+      if (is_hex_name(entry.path().filename().string(), ID_BYTES))
+        std::filesystem::remove(entry.path(), ec);
+    std::filesystem::remove(subdirectory / ".lock", ec);
+    // kept if there are any other files
+    std::filesystem::remove(subdirectory, ec);
+    ::close(fd);
+  }
+
+public:
+  upload_sessions(upload_session_config config, hash_algorithm algorithm)
+    : config(std::move(config))
+    , algorithm(algorithm)
+  {
+  }
+
+  upload_sessions(upload_sessions const&) = delete;
+  upload_sessions& operator=(upload_sessions const&) = delete;
+
+  ~upload_sessions()
+  {
+    sessions.clear();
+    if (lock_fd >= 0) {
+      std::error_code ec;
+      std::filesystem::remove(directory / ".lock", ec);
+      std::filesystem::remove(directory, ec);
+      ::close(lock_fd);
+    }
+  }
+
+  /**
+   * Create the subdirectory of this process, and remove files left by
+   * processes that exited
+   */
+  void init()
+  {
+    std::filesystem::path root = config.dir;
+    std::filesystem::create_directories(root);
+    for (auto const& entry : std::filesystem::directory_iterator(root))
+      if (entry.is_directory() &&
+          is_hex_name(entry.path().filename().string(), SUBDIRECTORY_BYTES))
+        remove_abandoned(entry.path());
+
+    // locked under a temporary name, so that no other process finds it
+    // unlocked and removes it
+    auto name = random_hex(SUBDIRECTORY_BYTES);
+    auto temporary = root / (name + ".new");
+    std::filesystem::create_directory(temporary);
+    lock_fd = lock_subdirectory(temporary);
+    if (lock_fd < 0)
+      throw std::runtime_error("Failed to lock " + temporary.string());
+    directory = root / name;
+    std::filesystem::rename(temporary, directory);
+  }
+
+  /**
+   * Start a session of an upload of `length` bytes, returned acquired by the
+   * caller. Returns an empty lease if there are too many sessions.
+   */
+  lease create(std::string filename, std::uint64_t length)
+  {
+    std::lock_guard lock(mutex);
+    remove_expired();
+    if (sessions.size() >= config.max_sessions)
+      return {};
+
+    auto id = random_hex(ID_BYTES);
+    auto session = std::make_shared<upload_session>(
+      id, std::move(filename), length, directory / id, algorithm);
+    session->in_use = true;
+    sessions.emplace(id, session);
+    return lease(this, std::move(session));
+  }
+
+  /** Take the session for a request */
+  std::pair<acquire_status, lease> acquire(std::string const& id)
+  {
+    std::lock_guard lock(mutex);
+    remove_expired();
+    auto it = sessions.find(id);
+    if (it == sessions.end())
+      return { acquire_status::not_found, lease() };
+    if (it->second->in_use)
+      return { acquire_status::in_use, lease() };
+    it->second->in_use = true;
+    return { acquire_status::acquired, lease(this, it->second) };
+  }
+
+  /**
+   * Forget the session, e.g. when it is finalized. Its file is removed once
+   * the last lease of it is gone.
+   */
+  void remove(std::string const& id)
+  {
+    std::lock_guard lock(mutex);
+    sessions.erase(id);
+  }
+
+  void write_metrics_json(std::ostream& stream) const
+  {
+    std::lock_guard lock(mutex);
+    stream << "{\"active\": " << sessions.size()
+           << ", \"expired_total\": " << expired << "}";
+  }
+};
+
+#endif // UPLOAD_SESSIONS_HPP
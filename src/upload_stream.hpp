@@ -0,0 +1,202 @@
+#ifndef UPLOAD_STREAM_HPP
+#define UPLOAD_STREAM_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+class upload_failed_error : public std::runtime_error
+{
+public:
+  upload_failed_error()
+    : std::runtime_error("Upload was not received completely")
+  {
+  }
+};
+
+/**
+ * Body of an upload that is still being received. The connection appends the
+ * parts as they arrive, while the image processor can already read them
+ * (blocking until more data comes), e.g. to decode the image during the
+ * transfer. The data is hashed as it is appended, so the hash is ready as soon
+ * as the upload is.
+ *
+ * All the data is kept, and can be taken as a whole when the upload is
+ * finished.
+ */
+class upload_stream
+{
+private:
+  enum class state_t
+  {
+    receiving,
+    finished,
+    failed,
+  };
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  state_t state = state_t::receiving;
+  std::vector<std::uint8_t> data;
+  image_hasher hasher;
+  std::string hash;
+
+  std::vector<std::pair<std::size_t, std::function<void()>>> data_waiters;
+  std::vector<std::function<void()>> finish_waiters;
+
+  /** Remove the waiters that can be called now, the mutex must be locked */
+  std::vector<std::function<void()>> take_ready_waiters()
+  {
+    std::vector<std::function<void()>> result;
+    for (auto it = data_waiters.begin(); it != data_waiters.end();) {
+      if (state == state_t::receiving && data.size() < it->first) {
+        ++it;
+        continue;
+      }
+      result.push_back(std::move(it->second));
+      it = data_waiters.erase(it);
+    }
+    if (state != state_t::receiving) {
+      for (auto& waiter : finish_waiters)
+        result.push_back(std::move(waiter));
+      finish_waiters.clear();
+    }
+    return result;
+  }
+
+  void end(state_t new_state)
+  {
+    std::vector<std::function<void()>> waiters;
+    {
+      std::lock_guard lock(mutex);
+      if (state != state_t::receiving)
+        return;
+      state = new_state;
+      if (new_state == state_t::finished)
+        hash = hasher.finish();
+      waiters = take_ready_waiters();
+    }
+    cv.notify_all();
+    for (auto& waiter : waiters)
+      waiter();
+  }
+
+public:
+  /** expected_size is only used to allocate the buffer, it may be 0 */
+  upload_stream(hash_algorithm algorithm, std::size_t expected_size)
+    : hasher(algorithm)
+  {
+    data.reserve(expected_size);
+  }
+
+  /** Add received data, called by the connection */
+  void append(std::uint8_t const* part, std::size_t size)
+  {
+    std::vector<std::function<void()>> waiters;
+    {
+      std::lock_guard lock(mutex);
+      if (state != state_t::receiving)
+        throw std::logic_error("Appending to an upload that already ended");
+      data.insert(data.end(), part, part + size);
+      hasher.update(part, size);
+      waiters = take_ready_waiters();
+    }
+    cv.notify_all();
+    for (auto& waiter : waiters)
+      waiter();
+  }
+
+  /** Mark the upload as complete, called by the connection */
+  void finish() { end(state_t::finished); }
+
+  /** Mark the upload as broken (e.g. the client disconnected) */
+  void fail() { end(state_t::failed); }
+
+  /**
+   * Copy up to `size` bytes from `offset` into `out`, waiting until at least
+   * one byte is available. Returns 0 at the end of a finished upload, throws
+   * upload_failed_error if the upload failed.
+   */
+  std::size_t read(std::size_t offset, void* out, std::size_t size)
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] {
+      return data.size() > offset || state != state_t::receiving;
+    });
+    if (state == state_t::failed)
+      throw upload_failed_error();
+    if (offset >= data.size())
+      return 0;
+    size = std::min(size, data.size() - offset);
+    std::memcpy(out, data.data() + offset, size);
+    return size;
+  }
+
+  /** Copy of the first (up to) `size` bytes received so far */
+  std::vector<std::uint8_t> peek(std::size_t size) const
+  {
+    std::lock_guard lock(mutex);
+    size = std::min(size, data.size());
+    return { data.begin(), data.begin() + size };
+  }
+
+  /**
+   * Call the callback once at least `size` bytes were received, or the upload
+   * ended. It is called right away if that already happened, otherwise from
+   * the connection's thread, so it should only schedule work.
+   */
+  void when_received(std::size_t size, std::function<void()>&& callback)
+  {
+    {
+      std::lock_guard lock(mutex);
+      if (state == state_t::receiving && data.size() < size) {
+        data_waiters.emplace_back(size, std::move(callback));
+        return;
+      }
+    }
+    callback();
+  }
+
+  /** Like when_received(), called once the upload finished or failed */
+  void when_ended(std::function<void()>&& callback)
+  {
+    {
+      std::lock_guard lock(mutex);
+      if (state == state_t::receiving) {
+        finish_waiters.push_back(std::move(callback));
+        return;
+      }
+    }
+    callback();
+  }
+
+  /** Whether the upload failed, valid after it ended */
+  bool failed() const
+  {
+    std::lock_guard lock(mutex);
+    return state == state_t::failed;
+  }
+
+  /**
+   * Take the whole body and its image_hash() after the upload finished.
+   * Readers must not be used afterwards.
+   */
+  std::pair<std::vector<std::uint8_t>, std::string> take()
+  {
+    std::lock_guard lock(mutex);
+    if (state != state_t::finished)
+      throw std::logic_error("Taking data of an unfinished upload");
+    return { std::move(data), std::move(hash) };
+  }
+};
+
+#endif // UPLOAD_STREAM_HPP
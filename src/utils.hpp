@@ -1,13 +1,20 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <algorithm>
 #include <charconv>
+#include <cstdint>
+#include <random>
 #include <regex>
 #include <string>
 #include <string_view>
+#include <vector>
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
+#include <blake3.h>
+
 #include <unidecode/unidecode.hpp>
 #include <unidecode/utf8_string_iterator.hpp>
 
@@ -114,6 +121,70 @@ string_view_to_int(std::string_view s)
   return result;
 }
 
+/** Like string_view_to_int(), for values which don't fit into an int */
+std::uint64_t
+string_view_to_uint64(std::string_view s)
+{
+  std::uint64_t result;
+  auto err = std::from_chars(s.data(), s.data() + s.size(), result);
+  if (err.ec == std::errc::invalid_argument)
+    throw std::invalid_argument{ "invalid_argument" };
+  if (err.ec == std::errc::result_out_of_range)
+    throw std::out_of_range{ "out_of_range" };
+  return result;
+}
+
+/**
+ * Parse a (byte) value from a number with an optional suffix (k, M, G).
+ * Suffixes are interpreted as powers of 1024.
+ */
+std::uint64_t
+parse_bytes(std::string_view s)
+{
+  std::uint64_t val = 0;
+  for (std::size_t i = 0; i < s.size(); i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      if (i != s.size() - 1)
+        throw std::runtime_error("Failed to parse value: " + std::string(s));
+
+      switch (s[i]) {
+        case 'B':
+          break;
+        case 'k':
+        case 'K':
+          val *= 1024;
+          break;
+        case 'M':
+          val *= 1024 * 1024;
+          break;
+        case 'G':
+          val *= std::uint64_t(1024) * 1024 * 1024;
+          break;
+        default:
+          throw std::runtime_error("Invalid byte value suffix: " +
+                                   std::string(s));
+      }
+      return val;
+    }
+    val = val * 10 + (s[i] - '0');
+  }
+  throw std::runtime_error(
+    "Missing byte value suffix (use 'B' to mark individual bytes): " +
+    std::string(s));
+  return val;
+}
+
+/** Parse a boolean value, either "true" or "false" */
+bool
+parse_bool(std::string_view s)
+{
+  if (s == "true")
+    return true;
+  if (s == "false")
+    return false;
+  throw std::runtime_error("Expected 'true' or 'false': " + std::string(s));
+}
+
 using dimension_t = unsigned long;
 
 /** Perform integer division, rounding up. */
@@ -125,19 +196,172 @@ div_round_up(dimension_t a, dimension_t b)
 
 static const char* hex_chars = "0123456789abcdef";
 
+/** Convert bytes to a lowercase hex string */
+std::string
+bytes_to_hex(std::uint8_t const* data, std::size_t size)
+{
+  std::string result(size * 2, '\0');
+  for (std::size_t i = 0; i < size; i++) {
+    result[2 * i] = hex_chars[data[i] >> 4];
+    result[2 * i + 1] = hex_chars[data[i] & 0xf];
+  }
+  return result;
+}
+
+/** Random lowercase hex string of 2 * bytes characters, e.g. for ids */
+std::string
+random_hex(std::size_t bytes)
+{
+  thread_local std::mt19937_64 random(std::random_device{}());
+  std::vector<std::uint8_t> data(bytes);
+  for (std::size_t i = 0; i < bytes; i += 8) {
+    auto value = random();
+    for (std::size_t j = i; j < std::min(bytes, i + 8); j++)
+      data[j] = value >> (8 * (j - i));
+  }
+  return bytes_to_hex(data.data(), data.size());
+}
+
 /** Return hexdigest of SHA256 hash of the input data */
 std::string
 sha256(std::vector<std::uint8_t> const& data)
 {
-  std::vector<unsigned char> hash(SHA256_DIGEST_LENGTH);
-  SHA256(data.data(), data.size(), hash.data());
-  // bytes to hex
-  std::string result;
-  for (auto c : hash) {
-    result += hex_chars[c >> 4];
-    result += hex_chars[c & 0xf];
+  std::uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256(data.data(), data.size(), hash);
+  return bytes_to_hex(hash, sizeof(hash));
+}
+
+/**
+ * Compute BLAKE3 hash of the data into `out`. Any output length can be
+ * requested, shorter outputs are prefixes of the longer ones.
+ */
+void
+blake3_into(std::vector<std::uint8_t> const& data,
+            std::uint8_t* out,
+            std::size_t out_length)
+{
+  blake3_hasher hasher;
+  blake3_hasher_init(&hasher);
+#ifdef ASSET_SERVER_BLAKE3_TBB
+  // splits large inputs between threads of the TBB pool
+  blake3_hasher_update_tbb(&hasher, data.data(), data.size());
+#else
+  blake3_hasher_update(&hasher, data.data(), data.size());
+#endif
+  blake3_hasher_finalize(&hasher, out, out_length);
+}
+
+/** Return hexdigest of BLAKE3 hash of the input data */
+std::string
+blake3(std::vector<std::uint8_t> const& data)
+{
+  std::uint8_t hash[BLAKE3_OUT_LEN];
+  blake3_into(data, hash, sizeof(hash));
+  return bytes_to_hex(hash, sizeof(hash));
+}
+
+enum class hash_algorithm
+{
+  sha256,
+  blake3,
+};
+
+std::string_view
+hash_algorithm_name(hash_algorithm algorithm)
+{
+  switch (algorithm) {
+    case hash_algorithm::sha256:
+      return "sha256";
+    case hash_algorithm::blake3:
+      return "blake3";
   }
-  return result;
+  throw std::logic_error("Unknown hash algorithm");
+}
+
+hash_algorithm
+parse_hash_algorithm(std::string_view s)
+{
+  if (s == "sha256")
+    return hash_algorithm::sha256;
+  if (s == "blake3")
+    return hash_algorithm::blake3;
+  throw std::runtime_error("Unknown hash algorithm: " + std::string(s));
+}
+
+/** Number of hex characters of the hash used to identify an image */
+static constexpr std::size_t image_hash_length = 16;
+
+/**
+ * Return the identifier of an image: a prefix of the hexdigest of its hash.
+ * Only the bytes needed for the prefix are converted to hex.
+ */
+std::string
+image_hash(hash_algorithm algorithm, std::vector<std::uint8_t> const& data)
+{
+  std::uint8_t hash[image_hash_length / 2];
+  if (algorithm == hash_algorithm::sha256) {
+    std::uint8_t full[SHA256_DIGEST_LENGTH];
+    SHA256(data.data(), data.size(), full);
+    std::copy_n(full, sizeof(hash), hash);
+  } else {
+    blake3_into(data, hash, sizeof(hash));
+  }
+  return bytes_to_hex(hash, sizeof(hash));
 }
 
-#endif // UTILS_HPP
\ No newline at end of file
+/**
+ * Computes the same identifier as image_hash(), but from data that arrives in
+ * several parts
+ */
+class image_hasher
+{
+private:
+  hash_algorithm algorithm;
+  EVP_MD_CTX* sha256_ctx = nullptr;
+  blake3_hasher blake3_ctx;
+
+public:
+  image_hasher(hash_algorithm algorithm)
+    : algorithm(algorithm)
+  {
+    if (algorithm == hash_algorithm::sha256) {
+      sha256_ctx = EVP_MD_CTX_new();
+      if (!sha256_ctx ||
+          !EVP_DigestInit_ex(sha256_ctx, EVP_sha256(), nullptr)) {
+        EVP_MD_CTX_free(sha256_ctx);
+        throw std::runtime_error("Failed to initialize SHA256");
+      }
+    } else {
+      blake3_hasher_init(&blake3_ctx);
+    }
+  }
+
+  image_hasher(image_hasher const&) = delete;
+  image_hasher& operator=(image_hasher const&) = delete;
+
+  ~image_hasher() { EVP_MD_CTX_free(sha256_ctx); }
+
+  void update(std::uint8_t const* data, std::size_t size)
+  {
+    if (algorithm == hash_algorithm::sha256)
+      EVP_DigestUpdate(sha256_ctx, data, size);
+    else
+      blake3_hasher_update(&blake3_ctx, data, size);
+  }
+
+  /** Return the identifier, no more data can be added after this */
+  std::string finish()
+  {
+    std::uint8_t hash[image_hash_length / 2];
+    if (algorithm == hash_algorithm::sha256) {
+      std::uint8_t full[SHA256_DIGEST_LENGTH];
+      EVP_DigestFinal_ex(sha256_ctx, full, nullptr);
+      std::copy_n(full, sizeof(hash), hash);
+    } else {
+      blake3_hasher_finalize(&blake3_ctx, hash, sizeof(hash));
+    }
+    return bytes_to_hex(hash, sizeof(hash));
+  }
+};
+
+#endif // UTILS_HPP
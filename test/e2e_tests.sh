@@ -105,6 +105,11 @@ echo "Testing upload of malformed file"
 dd if=/dev/zero of=./testfile bs=1M count=3 2> /dev/null
 simple_test 400 '"error.invalid_image"' -X POST "http://localhost:8000/api/upload?filename=image1.jpg" -H "Authorization: Bearer testing_token" --data-binary "@$dir/testfile"
 
+# 20000x20000 pixels in 82 bytes, with pixel data of the first row only, so
+# it must be rejected from its header: decoding it would fail as invalid
+echo "Testing upload of image with too many pixels"
+simple_test 413 '"error.image_too_large"' -X POST "http://localhost:8000/api/upload?filename=huge.png" -H "Authorization: Bearer testing_token" --data-binary "@$src/test/testdata/huge_dimensions.png"
+
 [ "$(ls -A "$data_dir")" = "" ] || fail "Data directory is not empty after set of failed requests"
 
 echo "Testing happy path"
@@ -127,4 +132,21 @@ diff "$dir/resp" "$src/test/testdata/image1_response_existing.json" || fail "Res
 find "$data_dir" -type f | sort > "$dir/files.txt"
 diff "$dir/files.txt" "$src/test/testdata/image1_files.txt" || fail "List of generated files does not match"
 
+# width x height of the (first page of a) GIF, from its logical screen
+gif_size() {
+  set -- $(od -An -tu1 -j6 -N4 "$1")
+  echo "$(($1 + 256 * $2))x$(($3 + 256 * $4))"
+}
+
+echo "Testing upload of portrait animated GIF"
+out=$(curl -s -o "$dir/resp" -w "%{http_code}\n" -X POST "http://localhost:8000/api/upload?filename=animated_portrait.gif" -H "Authorization: Bearer testing_token" --data-binary "@$src/test/testdata/animated_portrait.gif")
+[ "$out" = "200" ] || fail "Expected 200, got $out"
+subdir="$(tr < "$dir/resp" , "
+" | grep '"hash"' | cut -d'"' -f4)"
+# the 300x600 frames fit into the square of each variant, like still images
+size=$(gif_size "$data_dir/$subdir/300x300/animated_portrait.gif")
+[ "$size" = "150x300" ] || fail "Expected 150x300 frames of the largest variant, got $size"
+size=$(gif_size "$data_dir/$subdir/100x100/animated_portrait.gif")
+[ "$size" = "50x100" ] || fail "Expected 50x100 frames of the 100px variant, got $size"
+
 echo "=== ALL TESTS PASSED ==="
\ No newline at end of file
@@ -0,0 +1,75 @@
+#!/bin/sh
+
+# End-to-end test of the s3 storage backend against a local MinIO server
+# running in Docker. Requires curl with --aws-sigv4 support (7.75+).
+
+set -e
+
+fail() {
+  echo "FAIL: $1"
+  exit 1
+}
+
+s3() {
+  path="$1"
+  shift
+  curl -s --aws-sigv4 "aws:amz:us-east-1:s3" --user minioadmin:minioadmin \
+    "http://localhost:9000/asset-server-test$path" "$@"
+}
+
+src=$(realpath "$(dirname "$0")/..")
+dir=$(mktemp -d)
+cd "$dir"
+
+minio_name="asset-server-minio-$(tr -dc a-z0-9 < /dev/urandom | head -c 13)"
+echo "Starting MinIO as $minio_name"
+docker run --rm -d --name "$minio_name" -p 9000:9000 \
+  minio/minio server /data > /dev/null
+trap "docker stop $minio_name > /dev/null" EXIT
+
+for _ in $(seq 30); do
+  curl -s -o /dev/null http://localhost:9000/minio/health/live && break
+  sleep 1
+done
+s3 "" -X PUT -o /dev/null || fail "Failed to create the bucket"
+
+echo "Building the project"
+cmake "$src"
+make -j 4 asset-server
+
+echo "Running the server, logs will be in $dir/server_log"
+./asset-server --config-file "$src/test/s3_config.cfg" > server_log 2>&1 &
+pid=$!
+trap "kill $pid; docker stop $minio_name > /dev/null" EXIT
+sleep 1
+ps -p $pid > /dev/null || fail "Server failed to start"
+
+echo "Testing upload of malformed file"
+dd if=/dev/zero of=./testfile bs=1M count=3 2> /dev/null
+out=$(curl -s -o "$dir/resp" -w "%{http_code}\n" -X POST "http://localhost:8000/api/upload?filename=image1.jpg" -H "Authorization: Bearer testing_token" --data-binary "@$dir/testfile")
+[ "$out" = "400" ] || fail "Expected 400, got $out"
+s3 "?list-type=2&prefix=images/" | grep -o "<Key>[^<]*</Key>" | grep -qv "<Key>images/layout</Key>" && fail "Bucket contains objects after a failed request"
+
+echo "Testing happy path"
+out=$(curl -s -o "$dir/resp" -w "%{http_code}\n" -X POST "http://localhost:8000/api/upload?filename=image1.jpg" -H "Authorization: Bearer testing_token" --data-binary "@$src/test/testdata/image1.jpg")
+[ "$out" = "200" ] || fail "Expected 200, got $out"
+diff "$dir/resp" "$src/test/testdata/image1_response.json" || fail "Response does not match expected response"
+
+subdir="$(tr < "$dir/resp" , "
+" | grep '"hash"' | cut -d'"' -f4)"
+s3 "?list-type=2&prefix=images/$subdir/" > "$dir/listing"
+grep -q "<Key>images/$subdir/.manifest</Key>" "$dir/listing" || fail "Manifest not uploaded"
+# the files are stored under the generation of their upload, which the
+# manifest lists as "<path><tab><generation>"
+s3 "/images/$subdir/.manifest" -o "$dir/manifest"
+generation=$(awk -F "\t" '$1 == "image1.jpeg" { print $2 }' "$dir/manifest")
+[ -n "$generation" ] || fail "Original not listed in the manifest"
+s3 "/images/$subdir/$generation/image1.jpeg" -o "$dir/original"
+diff "$dir/original" "$src/test/testdata/image1.jpg" || fail "Server does not preserve uploaded file"
+
+echo "Testing upload of existing file with different name"
+out=$(curl -s -o "$dir/resp" -w "%{http_code}\n" -X POST "http://localhost:8000/api/upload?filename=image3.png" -H "Authorization: Bearer testing_token" --data-binary "@$src/test/testdata/image1.jpg")
+[ "$out" = "200" ] || fail "Expected 200, got $out"
+diff "$dir/resp" "$src/test/testdata/image1_response_existing.json" || fail "Response does not match expected response"
+
+echo "=== ALL TESTS PASSED ==="
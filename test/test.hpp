@@ -50,6 +50,13 @@ universal_tostring<unsigned>(unsigned s)
   return std::to_string(s);
 }
 
+template<>
+std::string
+universal_tostring<unsigned long>(unsigned long s)
+{
+  return std::to_string(s);
+}
+
 template<typename T, typename U>
 void
 assert_eq_(T a, U b, char const* a_str, char const* b_str)